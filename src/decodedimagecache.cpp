@@ -0,0 +1,157 @@
+#include "decodedimagecache.h"
+#include "memorypressuremonitor.h"
+
+#include <functional>
+#include <limits>
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QImageReader>
+#include <QPainter>
+#include <QPointer>
+#include <QRunnable>
+
+class DecodeImageRunnable : public QRunnable
+{
+public:
+    DecodeImageRunnable(DecodedImageCache *cache, const QString &path, const QSize &size, std::function<void(const QImage &)> done)
+        : m_cache(cache)
+        , m_path(path)
+        , m_size(size)
+        , m_done(std::move(done))
+    {
+    }
+
+    void run() override
+    {
+        const QImage image = DecodedImageCache::decode(m_path, m_size);
+        QMetaObject::invokeMethod(m_cache, [done = m_done, image] {
+            done(image);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    DecodedImageCache *m_cache;
+    const QString m_path;
+    const QSize m_size;
+    const std::function<void(const QImage &)> m_done;
+};
+
+DecodedImageCache::DecodedImageCache(QObject *parent)
+    : QObject(parent)
+{
+    m_cache.setMaxCost(256 * 1024);
+    // Decoding is memory bound, a couple of threads keep up with any slideshow
+    m_pool.setMaxThreadCount(2);
+
+    // Images on screen are held by their scene graph nodes, the cache only saves decoding
+    connect(MemoryPressureMonitor::instance(), &MemoryPressureMonitor::stageChanged, this, [this](MemoryPressureMonitor::Stage stage) {
+        if (stage >= MemoryPressureMonitor::DropCaches)
+            m_cache.clear();
+    });
+}
+
+DecodedImageCache::~DecodedImageCache()
+{
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+DecodedImageCache *DecodedImageCache::instance()
+{
+    static QPointer<DecodedImageCache> cache;
+    if (!cache)
+        cache = new DecodedImageCache(QCoreApplication::instance());
+    return cache;
+}
+
+QString DecodedImageCache::cacheKey(const QString &path, const QSize &size)
+{
+    return path + QLatin1Char('@') + QString::number(size.width()) + QLatin1Char('x') + QString::number(size.height());
+}
+
+/*!
+ * Returns the image decoded for \a path and \a size, or a null image when it was
+ * not decoded yet or was evicted.
+ */
+QImage DecodedImageCache::image(const QString &path, const QSize &size) const
+{
+    const QImage *image = m_cache.object(cacheKey(path, size));
+    return image ? *image : QImage();
+}
+
+/*!
+ * Decodes \a path for \a size in the background unless it is cached or already
+ * being decoded, imageDecoded() is emitted once it is done.
+ */
+void DecodedImageCache::prefetch(const QString &path, const QSize &size)
+{
+    const QString key = cacheKey(path, size);
+    if (m_cache.contains(key) || m_pending.contains(key))
+        return;
+
+    m_pending.insert(key);
+    m_pool.start(new DecodeImageRunnable(this, path, size, [this, path, size](const QImage &image) {
+        insert(path, size, image);
+    }));
+}
+
+void DecodedImageCache::insert(const QString &path, const QSize &size, const QImage &image)
+{
+    const QString key = cacheKey(path, size);
+    m_pending.remove(key);
+    if (!image.isNull())
+        m_cache.insert(key, new QImage(image), qMax<qsizetype>(1, image.sizeInBytes() / 1024));
+    Q_EMIT imageDecoded(path, size);
+}
+
+/*!
+ * Bounds the memory of the cached images, 256 MiB by default. Images in use by
+ * an item stay alive until the item lets go of them.
+ */
+void DecodedImageCache::setMaxBytes(qint64 bytes)
+{
+    m_cache.setMaxCost(int(qBound<qint64>(1, bytes / 1024, std::numeric_limits<int>::max())));
+}
+
+qint64 DecodedImageCache::maxBytes() const
+{
+    return qint64(m_cache.maxCost()) * 1024;
+}
+
+/*!
+ * Decodes \a path scaled down to cover \a size, onto black where it has alpha.
+ * This is safe to call from any thread.
+ */
+QImage DecodedImageCache::decode(const QString &path, const QSize &size)
+{
+    QImageReader reader(path);
+    reader.setAutoTransform(true);
+
+    QSize imageSize = reader.size();
+    // Orientations of 90 degrees are applied after decoding, scale the stored size
+    if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+        imageSize.transpose();
+    if (imageSize.isValid() && size.isValid()) {
+        const QSize scaled = imageSize.scaled(size, Qt::KeepAspectRatioByExpanding);
+        if (scaled.width() < imageSize.width()) {
+            const bool transposed = reader.transformation() & QImageIOHandler::TransformationRotate90;
+            reader.setScaledSize(transposed ? scaled.transposed() : scaled);
+        }
+    }
+
+    QImage image = reader.read();
+    if (image.isNull()) {
+        qWarning() << "failed to decode" << path << reader.errorString();
+        return QImage();
+    }
+
+    if (!image.hasAlphaChannel())
+        return image.convertToFormat(QImage::Format_RGB32);
+
+    QImage opaque(image.size(), QImage::Format_RGB32);
+    opaque.fill(Qt::black);
+    QPainter painter(&opaque);
+    painter.drawImage(0, 0, image);
+    return opaque;
+}
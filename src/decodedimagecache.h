@@ -0,0 +1,53 @@
+#ifndef DECODEDIMAGECACHE_H
+#define DECODEDIMAGECACHE_H
+
+#include "wallpaperglobal.h"
+
+#include <QCache>
+#include <QImage>
+#include <QObject>
+#include <QSet>
+#include <QThreadPool>
+
+/*!
+ * \brief Decodes images on a thread pool and keeps them, shared by every item
+ * and screen of the process.
+ *
+ * Images are decoded at the size they are shown at, covering the requested size
+ * with their aspect ratio and never above their own size, so that JPEG and other
+ * formats that can decode scaled down skip most of the work. Results are opaque,
+ * ready to be uploaded without a conversion. The cache is bounded by the bytes
+ * of its images and drops the least recently used ones first.
+ */
+class WSM_WALLPAPER_EXPORT DecodedImageCache : public QObject
+{
+    Q_OBJECT
+public:
+    static DecodedImageCache *instance();
+    ~DecodedImageCache() override;
+
+    QImage image(const QString &path, const QSize &size) const;
+    void prefetch(const QString &path, const QSize &size);
+
+    void setMaxBytes(qint64 bytes);
+    qint64 maxBytes() const;
+
+    static QImage decode(const QString &path, const QSize &size);
+
+Q_SIGNALS:
+    // Also emitted when decoding failed, image() then stays null
+    void imageDecoded(const QString &path, const QSize &size);
+
+private:
+    explicit DecodedImageCache(QObject *parent = nullptr);
+
+    static QString cacheKey(const QString &path, const QSize &size);
+    void insert(const QString &path, const QSize &size, const QImage &image);
+
+    // Costs are in KiB
+    QCache<QString, QImage> m_cache;
+    QSet<QString> m_pending;
+    QThreadPool m_pool;
+};
+
+#endif // DECODEDIMAGECACHE_H
@@ -1,4 +1,5 @@
 #include "eglhelpers.h"
+#include "frametrace.h"
 
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -73,6 +74,7 @@ EGLImage EGLHelpers::createImage(EGLDisplay display, EGLContext context, const D
     attribs << EGL_NONE;
 
     static auto eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    FrameTraceScope trace("eglCreateImage");
     EGLImage ret = eglCreateImageKHR(display, context, EGL_LINUX_DMA_BUF_EXT, (EGLClientBuffer) nullptr, attribs.data());
     if (ret == EGL_NO_IMAGE_KHR) {
         qWarning() << "invalid image" << EGLHelpers::formatEGLError(eglGetError());
@@ -0,0 +1,115 @@
+#include "framescheduler.h"
+#include "frametrace.h"
+#include "pipewiresourceitem.h"
+
+#include <algorithm>
+
+#include <QQuickWindow>
+#include <QVarLengthArray>
+
+FrameScheduler::FrameScheduler(QQuickWindow *window)
+    : QObject(window)
+{
+    // Runs on the render thread while the GUI thread is blocked, item state can be read
+    connect(window, &QQuickWindow::beforeSynchronizing, this, &FrameScheduler::schedule, Qt::DirectConnection);
+    // Ends every frame's timeline in the trace
+    connect(window, &QQuickWindow::frameSwapped, this, [] {
+        FrameTrace::instant("swap");
+    }, Qt::DirectConnection);
+}
+
+/*!
+ * Returns the scheduler shared by all items of \a window, it lives as long as
+ * the window.
+ */
+FrameScheduler *FrameScheduler::forWindow(QQuickWindow *window)
+{
+    if (!window)
+        return nullptr;
+
+    FrameScheduler *scheduler = window->findChild<FrameScheduler *>(QString(), Qt::FindDirectChildrenOnly);
+    if (!scheduler)
+        scheduler = new FrameScheduler(window);
+    return scheduler;
+}
+
+void FrameScheduler::addItem(PipewireSourceItem *item)
+{
+    if (!m_items.contains(item))
+        m_items.append(item);
+}
+
+void FrameScheduler::removeItem(PipewireSourceItem *item)
+{
+    m_items.removeAll(item);
+}
+
+/*!
+ * Sets how many bytes of CPU frames may be uploaded per frame, all items of the
+ * window together.
+ */
+void FrameScheduler::setUploadBudget(qint64 bytes)
+{
+    m_uploadBudget = qMax<qint64>(bytes, 0);
+}
+
+/*!
+ * Sets how many DMA-BUFs may be imported per frame.
+ */
+void FrameScheduler::setImportBudget(int imports)
+{
+    m_importBudget = qMax(imports, 0);
+}
+
+void FrameScheduler::schedule()
+{
+    FrameTraceScope trace("schedule");
+
+    struct Candidate {
+        PipewireSourceItem *item;
+        int priority;
+        bool focus;
+        int deferrals;
+        qreal area;
+        qint64 cost;
+        bool import;
+    };
+
+    QVarLengthArray<Candidate, 16> candidates;
+    for (const QPointer<PipewireSourceItem> &item : qAsConst(m_items)) {
+        bool import = false;
+        if (!item || !item->hasPendingFrame(&import))
+            continue;
+
+        const QRectF visible = item->visibleSceneRect();
+        candidates.append({item, item->priority(), item->hasActiveFocus(), item->consecutiveDeferrals(), visible.width() * visible.height(),
+                           import ? 0 : item->pendingFrameCost(), import});
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        if (a.priority != b.priority)
+            return a.priority > b.priority;
+        if (a.focus != b.focus)
+            return a.focus;
+        // Waiting raises the rank, so that large items can't starve small ones
+        if (a.deferrals != b.deferrals)
+            return a.deferrals > b.deferrals;
+        return a.area > b.area;
+    });
+
+    qint64 uploads = m_uploadBudget;
+    int imports = m_importBudget;
+    for (int i = 0; i < candidates.size(); ++i) {
+        const Candidate &candidate = candidates.at(i);
+        const bool fits = candidate.import ? imports > 0 : candidate.cost <= uploads;
+        if (i > 0 && !fits) {
+            candidate.item->deferFrame();
+            continue;
+        }
+
+        if (candidate.import)
+            --imports;
+        else
+            uploads -= candidate.cost;
+    }
+}
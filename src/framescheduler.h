@@ -0,0 +1,47 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+#include "wallpaperglobal.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QVector>
+
+class QQuickWindow;
+class PipewireSourceItem;
+
+/*!
+ * \brief Spreads frame imports and uploads of all items of a window over vsyncs.
+ *
+ * Before every synchronization the items with a new frame are ranked by their
+ * declared priority, active focus, how often they were deferred in a row and
+ * their visible area. They are served in that order while the per-frame upload
+ * and import budgets last, the others keep their frame for the next vsync. The
+ * first item is always served so that every frame makes progress.
+ */
+class WSM_WALLPAPER_EXPORT FrameScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    static FrameScheduler *forWindow(QQuickWindow *window);
+
+    void addItem(PipewireSourceItem *item);
+    void removeItem(PipewireSourceItem *item);
+
+    void setUploadBudget(qint64 bytes);
+    qint64 uploadBudget() const { return m_uploadBudget; }
+
+    void setImportBudget(int imports);
+    int importBudget() const { return m_importBudget; }
+
+private:
+    explicit FrameScheduler(QQuickWindow *window);
+
+    void schedule();
+
+    QVector<QPointer<PipewireSourceItem>> m_items;
+    qint64 m_uploadBudget = 24 * 1024 * 1024;
+    int m_importBudget = 4;
+};
+
+#endif // FRAMESCHEDULER_H
@@ -0,0 +1,112 @@
+#include "frameslot.h"
+
+#include <utility>
+
+/*!
+ * Makes \a frame the next one the render thread takes. Returns true and sets
+ * \a dropped when this replaces a frame the render thread never took, whose
+ * buffer then has to be released by the caller. The damage of the dropped frame
+ * is added to \a frame's.
+ */
+bool FrameSlot::publish(const PipeWireFrame &frame, PipeWireFrame *dropped)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_frames[m_write] = frame;
+    if (m_fullUpdate) {
+        m_frames[m_write].damage.reset();
+        m_fullUpdate = false;
+    }
+    std::swap(m_write, m_ready);
+
+    const bool replaced = m_hasReady;
+    m_hasReady = true;
+    if (replaced) {
+        PipewireSourceStream::mergeDamage(&m_frames[m_ready], m_frames[m_write]);
+        *dropped = std::exchange(m_frames[m_write], PipeWireFrame{});
+    }
+    return replaced;
+}
+
+/*!
+ * Makes the next published frame damage everything, for when a frame was skipped
+ * without being published.
+ */
+void FrameSlot::requestFullUpdate()
+{
+    QMutexLocker locker(&m_mutex);
+    m_fullUpdate = true;
+}
+
+/*!
+ * Takes the newest published frame, if there is one. \a previous receives the
+ * frame it replaces, which the render thread no longer uses from then on.
+ */
+bool FrameSlot::take(PipeWireFrame *frame, PipeWireFrame *previous)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_hasReady)
+        return false;
+
+    std::swap(m_ready, m_current);
+    m_hasReady = false;
+
+    *frame = m_frames[m_current];
+    *previous = m_hasCurrent ? std::exchange(m_frames[m_ready], PipeWireFrame{}) : PipeWireFrame{};
+    m_hasCurrent = true;
+    return true;
+}
+
+/*!
+ * Forgets the buffer of the frame the render thread took last, for when it was
+ * already handed back, so that it isn't handed back again as a previous frame's.
+ */
+void FrameSlot::releaseCurrentBuffer()
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_hasCurrent)
+        m_frames[m_current].buffer = nullptr;
+}
+
+/*!
+ * Returns whether a published frame waits to be taken, and whether it is a DMA-BUF.
+ */
+bool FrameSlot::hasFrame(bool *dmabuf) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (dmabuf)
+        *dmabuf = m_hasReady && m_frames[m_ready].dmabuf;
+    return m_hasReady;
+}
+
+/*!
+ * Forgets the frames that carry an image, leaving those with a held buffer.
+ */
+void FrameSlot::dropImages()
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_hasReady && m_frames[m_ready].image)
+        m_hasReady = false;
+    for (PipeWireFrame &frame : m_frames) {
+        if (frame.image)
+            frame = {};
+    }
+}
+
+/*!
+ * Forgets every frame, used when the stream that owns their buffers goes away.
+ */
+void FrameSlot::clear()
+{
+    QMutexLocker locker(&m_mutex);
+
+    for (PipeWireFrame &frame : m_frames) {
+        frame = {};
+    }
+    m_hasReady = false;
+    m_hasCurrent = false;
+}
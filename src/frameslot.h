@@ -0,0 +1,39 @@
+#ifndef FRAMESLOT_H
+#define FRAMESLOT_H
+
+#include "wallpaperglobal.h"
+#include "pipewiresourcestream.h"
+
+#include <QMutex>
+
+/*!
+ * \brief Triple buffer handing frames from the GUI thread to the render thread.
+ *
+ * The GUI thread publishes into its write slot and swaps it with the ready slot,
+ * the render thread swaps the ready slot with the one it is using, so neither
+ * side ever waits for the other to finish with a frame. Frames are small, their
+ * pixels stay in the held PipeWire buffer or in a shared image.
+ */
+class WSM_WALLPAPER_EXPORT FrameSlot
+{
+public:
+    bool publish(const PipeWireFrame &frame, PipeWireFrame *dropped);
+    void requestFullUpdate();
+    bool take(PipeWireFrame *frame, PipeWireFrame *previous);
+    void releaseCurrentBuffer();
+    bool hasFrame(bool *dmabuf = nullptr) const;
+    void clear();
+    void dropImages();
+
+private:
+    mutable QMutex m_mutex;
+    PipeWireFrame m_frames[3] = {};
+    int m_write = 0;
+    int m_ready = 1;
+    int m_current = 2;
+    bool m_hasReady = false;
+    bool m_hasCurrent = false;
+    bool m_fullUpdate = false;
+};
+
+#endif // FRAMESLOT_H
@@ -0,0 +1,141 @@
+#include "framesnapshot.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+static const char snapshotMagic[8] = {'W', 'S', 'M', 'S', 'N', 'A', 'P', '1'};
+
+// Padded to 64 bytes so the pixels that follow stay aligned in the mapping
+struct SnapshotHeader {
+    char magic[8];
+    quint32 width;
+    quint32 height;
+    quint32 stride;
+    quint32 format;
+    char reserved[40];
+};
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header must stay 64 bytes");
+
+struct SnapshotMapping {
+    void *data;
+    size_t size;
+};
+
+static void unmapSnapshot(void *info)
+{
+    SnapshotMapping *mapping = static_cast<SnapshotMapping *>(info);
+    munmap(mapping->data, mapping->size);
+    delete mapping;
+}
+
+static bool isSnapshotFormat(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*!
+ * Returns the snapshot file used for \a key, keys are hashed so any string works.
+ */
+QString FrameSnapshot::filePath(const QString &key)
+{
+    const QByteArray hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+        + QStringLiteral("/wsm-wallpaper/snapshots/") + QString::fromLatin1(hash) + QStringLiteral(".snap");
+}
+
+/*!
+ * Maps the snapshot stored for \a key, returns a null image when there is none
+ * or when the file is not a valid snapshot.
+ */
+QImage FrameSnapshot::load(const QString &key)
+{
+    const int fd = open(QFile::encodeName(filePath(key)).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return QImage();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < qint64(sizeof(SnapshotHeader))) {
+        close(fd);
+        return QImage();
+    }
+
+    const size_t size = size_t(st.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        qWarning() << "failed to map snapshot for" << key << strerror(errno);
+        return QImage();
+    }
+
+    const SnapshotHeader *header = static_cast<const SnapshotHeader *>(data);
+    const QImage::Format format = QImage::Format(header->format);
+    const bool valid = memcmp(header->magic, snapshotMagic, sizeof(snapshotMagic)) == 0
+        && header->width > 0 && header->height > 0
+        && header->width <= 16384 && header->height <= 16384
+        && header->stride >= header->width * 4
+        && isSnapshotFormat(format)
+        && sizeof(SnapshotHeader) + quint64(header->stride) * header->height <= size;
+    if (!valid) {
+        qWarning() << "ignoring invalid snapshot for" << key;
+        munmap(data, size);
+        return QImage();
+    }
+
+    const uchar *pixels = static_cast<const uchar *>(data) + sizeof(SnapshotHeader);
+    return QImage(pixels, int(header->width), int(header->height), int(header->stride), format,
+                  unmapSnapshot, new SnapshotMapping{data, size});
+}
+
+/*!
+ * Stores \a image as the snapshot of \a key, replacing the previous one atomically.
+ */
+bool FrameSnapshot::save(const QString &key, const QImage &image)
+{
+    if (image.isNull())
+        return false;
+
+    const QImage converted = isSnapshotFormat(image.format()) ? image : image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    const QString path = filePath(key);
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.width = quint32(converted.width());
+    header.height = quint32(converted.height());
+    header.stride = quint32(converted.width() * 4);
+    header.format = quint32(converted.format());
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "failed to write snapshot" << path << file.errorString();
+        return false;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (int y = 0; y < converted.height(); ++y) {
+        file.write(reinterpret_cast<const char *>(converted.constScanLine(y)), header.stride);
+    }
+    return file.commit();
+}
@@ -0,0 +1,25 @@
+#ifndef FRAMESNAPSHOT_H
+#define FRAMESNAPSHOT_H
+
+#include "wallpaperglobal.h"
+
+#include <QImage>
+#include <QString>
+
+/*!
+ * \brief Persists a downscaled last frame so a wallpaper can be shown before its
+ * stream is connected.
+ *
+ * A snapshot is an uncompressed 32 bit image behind a small header, stored per
+ * key in the cache directory. Loading maps the file instead of decoding it, the
+ * returned image uses the mapped pages directly and unmaps them when released.
+ */
+class WSM_WALLPAPER_EXPORT FrameSnapshot
+{
+public:
+    static QImage load(const QString &key);
+    static bool save(const QString &key, const QImage &image);
+    static QString filePath(const QString &key);
+};
+
+#endif // FRAMESNAPSHOT_H
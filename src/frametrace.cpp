@@ -0,0 +1,230 @@
+#include "frametrace.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QVector>
+
+std::atomic<bool> FrameTrace::s_enabled{false};
+
+static const int ringSize = 4096;
+
+struct TraceEvent {
+    const char *name;
+    qint64 begin;
+    // -1 marks an instant event
+    qint64 duration;
+    uint nodeId;
+    int seq;
+    qint64 pts;
+};
+
+/*!
+ * Events of one thread. Only that thread writes, readers may see an event that
+ * is being overwritten, which is acceptable for a diagnostic trace.
+ */
+struct TraceRing {
+    qint64 tid = 0;
+    QByteArray threadName;
+    std::atomic<quint64> head{0};
+    TraceEvent events[ringSize];
+};
+
+// Rings outlive their threads so that a dump still shows what they did
+static QMutex ringsMutex;
+static QVector<TraceRing *> rings;
+
+static TraceRing *threadRing()
+{
+    static thread_local TraceRing *ring = nullptr;
+    if (Q_UNLIKELY(!ring)) {
+        ring = new TraceRing;
+        ring->tid = syscall(SYS_gettid);
+        QThread *thread = QThread::currentThread();
+        if (QCoreApplication::instance() && thread == QCoreApplication::instance()->thread())
+            ring->threadName = "main";
+        else if (!thread->objectName().isEmpty())
+            ring->threadName = thread->objectName().toUtf8();
+        else
+            ring->threadName = QByteArray("thread ") + QByteArray::number(ring->tid);
+
+        QMutexLocker locker(&ringsMutex);
+        rings.append(ring);
+    }
+    return ring;
+}
+
+static void append(const TraceEvent &event)
+{
+    TraceRing *ring = threadRing();
+    const quint64 head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head % ringSize] = event;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+static void dumpToEnvironmentPath()
+{
+    FrameTrace::dump(QString::fromLocal8Bit(qgetenv("WSM_WALLPAPER_TRACE")));
+}
+
+static void initFromEnvironment()
+{
+    if (qEnvironmentVariableIsEmpty("WSM_WALLPAPER_TRACE"))
+        return;
+
+    FrameTrace::setEnabled(true);
+    qAddPostRoutine(dumpToEnvironmentPath);
+}
+Q_CONSTRUCTOR_FUNCTION(initFromEnvironment)
+
+// SIGUSR1 wakes the event loop through this pipe, the dump can't run in the handler
+static int dumpPipe[2] = {-1, -1};
+
+static void requestDump(int)
+{
+    const char byte = 0;
+    ssize_t written = write(dumpPipe[1], &byte, 1);
+    Q_UNUSED(written)
+}
+
+static void installDumpSignal()
+{
+    if (qEnvironmentVariableIsEmpty("WSM_WALLPAPER_TRACE") || dumpPipe[0] >= 0)
+        return;
+    if (pipe2(dumpPipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        qWarning() << "failed to create the frame trace dump pipe" << strerror(errno);
+        return;
+    }
+
+    auto notifier = new QSocketNotifier(dumpPipe[0], QSocketNotifier::Read, QCoreApplication::instance());
+    QObject::connect(notifier, &QSocketNotifier::activated, [] {
+        char byte;
+        while (read(dumpPipe[0], &byte, 1) > 0) {
+        }
+        dumpToEnvironmentPath();
+    });
+
+    struct sigaction action = {};
+    action.sa_handler = requestDump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+}
+Q_COREAPP_STARTUP_FUNCTION(installDumpSignal)
+
+void FrameTrace::setEnabled(bool enabled)
+{
+    s_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+/*!
+ * Returns CLOCK_MONOTONIC in nanoseconds, the clock PipeWire timestamps use.
+ */
+qint64 FrameTrace::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * Records a stage that ran from \a begin to \a end, \a name must be a string
+ * literal as only the pointer is kept.
+ */
+void FrameTrace::record(const char *name, qint64 begin, qint64 end, uint nodeId, qint64 pts, int seq)
+{
+    if (!isEnabled())
+        return;
+
+    append({name, begin, end - begin, nodeId, seq, pts});
+}
+
+/*!
+ * Records a point in time such as a buffer swap.
+ */
+void FrameTrace::instant(const char *name, uint nodeId, qint64 pts, int seq)
+{
+    if (!isEnabled())
+        return;
+
+    append({name, now(), -1, nodeId, seq, pts});
+}
+
+/*!
+ * Returns the recorded events in the Chrome trace event format, timestamps are
+ * in microseconds of CLOCK_MONOTONIC.
+ */
+QByteArray FrameTrace::toChromeJson()
+{
+    const QByteArray pid = QByteArray::number(qint64(getpid()));
+    QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&] {
+        if (!first)
+            json += ',';
+        first = false;
+    };
+
+    QMutexLocker locker(&ringsMutex);
+    for (TraceRing *ring : qAsConst(rings)) {
+        const QByteArray tid = QByteArray::number(ring->tid);
+        separator();
+        json += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + pid + ",\"tid\":" + tid
+            + ",\"args\":{\"name\":\"" + ring->threadName + "\"}}";
+
+        const quint64 head = ring->head.load(std::memory_order_acquire);
+        const quint64 begin = head > quint64(ringSize) ? head - ringSize : 0;
+        for (quint64 i = begin; i < head; ++i) {
+            const TraceEvent &event = ring->events[i % ringSize];
+            separator();
+            json += "{\"name\":\"" + QByteArray(event.name) + "\",\"cat\":\"frame\",\"pid\":" + pid + ",\"tid\":" + tid
+                + ",\"ts\":" + QByteArray::number(event.begin / 1000.0, 'f', 3);
+            if (event.duration < 0)
+                json += ",\"ph\":\"i\",\"s\":\"t\"";
+            else
+                json += ",\"ph\":\"X\",\"dur\":" + QByteArray::number(event.duration / 1000.0, 'f', 3);
+            json += ",\"args\":{\"node\":" + QByteArray::number(event.nodeId) + ",\"pts\":" + QByteArray::number(event.pts)
+                + ",\"seq\":" + QByteArray::number(event.seq) + "}}";
+        }
+    }
+    json += "]}";
+    return json;
+}
+
+/*!
+ * Writes the trace to \a path as Chrome trace event JSON.
+ */
+bool FrameTrace::dump(const QString &path)
+{
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "failed to write frame trace" << path << file.errorString();
+        return false;
+    }
+    file.write(toChromeJson());
+    return file.commit();
+}
+
+/*!
+ * Forgets the recorded events. An event a thread records at the same time may
+ * survive, new events keep going into the same rings.
+ */
+void FrameTrace::clear()
+{
+    QMutexLocker locker(&ringsMutex);
+    for (TraceRing *ring : qAsConst(rings)) {
+        ring->head.store(0, std::memory_order_relaxed);
+    }
+}
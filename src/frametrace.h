@@ -0,0 +1,78 @@
+#ifndef FRAMETRACE_H
+#define FRAMETRACE_H
+
+#include "wallpaperglobal.h"
+
+#include <atomic>
+
+#include <QByteArray>
+#include <QString>
+
+/*!
+ * \brief Records the stages of every frame into per-thread rings, for a timeline
+ * of the path from PipeWire to the screen.
+ *
+ * Each thread writes its own fixed size ring without locks, the oldest events are
+ * overwritten. Events carry the stream node id and the frame's PTS and sequence
+ * number so that a single frame can be followed across threads. The rings are
+ * exported as Chrome trace event JSON, which chrome://tracing and the Perfetto
+ * UI both open. Setting WSM_WALLPAPER_TRACE to a file path enables tracing at
+ * startup and writes the trace there when the application exits, and whenever
+ * the process receives SIGUSR1. While tracing is disabled a tracepoint costs one
+ * branch on a relaxed atomic load.
+ */
+class WSM_WALLPAPER_EXPORT FrameTrace
+{
+public:
+    static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+    static void setEnabled(bool enabled);
+
+    static qint64 now();
+    static void record(const char *name, qint64 begin, qint64 end, uint nodeId = 0, qint64 pts = 0, int seq = 0);
+    static void instant(const char *name, uint nodeId = 0, qint64 pts = 0, int seq = 0);
+
+    static QByteArray toChromeJson();
+    static bool dump(const QString &path);
+    static void clear();
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+/*!
+ * \brief Records the time until it goes out of scope as one trace event.
+ */
+class FrameTraceScope
+{
+public:
+    explicit FrameTraceScope(const char *name, uint nodeId = 0)
+        : m_name(name)
+        , m_nodeId(nodeId)
+        , m_begin(FrameTrace::isEnabled() ? FrameTrace::now() : 0)
+    {
+    }
+
+    ~FrameTraceScope()
+    {
+        if (Q_UNLIKELY(m_begin))
+            FrameTrace::record(m_name, m_begin, FrameTrace::now(), m_nodeId, m_pts, m_seq);
+    }
+
+    // Annotates the event once the frame is known
+    void setFrame(qint64 pts, int seq)
+    {
+        m_pts = pts;
+        m_seq = seq;
+    }
+
+private:
+    const char *const m_name;
+    const uint m_nodeId;
+    const qint64 m_begin;
+    qint64 m_pts = 0;
+    int m_seq = 0;
+
+    Q_DISABLE_COPY(FrameTraceScope)
+};
+
+#endif // FRAMETRACE_H
@@ -0,0 +1,108 @@
+#include "gltexturebackend.h"
+#include "eglhelpers.h"
+#include "frametrace.h"
+
+#include <EGL/eglext.h>
+
+#include <QGuiApplication>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QSGTexture>
+#include <qpa/qplatformnativeinterface.h>
+
+GLTextureBackend::GLTextureBackend()
+    : TextureBackend(QSGRendererInterface::OpenGL)
+{
+    // Created from updatePaintNode, the scene graph context is current
+    if (QOpenGLContext *context = QOpenGLContext::currentContext()) {
+        GLint maxTextureSize = 0;
+        context->functions()->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+        if (maxTextureSize > 0)
+            setMaxTextureSize(maxTextureSize);
+    }
+}
+
+GLTextureBackend::~GLTextureBackend()
+{
+    if (m_image != EGL_NO_IMAGE_KHR) {
+        eglDestroyImage(eglGetCurrentDisplay(), m_image);
+    }
+}
+
+bool GLTextureBackend::supportsDmaBuf() const
+{
+    return true;
+}
+
+QSGTexture *GLTextureBackend::importDmaBuf(QQuickWindow *window, const DmaBufAttributes &attribs, spa_video_format format, const QSize &size)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    const auto openglContext = window->openglContext();
+#else
+    const auto openglContext = static_cast<QOpenGLContext *>(window->rendererInterface()->getResource(window, QSGRendererInterface::OpenGLContextResource));
+#endif
+    if (!openglContext) {
+        qWarning() << "need a window and a context" << window;
+        return nullptr;
+    }
+
+    const EGLDisplay display = static_cast<EGLDisplay>(QGuiApplication::platformNativeInterface()->nativeResourceForIntegration("egldisplay"));
+    if (m_image) {
+        eglDestroyImage(display, m_image);
+    }
+    const EGLContext context = static_cast<EGLContext>(QGuiApplication::platformNativeInterface()->nativeResourceForIntegration("eglcontext"));
+    m_image = EGLHelpers::createImage(display, context, attribs, PipewireSourceStream::spaVideoFormatToDrmFormat(format), size);
+    if (m_image == EGL_NO_IMAGE_KHR) {
+        return nullptr;
+    }
+    if (!m_texture) {
+        m_texture.reset(new QOpenGLTexture(QOpenGLTexture::Target2D));
+        bool created = m_texture->create();
+        Q_ASSERT(created);
+    }
+
+    m_texture->bind();
+
+    {
+        FrameTraceScope trace("eglImageTargetTexture");
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)m_image);
+    }
+
+    m_texture->setWrapMode(QOpenGLTexture::ClampToEdge);
+    m_texture->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+    m_texture->release();
+    m_texture->setSize(size.width(), size.height());
+
+    QQuickWindow::CreateTextureOption textureOption =
+            format == SPA_VIDEO_FORMAT_ARGB || format == SPA_VIDEO_FORMAT_BGRA ? QQuickWindow::TextureHasAlphaChannel : QQuickWindow::TextureIsOpaque;
+    return wrapTexture(window, m_texture->textureId(), size, textureOption);
+}
+
+QSGTexture *GLTextureBackend::uploadImage(QQuickWindow *window, const QImage &image)
+{
+    // Called from updatePaintNode, so the scene graph context is current here
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (PboTextureUploader::isSupported(context)) {
+        if (!m_uploader)
+            m_uploader.reset(new PboTextureUploader);
+
+        if (m_uploader->upload(image))
+            return wrapTexture(window, m_uploader->textureId(), m_uploader->size(), QQuickWindow::TextureIsOpaque);
+    }
+
+    return TextureBackend::uploadImage(window, image);
+}
+
+QExplicitlySharedDataPointer<PboFrameWriter> GLTextureBackend::frameWriter() const
+{
+    return m_uploader && m_uploader->isPersistent() ? m_uploader->writer() : QExplicitlySharedDataPointer<PboFrameWriter>();
+}
+
+QSGTexture *GLTextureBackend::wrapTexture(QQuickWindow *window, uint textureId, const QSize &size, QQuickWindow::CreateTextureOption textureOption)
+{
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    return window->createTextureFromNativeObject(QQuickWindow::NativeObjectTexture, &textureId, 0 /*a vulkan thing?*/, size, textureOption);
+#else
+    return QNativeInterface::QSGOpenGLTexture::fromNative(textureId, window, size, textureOption);
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef GLTEXTUREBACKEND_H
+#define GLTEXTUREBACKEND_H
+
+#include "texturebackend.h"
+#include "pbotextureuploader.h"
+
+#include <EGL/egl.h>
+
+#include <QOpenGLTexture>
+#include <QScopedPointer>
+
+/*!
+ * \brief OpenGL texture backend, imports DMA-BUFs as EGLImages and uploads CPU
+ * frames through a PboTextureUploader.
+ */
+class WSM_WALLPAPER_EXPORT GLTextureBackend : public TextureBackend
+{
+public:
+    GLTextureBackend();
+    ~GLTextureBackend() override;
+
+    bool supportsDmaBuf() const override;
+    QSGTexture *importDmaBuf(QQuickWindow *window, const DmaBufAttributes &attribs, spa_video_format format, const QSize &size) override;
+    QSGTexture *uploadImage(QQuickWindow *window, const QImage &image) override;
+    QExplicitlySharedDataPointer<PboFrameWriter> frameWriter() const override;
+
+    static QSGTexture *wrapTexture(QQuickWindow *window, uint textureId, const QSize &size, QQuickWindow::CreateTextureOption textureOption);
+
+private:
+    EGLImage m_image = nullptr;
+    QScopedPointer<QOpenGLTexture> m_texture;
+    QScopedPointer<PboTextureUploader> m_uploader;
+};
+
+#endif // GLTEXTUREBACKEND_H
@@ -0,0 +1,135 @@
+#include "imagescaler.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Adds a row of bytes to a row of 32 bit sums, this is where nearly all the time goes
+static void accumulateRow(const uchar *src, quint32 *acc, int count)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i *sums = reinterpret_cast<__m128i *>(acc + i);
+        _mm_storeu_si128(sums, _mm_add_epi32(_mm_loadu_si128(sums), _mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_si128(sums + 1, _mm_add_epi32(_mm_loadu_si128(sums + 1), _mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_si128(sums + 2, _mm_add_epi32(_mm_loadu_si128(sums + 2), _mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_si128(sums + 3, _mm_add_epi32(_mm_loadu_si128(sums + 3), _mm_unpackhi_epi16(high, zero)));
+    }
+#endif
+    for (; i < count; ++i) {
+        acc[i] += src[i];
+    }
+}
+
+/*!
+ * Returns the largest size fitting in \a bounds with the aspect ratio of \a source,
+ * or \a source itself when it already fits.
+ */
+QSize ImageScaler::targetSize(const QSize &source, const QSize &bounds)
+{
+    if (!bounds.isValid() || bounds.isEmpty())
+        return source;
+
+    if (source.width() <= bounds.width() && source.height() <= bounds.height())
+        return source;
+
+    const QSize scaled = source.scaled(bounds, Qt::KeepAspectRatio);
+    return scaled.expandedTo(QSize(1, 1));
+}
+
+/*!
+ * Maps a damaged rectangle of the source to the destination pixels it influences.
+ */
+QRect ImageScaler::mapToTarget(const QRect &sourceRect, const QSize &srcSize, const QSize &dstSize)
+{
+    if (srcSize.isEmpty())
+        return QRect();
+
+    const int x0 = int(qint64(sourceRect.left()) * dstSize.width() / srcSize.width());
+    const int y0 = int(qint64(sourceRect.top()) * dstSize.height() / srcSize.height());
+    const int x1 = int((qint64(sourceRect.right() + 1) * dstSize.width() + srcSize.width() - 1) / srcSize.width());
+    const int y1 = int((qint64(sourceRect.bottom() + 1) * dstSize.height() + srcSize.height() - 1) / srcSize.height());
+
+    // One pixel of margin covers the rounding of the box boundaries
+    return QRect(QPoint(x0 - 1, y0 - 1), QPoint(x1, y1)).intersected(QRect(QPoint(0, 0), dstSize));
+}
+
+/*!
+ * Box filters \a src into \a dst, only the \a dstRect part of the destination is
+ * written so that a damaged frame only costs what changed.
+ */
+void ImageScaler::scale(const uchar *src, int srcStride, const QSize &srcSize,
+                        uchar *dst, int dstStride, const QSize &dstSize,
+                        int bytesPerPixel, const QRect &dstRect)
+{
+    const QRect rect = dstRect.intersected(QRect(QPoint(0, 0), dstSize));
+    if (rect.isEmpty() || srcSize.isEmpty())
+        return;
+
+    prepare(srcSize, dstSize, bytesPerPixel);
+
+    const int srcBegin = m_columnStart[rect.left()] * bytesPerPixel;
+    const int srcEnd = m_columnStart[rect.right() + 1] * bytesPerPixel;
+    quint32 *acc = m_accumulator.data();
+
+    for (int dy = rect.top(); dy <= rect.bottom(); ++dy) {
+        const int y0 = m_rowStart[dy];
+        const int y1 = m_rowStart[dy + 1];
+
+        memset(acc + srcBegin, 0, (srcEnd - srcBegin) * sizeof(quint32));
+        for (int y = y0; y < y1; ++y) {
+            accumulateRow(src + qsizetype(y) * srcStride + srcBegin, acc + srcBegin, srcEnd - srcBegin);
+        }
+
+        uchar *out = dst + qsizetype(dy) * dstStride;
+        for (int dx = rect.left(); dx <= rect.right(); ++dx) {
+            const int x0 = m_columnStart[dx];
+            const int x1 = m_columnStart[dx + 1];
+            const quint64 count = quint64(y1 - y0) * (x1 - x0);
+            if (!count)
+                continue;
+
+            for (int c = 0; c < bytesPerPixel; ++c) {
+                quint64 sum = 0;
+                for (int x = x0; x < x1; ++x) {
+                    sum += acc[x * bytesPerPixel + c];
+                }
+                out[dx * bytesPerPixel + c] = uchar((sum + count / 2) / count);
+            }
+        }
+    }
+}
+
+void ImageScaler::prepare(const QSize &srcSize, const QSize &dstSize, int bytesPerPixel)
+{
+    if (m_srcSize == srcSize && m_dstSize == dstSize && m_bytesPerPixel == bytesPerPixel)
+        return;
+
+    m_srcSize = srcSize;
+    m_dstSize = dstSize;
+    m_bytesPerPixel = bytesPerPixel;
+
+    // Destination pixels never cover an empty box, even when a dimension is not reduced
+    m_columnStart.resize(dstSize.width() + 1);
+    for (int i = 0; i <= dstSize.width(); ++i) {
+        m_columnStart[i] = qMin(int(qint64(i) * srcSize.width() / dstSize.width()), srcSize.width());
+        if (i > 0 && m_columnStart[i] <= m_columnStart[i - 1])
+            m_columnStart[i] = qMin(m_columnStart[i - 1] + 1, srcSize.width());
+    }
+
+    m_rowStart.resize(dstSize.height() + 1);
+    for (int i = 0; i <= dstSize.height(); ++i) {
+        m_rowStart[i] = qMin(int(qint64(i) * srcSize.height() / dstSize.height()), srcSize.height());
+        if (i > 0 && m_rowStart[i] <= m_rowStart[i - 1])
+            m_rowStart[i] = qMin(m_rowStart[i - 1] + 1, srcSize.height());
+    }
+
+    m_accumulator.resize(srcSize.width() * bytesPerPixel);
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGESCALER_H
+#define IMAGESCALER_H
+
+#include "wallpaperglobal.h"
+
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+/*!
+ * \brief Box filter used to shrink CPU frames before they are uploaded.
+ *
+ * Every destination pixel is the average of the source pixels it covers, which
+ * gives a correct minification for any ratio. The filter only looks at bytes and
+ * averages every channel the same way, so it works for all 8 bit per channel
+ * packed formats the stream negotiates, whatever their channel order.
+ */
+class WSM_WALLPAPER_EXPORT ImageScaler
+{
+public:
+    static QSize targetSize(const QSize &source, const QSize &bounds);
+
+    void scale(const uchar *src, int srcStride, const QSize &srcSize,
+               uchar *dst, int dstStride, const QSize &dstSize,
+               int bytesPerPixel, const QRect &dstRect);
+
+    static QRect mapToTarget(const QRect &sourceRect, const QSize &srcSize, const QSize &dstSize);
+
+private:
+    void prepare(const QSize &srcSize, const QSize &dstSize, int bytesPerPixel);
+
+    QSize m_srcSize;
+    QSize m_dstSize;
+    int m_bytesPerPixel = 0;
+
+    // First source column/row of every destination column/row, plus an end marker
+    QVector<int> m_columnStart;
+    QVector<int> m_rowStart;
+    QVector<quint32> m_accumulator;
+};
+
+#endif // IMAGESCALER_H
@@ -0,0 +1,135 @@
+#include "memfdbufferpool.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <QDebug>
+#include <QFile>
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+/*!
+ * Returns the default huge page size, which is what MFD_HUGETLB allocates.
+ */
+static size_t hugePageSize()
+{
+    static const size_t size = [] {
+        QFile meminfo(QStringLiteral("/proc/meminfo"));
+        if (meminfo.open(QIODevice::ReadOnly)) {
+            const QList<QByteArray> lines = meminfo.readAll().split('\n');
+            for (const QByteArray &line : lines) {
+                if (line.startsWith("Hugepagesize:"))
+                    return size_t(line.mid(13).trimmed().split(' ').value(0).toULongLong()) * 1024;
+            }
+        }
+        return size_t(2 * 1024 * 1024);
+    }();
+    return size;
+}
+
+static size_t roundUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+MemFdBufferPool::~MemFdBufferPool()
+{
+    clear();
+}
+
+/*!
+ * Returns a block of at least \a size bytes, an idle one of that size if there
+ * is one. Idle blocks of other sizes are kept, a buffer of their size may still
+ * be added. The block is invalid when no memory could be allocated.
+ */
+MemFdBufferPool::Block MemFdBufferPool::acquire(size_t size)
+{
+    static const size_t pageSize = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < m_idle.size(); ++i) {
+        const Block &block = m_idle.at(i);
+        if (block.size == roundUp(size, block.hugePages ? hugePageSize() : pageSize))
+            return m_idle.takeAt(i);
+    }
+
+    return allocate(size);
+}
+
+/*!
+ * Takes \a block back, it stays mapped for the next acquire().
+ */
+void MemFdBufferPool::release(const Block &block)
+{
+    if (block.isValid())
+        m_idle.append(block);
+}
+
+/*!
+ * Frees the idle blocks, called when the frame format or size changes.
+ */
+void MemFdBufferPool::clear()
+{
+    for (const Block &block : qAsConst(m_idle))
+        destroy(block);
+    m_idle.clear();
+}
+
+MemFdBufferPool::Block MemFdBufferPool::allocate(size_t size)
+{
+    Block block;
+    const unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+
+    // Explicit huge pages only exist when the administrator reserved some, mmap fails otherwise
+    if (size >= hugePageSize()) {
+        block.size = roundUp(size, hugePageSize());
+        block.fd = memfd_create("wsm-wallpaper-buffer", flags | MFD_HUGETLB);
+        if (block.fd >= 0 && ftruncate(block.fd, block.size) == 0) {
+            void *map = mmap(nullptr, block.size, PROT_READ | PROT_WRITE, MAP_SHARED, block.fd, 0);
+            if (map != MAP_FAILED) {
+                block.data = static_cast<uchar *>(map);
+                block.hugePages = true;
+            }
+        }
+        if (!block.hugePages && block.fd >= 0) {
+            close(block.fd);
+            block.fd = -1;
+        }
+    }
+
+    if (!block.hugePages) {
+        block.size = roundUp(size, sysconf(_SC_PAGESIZE));
+        block.fd = memfd_create("wsm-wallpaper-buffer", flags);
+        if (block.fd < 0 || ftruncate(block.fd, block.size) != 0) {
+            qWarning() << "failed to allocate a buffer of" << size << "bytes:" << strerror(errno);
+            destroy(block);
+            return Block();
+        }
+        void *map = mmap(nullptr, block.size, PROT_READ | PROT_WRITE, MAP_SHARED, block.fd, 0);
+        if (map == MAP_FAILED) {
+            qWarning() << "failed to map a buffer of" << size << "bytes:" << strerror(errno);
+            destroy(block);
+            return Block();
+        }
+        block.data = static_cast<uchar *>(map);
+        // Honored for shared memory when shmem_enabled allows it
+        if (block.size >= hugePageSize())
+            madvise(map, block.size, MADV_HUGEPAGE);
+    }
+
+    // The producer can't resize what we map
+    fcntl(block.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    return block;
+}
+
+void MemFdBufferPool::destroy(const Block &block)
+{
+    if (block.data)
+        munmap(block.data, block.size);
+    if (block.fd >= 0)
+        close(block.fd);
+}
@@ -0,0 +1,48 @@
+#ifndef MEMFDBUFFERPOOL_H
+#define MEMFDBUFFERPOOL_H
+
+#include "wallpaperglobal.h"
+
+#include <QVector>
+
+/*!
+ * \brief Sealed memfd blocks a stream hands to its producer as buffers.
+ *
+ * Blocks are backed by explicit huge pages when the system has some reserved,
+ * otherwise transparent huge pages are requested for the mapping, which reduces
+ * TLB misses while frames are scaled and uploaded. Released blocks stay mapped
+ * and are handed out again for the same size, so a renegotiation that keeps the
+ * frame size and format doesn't allocate; idle blocks are only freed by clear()
+ * once the format or size changes.
+ */
+class WSM_WALLPAPER_EXPORT MemFdBufferPool
+{
+public:
+    struct Block {
+        int fd = -1;
+        uchar *data = nullptr;
+        size_t size = 0;
+        bool hugePages = false;
+
+        bool isValid() const { return fd >= 0; }
+    };
+
+    MemFdBufferPool() = default;
+    ~MemFdBufferPool();
+
+    Block acquire(size_t size);
+    void release(const Block &block);
+    void clear();
+
+    int idleCount() const { return m_idle.size(); }
+
+private:
+    static Block allocate(size_t size);
+    static void destroy(const Block &block);
+
+    QVector<Block> m_idle;
+
+    Q_DISABLE_COPY(MemFdBufferPool)
+};
+
+#endif // MEMFDBUFFERPOOL_H
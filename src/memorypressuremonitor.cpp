@@ -0,0 +1,176 @@
+#include "memorypressuremonitor.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFile>
+#include <QSocketNotifier>
+
+// Unprivileged triggers need a window that is a multiple of two seconds
+static const int pollInterval = 2000;
+static const int calmPollsToRelease = 3;
+
+struct StageThreshold {
+    MemoryPressureMonitor::Stage stage;
+    // PSI trigger raising the stage, stall time in a two second window
+    const char *trigger;
+    // Which average releases the stage, and below which percentage
+    bool full;
+    double release;
+};
+
+static const StageThreshold thresholds[] = {
+    {MemoryPressureMonitor::DropCaches, "some 100000 2000000", false, 2},
+    {MemoryPressureMonitor::ReduceBuffers, "some 300000 2000000", false, 8},
+    {MemoryPressureMonitor::ReduceFrameRate, "full 200000 2000000", true, 5},
+    {MemoryPressureMonitor::PauseHidden, "full 600000 2000000", true, 15},
+};
+
+/*!
+ * Returns the memory.pressure file of the cgroup v2 the process is in, empty
+ * when there is none.
+ */
+static QString cgroupPressurePath()
+{
+    QFile cgroups(QStringLiteral("/proc/self/cgroup"));
+    if (!cgroups.open(QIODevice::ReadOnly))
+        return QString();
+
+    const QList<QByteArray> lines = cgroups.readAll().split('\n');
+    for (const QByteArray &line : lines) {
+        if (!line.startsWith("0::"))
+            continue;
+        const QString path = QStringLiteral("/sys/fs/cgroup") + QString::fromUtf8(line.mid(3)) + QStringLiteral("/memory.pressure");
+        if (QFile::exists(path))
+            return path;
+    }
+    return QString();
+}
+
+/*!
+ * Reads the avg10 percentage of the "some" or "full" line of a pressure file.
+ */
+static double readAverage(const QString &path, bool full)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+
+    const QByteArray prefix = full ? "full " : "some ";
+    const QList<QByteArray> lines = file.readAll().split('\n');
+    for (const QByteArray &line : lines) {
+        if (!line.startsWith(prefix))
+            continue;
+        const int begin = line.indexOf("avg10=");
+        if (begin < 0)
+            return 0;
+        const int end = line.indexOf(' ', begin);
+        return line.mid(begin + 6, end < 0 ? -1 : end - begin - 6).toDouble();
+    }
+    return 0;
+}
+
+MemoryPressureMonitor::MemoryPressureMonitor(QObject *parent)
+    : QObject(parent)
+{
+    m_pollTimer.setInterval(pollInterval);
+    connect(&m_pollTimer, &QTimer::timeout, this, &MemoryPressureMonitor::poll);
+
+    watch(QStringLiteral("/proc/pressure/memory"));
+    const QString cgroup = cgroupPressurePath();
+    if (!cgroup.isEmpty())
+        watch(cgroup);
+
+    if (m_triggers.isEmpty())
+        qDebug() << "no memory pressure information, streams won't degrade under pressure";
+}
+
+MemoryPressureMonitor::~MemoryPressureMonitor()
+{
+    for (const Trigger &trigger : qAsConst(m_triggers)) {
+        delete trigger.notifier;
+        close(trigger.fd);
+    }
+}
+
+MemoryPressureMonitor *MemoryPressureMonitor::instance()
+{
+    static MemoryPressureMonitor *monitor = new MemoryPressureMonitor(qApp);
+    return monitor;
+}
+
+/*!
+ * Registers one trigger per stage on the pressure file at \a path. The kernel
+ * signals a trigger as a priority event on its file descriptor.
+ */
+void MemoryPressureMonitor::watch(const QString &path)
+{
+    const QByteArray encoded = QFile::encodeName(path);
+    bool watched = false;
+    for (const StageThreshold &threshold : thresholds) {
+        const int fd = open(encoded.constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            break;
+
+        // The trigger string is written including its terminating null
+        if (write(fd, threshold.trigger, strlen(threshold.trigger) + 1) < 0) {
+            qDebug() << "failed to add memory pressure trigger to" << path << strerror(errno);
+            close(fd);
+            break;
+        }
+
+        auto notifier = new QSocketNotifier(fd, QSocketNotifier::Exception, this);
+        const Stage stage = threshold.stage;
+        connect(notifier, &QSocketNotifier::activated, this, [this, stage] {
+            if (stage > m_stage)
+                setStage(stage);
+            m_calmPolls = 0;
+        });
+        m_triggers.append({fd, stage, notifier});
+        watched = true;
+    }
+    // Stages the triggers registered so far raise are polled back down from this file
+    if (watched)
+        m_files.append(path);
+}
+
+void MemoryPressureMonitor::setStage(Stage stage)
+{
+    if (stage == m_stage)
+        return;
+
+    qDebug() << "memory pressure stage" << m_stage << "->" << stage;
+    m_stage = stage;
+    ++m_transitions;
+    m_calmPolls = 0;
+    if (stage == Normal)
+        m_pollTimer.stop();
+    else if (!m_pollTimer.isActive())
+        m_pollTimer.start();
+    Q_EMIT stageChanged(stage);
+}
+
+/*!
+ * Steps down one stage once pressure stayed below the current stage's release
+ * level for a few polls, triggers don't report when pressure goes away.
+ */
+void MemoryPressureMonitor::poll()
+{
+    const StageThreshold &threshold = thresholds[m_stage - 1];
+    double average = 0;
+    for (const QString &file : qAsConst(m_files)) {
+        average = qMax(average, readAverage(file, threshold.full));
+    }
+
+    if (average >= threshold.release) {
+        m_calmPolls = 0;
+        return;
+    }
+    if (++m_calmPolls >= calmPollsToRelease)
+        setStage(Stage(m_stage - 1));
+}
@@ -0,0 +1,69 @@
+#ifndef MEMORYPRESSUREMONITOR_H
+#define MEMORYPRESSUREMONITOR_H
+
+#include "wallpaperglobal.h"
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+class QSocketNotifier;
+
+/*!
+ * \brief Turns Linux pressure stall information into degradation stages.
+ *
+ * PSI triggers on /proc/pressure/memory, and on the memory.pressure file of the
+ * process's cgroup when it has one, raise the stage as soon as the kernel reports
+ * stalls above a stage's threshold. While degraded the averages are polled, and
+ * once they stay below a stage's release level for a few polls the stage steps
+ * back down, one at a time. Without PSI the stage stays Normal.
+ */
+class WSM_WALLPAPER_EXPORT MemoryPressureMonitor : public QObject
+{
+    Q_OBJECT
+public:
+    enum Stage {
+        Normal,
+        // Decoded images, snapshots and unused frame copies are dropped
+        DropCaches,
+        // Streams get fewer buffers and CPU frames are downscaled to the item
+        ReduceBuffers,
+        // Streams are renegotiated to a lower framerate
+        ReduceFrameRate,
+        // Streams that can't be seen are paused even when they would keep running
+        PauseHidden,
+    };
+    Q_ENUM(Stage)
+
+    static MemoryPressureMonitor *instance();
+    ~MemoryPressureMonitor() override;
+
+    Stage stage() const { return m_stage; }
+    quint64 transitions() const { return m_transitions; }
+    bool isAvailable() const { return !m_triggers.isEmpty(); }
+
+Q_SIGNALS:
+    void stageChanged(MemoryPressureMonitor::Stage stage);
+
+private:
+    explicit MemoryPressureMonitor(QObject *parent = nullptr);
+
+    void watch(const QString &path);
+    void setStage(Stage stage);
+    void poll();
+
+    struct Trigger {
+        int fd;
+        Stage stage;
+        QSocketNotifier *notifier;
+    };
+
+    QVector<QString> m_files;
+    QVector<Trigger> m_triggers;
+    QTimer m_pollTimer;
+    Stage m_stage = Normal;
+    int m_calmPolls = 0;
+    quint64 m_transitions = 0;
+};
+
+#endif // MEMORYPRESSUREMONITOR_H
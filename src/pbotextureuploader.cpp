@@ -0,0 +1,486 @@
+#include "pbotextureuploader.h"
+
+#include <QDebug>
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+#ifndef GL_MAP_UNSYNCHRONIZED_BIT
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_ALREADY_SIGNALED
+#define GL_ALREADY_SIGNALED 0x911A
+#endif
+#ifndef GL_CONDITION_SATISFIED
+#define GL_CONDITION_SATISFIED 0x911C
+#endif
+#ifndef GL_WAIT_FAILED
+#define GL_WAIT_FAILED 0x911D
+#endif
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+#ifndef GL_BGRA
+#define GL_BGRA 0x80E1
+#endif
+#ifndef GL_BGR
+#define GL_BGR 0x80E0
+#endif
+#ifndef GL_RGBA8
+#define GL_RGBA8 0x8058
+#endif
+#ifndef GL_RGB8
+#define GL_RGB8 0x8051
+#endif
+#ifndef GL_TEXTURE_SWIZZLE_R
+#define GL_TEXTURE_SWIZZLE_R 0x8E42
+#endif
+#ifndef GL_TEXTURE_SWIZZLE_B
+#define GL_TEXTURE_SWIZZLE_B 0x8E44
+#endif
+
+typedef void (*PFNGLBUFFERSTORAGEPROC_WSM)(GLenum target, qopengl_GLsizeiptr size, const void *data, GLbitfield flags);
+
+// Upper bound for waiting on a ring slot, a slot three frames old is virtually always free
+static const quint64 kSlotWaitTimeoutNs = 100 * 1000 * 1000;
+
+struct GLUploadFormat {
+    GLenum format = 0;
+    GLenum internalFormat = 0;
+    int bytesPerPixel = 0;
+    // Red and blue are uploaded swapped and swapped back when sampling
+    bool swapRedBlue = false;
+};
+
+/*!
+ * Returns how the pixels of \a format are uploaded as they are. Without GL_BGRA
+ * or GL_BGR, which GLES lacks, blue first layouts go up as RGB and a texture
+ * swizzle, core in GLES 3.0, puts the channels back in order.
+ */
+static GLUploadFormat uploadFormatForImage(QOpenGLContext *context, QImage::Format format)
+{
+    const bool gles = context->isOpenGLES();
+    const bool hasBgra = !gles || context->hasExtension(QByteArrayLiteral("GL_EXT_texture_format_BGRA8888"));
+
+    switch (format) {
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return {GL_RGBA, GL_RGBA8, 4, false};
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        if (hasBgra)
+            return {GL_BGRA, GLenum(gles ? GL_BGRA : GL_RGBA8), 4, false};
+        return {GL_RGBA, GL_RGBA8, 4, true};
+    case QImage::Format_RGB888:
+        return {GL_RGB, GL_RGB8, 3, false};
+    case QImage::Format_BGR888:
+        if (!gles)
+            return {GL_BGR, GL_RGB8, 3, false};
+        return {GL_RGB, GL_RGB8, 3, true};
+    default:
+        break;
+    }
+    return {};
+}
+
+/*!
+ * Finds the unpack row length and alignment that make GL step \a stride bytes
+ * from row to row. GL rounds a row of rowLength pixels up to the alignment, so
+ * any stride that is a multiple of four works, whatever the pixel size.
+ */
+static bool unpackLayout(int stride, int width, int bytesPerPixel, int *rowLength, int *alignment)
+{
+    for (int align : {8, 4, 2, 1}) {
+        if (stride % align != 0)
+            continue;
+        for (int length = stride / bytesPerPixel; length >= width && length * bytesPerPixel > stride - align; --length) {
+            if ((length * bytesPerPixel + align - 1) / align * align == stride) {
+                *rowLength = length;
+                *alignment = align;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+PboFrameWriter::PboFrameWriter(int slotCount)
+    : m_slots(slotCount)
+{
+    for (Slot &slot : m_slots)
+        slot.writer = this;
+}
+
+/*!
+ * Returns an image of \a size and \a format over a free slot, or a null image
+ * when the slots are busy, too small or not persistently mapped.
+ */
+QImage PboFrameWriter::acquireImage(const QSize &size, QImage::Format format)
+{
+    const int bytesPerLine = (size.width() * QImage::toPixelFormat(format).bitsPerPixel() / 8 + 3) & ~3;
+
+    QMutexLocker locker(&m_mutex);
+    if (size.isEmpty() || qsizetype(bytesPerLine) * size.height() > m_slotSize)
+        return QImage();
+
+    for (Slot &slot : m_slots) {
+        if (!slot.mapped || slot.referenced || slot.uploading)
+            continue;
+        slot.referenced = true;
+        // The image keeps the writer alive, it may outlive the uploader
+        ref.ref();
+        return QImage(slot.mapped, size.width(), size.height(), bytesPerLine, format, releaseImage, &slot);
+    }
+    return QImage();
+}
+
+void PboFrameWriter::releaseImage(void *info)
+{
+    Slot *slot = static_cast<Slot *>(info);
+    PboFrameWriter *writer = slot->writer;
+    {
+        QMutexLocker locker(&writer->m_mutex);
+        slot->referenced = false;
+    }
+    if (!writer->ref.deref())
+        delete writer;
+}
+
+// Called with m_mutex locked
+int PboFrameWriter::slotOf(const uchar *bits)
+{
+    for (size_t i = 0; i < m_slots.size(); ++i) {
+        if (m_slots[i].mapped && m_slots[i].mapped == bits)
+            return int(i);
+    }
+    return -1;
+}
+
+PboTextureUploader::PboTextureUploader(int slotCount)
+    : m_slots(qMax(slotCount, 2))
+    , m_writer(new PboFrameWriter(qMax(slotCount, 2)))
+{
+}
+
+PboTextureUploader::~PboTextureUploader()
+{
+    invalidate();
+}
+
+bool PboTextureUploader::isSupported(QOpenGLContext *context)
+{
+    if (!context)
+        return false;
+
+    // Pixel unpack buffers, glMapBufferRange and fence syncs are all core in GL 3.2 and GLES 3.0
+    const QSurfaceFormat format = context->format();
+    if (context->isOpenGLES())
+        return format.majorVersion() >= 3;
+
+    return format.version() >= qMakePair(3, 2)
+            || (context->hasExtension(QByteArrayLiteral("GL_ARB_pixel_buffer_object"))
+                && context->hasExtension(QByteArrayLiteral("GL_ARB_map_buffer_range"))
+                && context->hasExtension(QByteArrayLiteral("GL_ARB_sync")));
+}
+
+bool PboTextureUploader::upload(const QImage &source)
+{
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (!context || source.isNull())
+        return false;
+
+    // Every format a stream delivers uploads as it is, others are converted once
+    QImage image = source;
+    GLUploadFormat uploadFormat = uploadFormatForImage(context, image.format());
+    if (!uploadFormat.format) {
+        image = image.convertToFormat(QImage::Format_RGBA8888);
+        uploadFormat = uploadFormatForImage(context, image.format());
+    }
+
+    // Rows keep their stride, QImage aligns it to four bytes so this practically always works
+    int rowLength = 0;
+    int alignment = 0;
+    if (!unpackLayout(image.bytesPerLine(), image.width(), uploadFormat.bytesPerPixel, &rowLength, &alignment)) {
+        image = image.convertToFormat(QImage::Format_RGBA8888);
+        uploadFormat = uploadFormatForImage(context, image.format());
+        rowLength = image.width();
+        alignment = 4;
+    }
+
+    const qsizetype bytes = qsizetype(image.bytesPerLine()) * image.height();
+    pollFences();
+    if (!ensureResources(context, image.size(), bytes))
+        return false;
+
+    // Images from the writer already are in their slot
+    int index = -1;
+    {
+        QMutexLocker locker(&m_writer->m_mutex);
+        index = m_writer->slotOf(image.constBits());
+        if (index >= 0)
+            m_writer->m_slots[index].uploading = true;
+    }
+    const bool written = index >= 0;
+    if (!written)
+        index = claimSlot();
+    if (index < 0)
+        return false;
+
+    QOpenGLExtraFunctions *f = context->extraFunctions();
+    Slot &slot = m_slots[index];
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+
+    if (!written) {
+        waitForSlot(slot);
+        uchar *dst = slot.mapped;
+        if (!m_persistent) {
+            // The fence above guarantees the GPU is done with this slot
+            dst = static_cast<uchar *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+        }
+        if (!dst) {
+            qWarning() << "Failed to map pixel buffer object";
+            f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            QMutexLocker locker(&m_writer->m_mutex);
+            m_writer->m_slots[index].uploading = false;
+            return false;
+        }
+
+        memcpy(dst, image.constBits(), bytes);
+
+        if (!m_persistent)
+            f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    f->glBindTexture(GL_TEXTURE_2D, m_texture);
+    if (m_textureFormat != uploadFormat.internalFormat) {
+        f->glTexImage2D(GL_TEXTURE_2D, 0, uploadFormat.internalFormat, m_size.width(), m_size.height(), 0, uploadFormat.format, GL_UNSIGNED_BYTE, nullptr);
+        m_textureFormat = uploadFormat.internalFormat;
+    }
+    if (m_swapRedBlue != uploadFormat.swapRedBlue) {
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, uploadFormat.swapRedBlue ? GL_BLUE : GL_RED);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, uploadFormat.swapRedBlue ? GL_RED : GL_BLUE);
+        m_swapRedBlue = uploadFormat.swapRedBlue;
+    }
+
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    f->glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+    f->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_size.width(), m_size.height(), uploadFormat.format, GL_UNSIGNED_BYTE, nullptr);
+    f->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    slot.fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    return true;
+}
+
+void PboTextureUploader::invalidate()
+{
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (!context) {
+        // The context is already gone, and with it every object we own
+        QMutexLocker locker(&m_writer->m_mutex);
+        for (PboFrameWriter::Slot &shared : m_writer->m_slots) {
+            shared.mapped = nullptr;
+            shared.uploading = false;
+        }
+        m_writer->m_slotSize = 0;
+        m_slots.fill(Slot());
+        m_texture = 0;
+        m_size = QSize();
+        m_textureFormat = 0;
+        m_swapRedBlue = false;
+        return;
+    }
+
+    releaseBuffers();
+    if (m_texture) {
+        context->functions()->glDeleteTextures(1, &m_texture);
+        m_texture = 0;
+    }
+    m_size = QSize();
+    m_textureFormat = 0;
+    m_swapRedBlue = false;
+}
+
+bool PboTextureUploader::ensureResources(QOpenGLContext *context, const QSize &size, qsizetype bytes)
+{
+    QOpenGLExtraFunctions *f = context->extraFunctions();
+
+    if (!m_texture) {
+        f->glGenTextures(1, &m_texture);
+        f->glBindTexture(GL_TEXTURE_2D, m_texture);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        f->glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    if (m_size != size) {
+        m_size = size;
+        m_textureFormat = 0;
+    }
+
+    if (m_slotSize >= bytes && m_slots.first().buffer)
+        return true;
+
+    // Written images point into the current slots, they are replaced once those are gone
+    {
+        QMutexLocker locker(&m_writer->m_mutex);
+        for (PboFrameWriter::Slot &shared : m_writer->m_slots) {
+            if (shared.referenced)
+                return false;
+        }
+        for (PboFrameWriter::Slot &shared : m_writer->m_slots)
+            shared.mapped = nullptr;
+    }
+    releaseBuffers();
+
+    const bool hasBufferStorage = context->hasExtension(QByteArrayLiteral("GL_ARB_buffer_storage"))
+            || context->hasExtension(QByteArrayLiteral("GL_EXT_buffer_storage"));
+    auto glBufferStorage = reinterpret_cast<PFNGLBUFFERSTORAGEPROC_WSM>(
+            context->getProcAddress(context->isOpenGLES() ? "glBufferStorageEXT" : "glBufferStorage"));
+    m_persistent = !m_persistentFailed && hasBufferStorage && glBufferStorage;
+
+    const GLbitfield persistentFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    for (Slot &slot : m_slots) {
+        f->glGenBuffers(1, &slot.buffer);
+        f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+        if (m_persistent) {
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, persistentFlags);
+            slot.mapped = static_cast<uchar *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, persistentFlags));
+            if (!slot.mapped) {
+                qWarning() << "Persistent mapping failed, falling back to per-frame mapping";
+                f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                releaseBuffers();
+                m_persistentFailed = true;
+                return ensureResources(context, size, bytes);
+            }
+        } else {
+            f->glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        }
+    }
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    m_slotSize = bytes;
+    m_nextSlot = 0;
+
+    if (m_persistent) {
+        QMutexLocker locker(&m_writer->m_mutex);
+        for (int i = 0; i < m_slots.size(); ++i)
+            m_writer->m_slots[i].mapped = m_slots[i].mapped;
+        m_writer->m_slotSize = bytes;
+    }
+    return true;
+}
+
+/*!
+ * Claims the next ring slot no written image points into for a copy. It stays
+ * claimed until its upload fence signaled. Returns -1 when every slot is taken.
+ */
+int PboTextureUploader::claimSlot()
+{
+    QMutexLocker locker(&m_writer->m_mutex);
+    for (int i = 0; i < m_slots.size(); ++i) {
+        const int index = (m_nextSlot + i) % m_slots.size();
+        PboFrameWriter::Slot &shared = m_writer->m_slots[index];
+        if (shared.referenced)
+            continue;
+        shared.uploading = true;
+        m_nextSlot = (index + 1) % m_slots.size();
+        return index;
+    }
+    return -1;
+}
+
+void PboTextureUploader::waitForSlot(Slot &slot)
+{
+    if (!slot.fence)
+        return;
+
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+    const GLenum result = f->glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, kSlotWaitTimeoutNs);
+    if (result == GL_WAIT_FAILED)
+        qWarning() << "Waiting for the upload fence failed";
+
+    f->glDeleteSync(slot.fence);
+    slot.fence = nullptr;
+}
+
+/*!
+ * Hands slots whose upload finished back to the writer, without waiting.
+ */
+void PboTextureUploader::pollFences()
+{
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+    for (int i = 0; i < m_slots.size(); ++i) {
+        Slot &slot = m_slots[i];
+        if (!slot.fence)
+            continue;
+        const GLenum result = f->glClientWaitSync(slot.fence, 0, 0);
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+            continue;
+        f->glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        QMutexLocker locker(&m_writer->m_mutex);
+        m_writer->m_slots[i].uploading = false;
+    }
+}
+
+void PboTextureUploader::releaseBuffers()
+{
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+    QMutexLocker locker(&m_writer->m_mutex);
+    m_writer->m_slotSize = 0;
+    for (int i = 0; i < m_slots.size(); ++i) {
+        Slot &slot = m_slots[i];
+        PboFrameWriter::Slot &shared = m_writer->m_slots[i];
+        shared.mapped = nullptr;
+        shared.uploading = false;
+        if (slot.fence)
+            f->glDeleteSync(slot.fence);
+        if (slot.buffer && shared.referenced) {
+            // An image still points into the mapping, the buffer goes with the context
+            slot = Slot();
+            continue;
+        }
+        if (slot.buffer) {
+            if (slot.mapped) {
+                f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+                f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            }
+            f->glDeleteBuffers(1, &slot.buffer);
+        }
+        slot = Slot();
+    }
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    m_slotSize = 0;
+}
@@ -0,0 +1,116 @@
+#ifndef PBOTEXTUREUPLOADER_H
+#define PBOTEXTUREUPLOADER_H
+
+#include "wallpaperglobal.h"
+
+#include <QExplicitlySharedDataPointer>
+#include <QImage>
+#include <QMutex>
+#include <QSharedData>
+#include <QSize>
+#include <QVector>
+
+#include <vector>
+
+typedef unsigned int GLuint;
+typedef unsigned int GLenum;
+typedef struct __GLsync *GLsync;
+
+class QOpenGLContext;
+class PboTextureUploader;
+
+/*!
+ * \brief Lets another thread write frames straight into the persistently mapped
+ * slots of a PboTextureUploader.
+ *
+ * acquireImage() returns an image over a free slot, uploading it needs no further
+ * copy. A slot is handed out again once its image is gone and the upload from it
+ * has finished. Thread safe.
+ */
+class WSM_WALLPAPER_EXPORT PboFrameWriter : public QSharedData
+{
+public:
+    explicit PboFrameWriter(int slotCount);
+
+    QImage acquireImage(const QSize &size, QImage::Format format);
+
+private:
+    friend class PboTextureUploader;
+
+    struct Slot {
+        PboFrameWriter *writer = nullptr;
+        uchar *mapped = nullptr;
+        // An image points into the slot, or the GPU still reads from it
+        bool referenced = false;
+        bool uploading = false;
+    };
+
+    static void releaseImage(void *info);
+    int slotOf(const uchar *bits);
+
+    QMutex m_mutex;
+    std::vector<Slot> m_slots;
+    qsizetype m_slotSize = 0;
+};
+
+/*!
+ * \brief Streams CPU frames into a GL texture through a ring of pixel buffer objects.
+ *
+ * Each frame is copied into the next ring slot and the texture is updated from
+ * that buffer, so glTexSubImage2D returns immediately and the driver performs
+ * the transfer asynchronously. A fence is placed after every upload and the slot
+ * is only written again once the fence has signaled. When GL_ARB_buffer_storage
+ * (or GL_EXT_buffer_storage on GLES) is available the slots are mapped
+ * persistently, otherwise they are mapped unsynchronized for each frame.
+ * Persistent slots are also offered through writer(), images written there
+ * upload without any copy on the render thread.
+ *
+ * Pixels go up in the layout they arrive in, rows keep their stride and blue
+ * first layouts the GL lacks an upload format for are fixed with a swizzle, so
+ * no frame a stream delivers is converted on the CPU.
+ *
+ * All methods must be called with the owning GL context current.
+ */
+class WSM_WALLPAPER_EXPORT PboTextureUploader
+{
+public:
+    explicit PboTextureUploader(int slotCount = 3);
+    ~PboTextureUploader();
+
+    static bool isSupported(QOpenGLContext *context);
+
+    bool upload(const QImage &image);
+    void invalidate();
+
+    QExplicitlySharedDataPointer<PboFrameWriter> writer() const { return m_writer; }
+    GLuint textureId() const { return m_texture; }
+    QSize size() const { return m_size; }
+    bool isPersistent() const { return m_persistent; }
+
+private:
+    struct Slot {
+        GLuint buffer = 0;
+        uchar *mapped = nullptr;
+        GLsync fence = nullptr;
+    };
+
+    bool ensureResources(QOpenGLContext *context, const QSize &size, qsizetype bytes);
+    int claimSlot();
+    void waitForSlot(Slot &slot);
+    void pollFences();
+    void releaseBuffers();
+
+    QVector<Slot> m_slots;
+    QExplicitlySharedDataPointer<PboFrameWriter> m_writer;
+    int m_nextSlot = 0;
+    qsizetype m_slotSize = 0;
+    bool m_persistent = false;
+    bool m_persistentFailed = false;
+
+    GLuint m_texture = 0;
+    QSize m_size;
+    GLenum m_textureFormat = 0;
+    bool m_swapRedBlue = false;
+};
+
+#endif // PBOTEXTUREUPLOADER_H
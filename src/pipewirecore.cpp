@@ -53,7 +53,8 @@ void PipewireCore::onCoreError(void *data, uint32_t id, int seq, int res, const
     qDebug() << "PipeWire remote error: " << res << message;
     if (id == PW_ID_CORE) {
         PipewireCore *pw = static_cast<PipewireCore *>(data);
-        Q_EMIT pw->pipewireFailed(QString::fromUtf8(message));
+        pw->m_error = QString::fromUtf8(message);
+        Q_EMIT pw->pipewireFailed(pw->m_error);
     }
 }
 
@@ -112,7 +113,8 @@ QSharedPointer<PipewireCore> PipewireCore::fetch(int fd)
 {
     static QThreadStorage<QHash<int, QWeakPointer<PipewireCore>>> global;
     QSharedPointer<PipewireCore> ret = global.localData().value(fd).toStrongRef();
-    if (!ret) {
+    // A core that failed can't be shared anymore, streams reconnecting need a new one
+    if (!ret || !ret->error().isEmpty()) {
         ret.reset(new PipewireCore);
         if (ret->init(fd)) {
             global.localData().insert(fd, ret);
@@ -0,0 +1,127 @@
+#include "pipewireframesink.h"
+
+// Offsets of the red and blue bytes, green is always in the middle
+static bool channelOffsets(spa_video_format format, int *red, int *blue)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGBx:
+    case SPA_VIDEO_FORMAT_RGBA:
+    case SPA_VIDEO_FORMAT_RGB:
+        *red = 0;
+        *blue = 2;
+        return true;
+    case SPA_VIDEO_FORMAT_BGRx:
+    case SPA_VIDEO_FORMAT_BGRA:
+    case SPA_VIDEO_FORMAT_BGR:
+        *red = 2;
+        *blue = 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Calls \a visit with the red, green and blue value of every sampled pixel
+template<typename Visitor>
+static bool samplePixels(const PipeWireFrameView &frame, int samplesPerSide, Visitor visit)
+{
+    int red, blue;
+    if (!frame.data || frame.size.isEmpty() || !channelOffsets(frame.format, &red, &blue))
+        return false;
+
+    const int stepX = qMax(1, frame.size.width() / samplesPerSide);
+    const int stepY = qMax(1, frame.size.height() / samplesPerSide);
+    for (int y = stepY / 2; y < frame.size.height(); y += stepY) {
+        const uchar *row = frame.data + qsizetype(y) * frame.stride;
+        for (int x = stepX / 2; x < frame.size.width(); x += stepX) {
+            const uchar *pixel = row + x * frame.bytesPerPixel;
+            visit(pixel[red], pixel[1], pixel[blue]);
+        }
+    }
+    return true;
+}
+
+PipeWireFrameSink::~PipeWireFrameSink()
+{
+}
+
+/*!
+ * Returns the metadata the sink reads from the view, none by default. The
+ * stream only parses, and negotiates, metadata some consumer needs.
+ */
+PipeWireFrameSink::MetadataFlags PipeWireFrameSink::metadata() const
+{
+    return NoMetadata;
+}
+
+AverageColorSink::AverageColorSink(int samplesPerSide)
+    : m_samplesPerSide(qMax(1, samplesPerSide))
+{
+}
+
+void AverageColorSink::consumeFrame(const PipeWireFrameView &frame)
+{
+    quint64 sums[3] = {};
+    quint64 count = 0;
+    const bool sampled = samplePixels(frame, m_samplesPerSide, [&](uchar r, uchar g, uchar b) {
+        sums[0] += r;
+        sums[1] += g;
+        sums[2] += b;
+        ++count;
+    });
+    if (!sampled || !count)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    m_color = QColor(int(sums[0] / count), int(sums[1] / count), int(sums[2] / count));
+}
+
+/*!
+ * Returns the average color of the last CPU frame, invalid before the first one.
+ * This may be called from any thread.
+ */
+QColor AverageColorSink::color() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_color;
+}
+
+HistogramSink::HistogramSink(int bins, int samplesPerSide)
+    : m_bins(qBound(1, bins, 256))
+    , m_samplesPerSide(qMax(1, samplesPerSide))
+{
+}
+
+void HistogramSink::consumeFrame(const PipeWireFrameView &frame)
+{
+    QVector<quint32> histograms[4];
+    for (QVector<quint32> &histogram : histograms) {
+        histogram.fill(0, m_bins);
+    }
+
+    const bool sampled = samplePixels(frame, m_samplesPerSide, [&](uchar r, uchar g, uchar b) {
+        // Rec. 709 luma in integer arithmetic
+        const int luma = (r * 54 + g * 183 + b * 19) >> 8;
+        ++histograms[Red][r * m_bins >> 8];
+        ++histograms[Green][g * m_bins >> 8];
+        ++histograms[Blue][b * m_bins >> 8];
+        ++histograms[Luma][luma * m_bins >> 8];
+    });
+    if (!sampled)
+        return;
+
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < 4; ++i) {
+        m_histograms[i].swap(histograms[i]);
+    }
+}
+
+/*!
+ * Returns the histogram of \a channel for the last CPU frame, empty before the
+ * first one. This may be called from any thread.
+ */
+QVector<quint32> HistogramSink::histogram(Channel channel) const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_histograms[channel];
+}
@@ -0,0 +1,108 @@
+#ifndef PIPEWIREFRAMESINK_H
+#define PIPEWIREFRAMESINK_H
+
+#include "wallpaperglobal.h"
+#include "pipewiresourcestream.h"
+
+#include <QColor>
+#include <QFlags>
+#include <QMutex>
+#include <QVector>
+
+/*!
+ * \brief Borrowed view of a frame, valid only while PipeWireFrameSink::consumeFrame() runs.
+ *
+ * CPU frames point straight into the producer's buffer at the top left pixel of
+ * sourceRect; DMA-BUF frames have no pixels, only their attributes. Metadata a
+ * sink did not ask for is not parsed and left null.
+ */
+struct PipeWireFrameView {
+    spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN;
+    QSize size;
+    int stride = 0;
+    int bytesPerPixel = 0;
+    const uchar *data = nullptr;
+    const DmaBufAttributes *dmabuf = nullptr;
+    QRect sourceRect;
+    int sequential = 0;
+    qint64 presentationTimestamp = 0;
+    const PipeWireDamage *damage = nullptr;
+    const PipeWireCursor *cursor = nullptr;
+    // CLOCK_MONOTONIC nanoseconds by which the sink should return, one frame
+    // interval after the frame arrived
+    qint64 deadline = 0;
+};
+
+/*!
+ * \brief Consumes frames of a PipewireSourceStream without a scene graph or copies.
+ *
+ * Sinks are called directly by the stream on the thread that processes it,
+ * before frameReceived is emitted, and must neither block nor keep pointers from
+ * the view. A stream without receivers for frameReceived copies nothing, so a
+ * headless consumer only pays for what its sinks read.
+ */
+class WSM_WALLPAPER_EXPORT PipeWireFrameSink
+{
+public:
+    enum Metadata {
+        NoMetadata = 0,
+        Damage = 1 << 0,
+        Cursor = 1 << 1,
+    };
+    Q_DECLARE_FLAGS(MetadataFlags, Metadata)
+
+    virtual ~PipeWireFrameSink();
+
+    virtual MetadataFlags metadata() const;
+    virtual void consumeFrame(const PipeWireFrameView &frame) = 0;
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(PipeWireFrameSink::MetadataFlags)
+
+/*!
+ * \brief Average color of CPU frames, sampled on a coarse grid.
+ */
+class WSM_WALLPAPER_EXPORT AverageColorSink : public PipeWireFrameSink
+{
+public:
+    explicit AverageColorSink(int samplesPerSide = 64);
+
+    void consumeFrame(const PipeWireFrameView &frame) override;
+    QColor color() const;
+
+private:
+    const int m_samplesPerSide;
+    mutable QMutex m_mutex;
+    QColor m_color;
+};
+
+/*!
+ * \brief Per channel histograms of CPU frames, sampled on a coarse grid.
+ *
+ * Each of the red, green, blue and luma histograms has bins() bins counting
+ * sampled pixels.
+ */
+class WSM_WALLPAPER_EXPORT HistogramSink : public PipeWireFrameSink
+{
+public:
+    enum Channel {
+        Red,
+        Green,
+        Blue,
+        Luma,
+    };
+
+    explicit HistogramSink(int bins = 16, int samplesPerSide = 64);
+
+    void consumeFrame(const PipeWireFrameView &frame) override;
+    int bins() const { return m_bins; }
+    QVector<quint32> histogram(Channel channel) const;
+
+private:
+    const int m_bins;
+    const int m_samplesPerSide;
+    mutable QMutex m_mutex;
+    QVector<quint32> m_histograms[4];
+};
+
+#endif // PIPEWIREFRAMESINK_H
@@ -1,102 +1,334 @@
-#include "eglhelpers.h"
 #include "pipewiresourceitem.h"
 #include "private/pipewiresourceitem_p.h"
-
-#include <EGL/eglext.h>
+#include "framescheduler.h"
+#include "framesnapshot.h"
+#include "frametrace.h"
+#include "imagescaler.h"
+#include "memorypressuremonitor.h"
+#include "pbotextureuploader.h"
+#include "previewscheduler.h"
+#include "textureatlas.h"
+#include "tiledtexturenode.h"
 
 #include <fcntl.h>
-#include <libdrm/drm_fourcc.h>
 
 #include <QGuiApplication>
 #include <QLoggingCategory>
-#include <QOpenGLTexture>
-#include <QSocketNotifier>
-#include <QVersionNumber>
+#include <QMatrix4x4>
+#include <QRunnable>
+#include <QSGImageNode>
+#include <QSGOpacityNode>
+#include <QSGRectangleNode>
+#include <QSGTransformNode>
+#include <QSGTextureProvider>
 #include <QThread>
-#include <qpa/qplatformnativeinterface.h>
+
+// Reconnection backoff, the delay doubles with every attempt that fails
+static const int reconnectBaseDelay = 100;
+static const int reconnectMaxDelay = 5000;
+static const int maxReconnectAttempts = 10;
+
+// Snapshots are refreshed at most this often while frames arrive, and bounded in size
+static const int snapshotInterval = 30000;
+static const QSize maxSnapshotSize(1280, 1280);
+static const int snapshotFadeDuration = 250;
+// Tiles large frames are split into, small ones repaint little more than the damage in software
+static const int frameTileSize = 1024;
+static const int softwareTileSize = 128;
+// Frame rate streams are limited to under heavy memory pressure
+static const int pressureFrameRate = 10;
 
 class PipeWireRenderNode : public QSGNode
 {
 public:
+    PipeWireRenderNode()
+        : m_content(new QSGTransformNode)
+    {
+        appendChildNode(m_content);
+    }
+
+    // Rotates and flips everything in stream coordinates, the snapshot is already upright
+    void setContentMatrix(const QMatrix4x4 &matrix)
+    {
+        if (m_content->matrix() != matrix)
+            m_content->setMatrix(matrix);
+    }
+
     QSGImageNode *screenNode(QQuickWindow *window)
     {
         if (!m_screenNode) {
             m_screenNode = window->createImageNode();
-            appendChildNode(m_screenNode);
+            m_screenNode->setOwnsTexture(true);
+            m_content->prependChildNode(m_screenNode);
         }
         return m_screenNode;
     }
+
+    // Shows a tile of the window's atlas, which the item owns
+    QSGImageNode *atlasNode(QQuickWindow *window)
+    {
+        if (!m_atlasNode) {
+            m_atlasNode = window->createImageNode();
+            m_content->prependChildNode(m_atlasNode);
+        }
+        return m_atlasNode;
+    }
+
+    TiledTextureNode *tiledNode(int tileSize)
+    {
+        if (!m_tiledNode) {
+            m_tiledNode = new TiledTextureNode(tileSize);
+            m_content->prependChildNode(m_tiledNode);
+        }
+        return m_tiledNode;
+    }
+
+    // Stays above the frame, which is drawn by the content node
+    QSGImageNode *snapshotNode(QQuickWindow *window)
+    {
+        if (!m_snapshotOpacity) {
+            m_snapshotOpacity = new QSGOpacityNode;
+            m_snapshotNode = window->createImageNode();
+            m_snapshotNode->setOwnsTexture(true);
+            m_snapshotOpacity->appendChildNode(m_snapshotNode);
+            appendChildNode(m_snapshotOpacity);
+        }
+        return m_snapshotNode;
+    }
+
+    void setSnapshotOpacity(qreal opacity)
+    {
+        if (m_snapshotOpacity)
+            m_snapshotOpacity->setOpacity(opacity);
+    }
+
     QSGImageNode *cursorNode(QQuickWindow *window)
     {
         if (!m_cursorNode) {
             m_cursorNode = window->createImageNode();
-            appendChildNode(m_cursorNode);
+            m_content->appendChildNode(m_cursorNode);
         }
         return m_cursorNode;
     }
 
-    QSGImageNode *damageNode(QQuickWindow *window)
+    // Holds a rectangle node per damaged rect
+    QSGNode *damageNode()
     {
         if (!m_damageNode) {
-            m_damageNode = window->createImageNode();
-            appendChildNode(m_damageNode);
+            m_damageNode = new QSGNode;
+            m_content->appendChildNode(m_damageNode);
         }
         return m_damageNode;
     }
 
+    void discardScreen()
+    {
+        discard(m_content, m_screenNode);
+    }
+
+    void discardAtlas()
+    {
+        discard(m_content, m_atlasNode);
+    }
+
+    void discardTiles()
+    {
+        discard(m_content, m_tiledNode);
+    }
+
+    void discardSnapshot()
+    {
+        discard(this, m_snapshotOpacity);
+        m_snapshotNode = nullptr;
+    }
+
     void discardCursor()
     {
-        if (m_cursorNode) {
-            removeChildNode(m_cursorNode);
-            delete m_cursorNode;
-            m_cursorNode = nullptr;
-        }
+        discard(m_content, m_cursorNode);
     }
 
     void discardDamage()
     {
-        if (m_damageNode) {
-            removeChildNode(m_damageNode);
-            delete m_damageNode;
-            m_damageNode = nullptr;
-        }
+        discard(m_content, m_damageNode);
     }
 
 private:
+    template<typename Node>
+    static void discard(QSGNode *parent, Node *&node)
+    {
+        if (node) {
+            parent->removeChildNode(node);
+            delete node;
+            node = nullptr;
+        }
+    }
+
+    QSGTransformNode *m_content;
     QSGImageNode *m_screenNode = nullptr;
+    QSGImageNode *m_atlasNode = nullptr;
+    TiledTextureNode *m_tiledNode = nullptr;
+    QSGOpacityNode *m_snapshotOpacity = nullptr;
+    QSGImageNode *m_snapshotNode = nullptr;
     QSGImageNode *m_cursorNode = nullptr;
-    QSGImageNode *m_damageNode = nullptr;
+    QSGNode *m_damageNode = nullptr;
 };
 
-class DiscardEglPixmapRunnable : public QRunnable
+static bool isTransposed(PipeWireTransform transform)
+{
+    return transform == PipeWireTransform::Rotate90 || transform == PipeWireTransform::Rotate270
+        || transform == PipeWireTransform::Flipped90 || transform == PipeWireTransform::Flipped270;
+}
+
+/*!
+ * Returns the rect a frame of \a frameSize is drawn into, in stream orientation,
+ * so that it fits \a bounds with its aspect ratio once \a transform is applied.
+ */
+static QRect contentRect(const QSize &frameSize, const QRect &bounds, PipeWireTransform transform)
+{
+    const bool transposed = isTransposed(transform);
+    const QSize shown = (transposed ? frameSize.transposed() : frameSize).scaled(bounds.size(), Qt::KeepAspectRatio);
+    QRect rect({0, 0}, transposed ? shown.transposed() : shown);
+    rect.moveCenter(bounds.center());
+    return rect;
+}
+
+/*!
+ * Returns the matrix applying \a transform around \a center. SPA flips around
+ * the vertical axis first and then rotates counter-clockwise.
+ */
+static QMatrix4x4 contentMatrix(PipeWireTransform transform, const QPointF &center)
+{
+    QMatrix4x4 matrix;
+    if (transform == PipeWireTransform::Normal)
+        return matrix;
+
+    const int value = int(transform);
+    matrix.translate(center.x(), center.y());
+    matrix.rotate(-90 * (value % 4), 0, 0, 1);
+    if (value >= int(PipeWireTransform::Flipped))
+        matrix.scale(-1, 1);
+    matrix.translate(-center.x(), -center.y());
+    return matrix;
+}
+
+class DiscardTextureBackendRunnable : public QRunnable
 {
 public:
-    DiscardEglPixmapRunnable(EGLImageKHR image, QOpenGLTexture *texture)
-        : m_image(image)
-        , m_texture(texture)
+    DiscardTextureBackendRunnable(TextureBackend *backend)
+        : m_backend(backend)
     {
     }
 
     void run() override
     {
-        if (m_image != EGL_NO_IMAGE_KHR) {
-            eglDestroyImage(eglGetCurrentDisplay(), m_image);
-        }
+        delete m_backend;
+    }
+
+private:
+    TextureBackend *m_backend;
+};
+
+/*!
+ * \brief Exposes the texture of the newest frame to other items, such as a
+ * ShaderEffect using the wallpaper as source. Lives on the render thread.
+ */
+class PipeWireTextureProvider : public QSGTextureProvider
+{
+public:
+    QSGTexture *texture() const override
+    {
+        return m_texture;
+    }
 
+    void setTexture(QSGTexture *texture)
+    {
+        if (texture == m_texture)
+            return;
+
+        m_texture = texture;
+        Q_EMIT textureChanged();
+    }
+
+private:
+    QSGTexture *m_texture = nullptr;
+};
+
+class DiscardTextureRunnable : public QRunnable
+{
+public:
+    DiscardTextureRunnable(QSGTexture *texture)
+        : m_texture(texture)
+    {
+    }
+
+    void run() override
+    {
         delete m_texture;
     }
 
 private:
-    const EGLImageKHR m_image;
-    QOpenGLTexture *m_texture;
+    QSGTexture *m_texture;
+};
+
+class DiscardTextureProviderRunnable : public QRunnable
+{
+public:
+    DiscardTextureProviderRunnable(PipeWireTextureProvider *provider)
+        : m_provider(provider)
+    {
+    }
+
+    void run() override
+    {
+        delete m_provider;
+    }
+
+private:
+    PipeWireTextureProvider *m_provider;
+};
+
+/*!
+ * \brief Scales a frame down to the snapshot size, makes it upright and saves it.
+ */
+class SaveSnapshotRunnable : public QRunnable
+{
+public:
+    SaveSnapshotRunnable(const QString &key, const QImage &image, PipeWireTransform transform)
+        : m_key(key)
+        , m_image(image)
+        , m_transform(transform)
+    {
+    }
+
+    void run() override
+    {
+        const QSize target = ImageScaler::targetSize(m_image.size(), maxSnapshotSize);
+        QImage snapshot = target == m_image.size() ? m_image : m_image.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        if (m_transform != PipeWireTransform::Normal)
+            snapshot = snapshot.transformed(contentMatrix(m_transform, QPointF()).toTransform());
+        FrameSnapshot::save(m_key, snapshot);
+    }
+
+private:
+    const QString m_key;
+    const QImage m_image;
+    const PipeWireTransform m_transform;
 };
 
 PipewireSourceItem::PipewireSourceItem(QQuickItem *parent)
     : QQuickItem(*(new PipewireSourceItemPrivate), parent)
 {
+    Q_D(PipewireSourceItem);
+
     setFlag(ItemHasContents, true);
 
+    d->reconnectTimer.setSingleShot(true);
+    connect(&d->reconnectTimer, &QTimer::timeout, this, &PipewireSourceItem::reconnect);
+    d->snapshotTimer.setSingleShot(true);
+    connect(&d->snapshotTimer, &QTimer::timeout, this, &PipewireSourceItem::saveSnapshot);
+    d->snapshotPool.setMaxThreadCount(1);
     connect(this, &QQuickItem::visibleChanged, this, &PipewireSourceItem::handleVisibleChanged);
+    connect(MemoryPressureMonitor::instance(), &MemoryPressureMonitor::stageChanged, this, &PipewireSourceItem::applyMemoryPressure);
 }
 
 void PipewireSourceItem::setNodeId(uint nodeId)
@@ -107,6 +339,7 @@ void PipewireSourceItem::setNodeId(uint nodeId)
         return;
 
     d->nodeId = nodeId;
+    d->resetRecovery();
     refresh();
     Q_EMIT nodeIdChanged(nodeId);
 }
@@ -125,6 +358,7 @@ void PipewireSourceItem::setFd(uint fd)
         return;
 
     d->fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+    d->resetRecovery();
     refresh();
     Q_EMIT fdChanged(fd);
 }
@@ -134,24 +368,637 @@ uint PipewireSourceItem::fd() const
 
 }
 
+void PipewireSourceItem::setPauseWhenHidden(bool pause)
+{
+    Q_D(PipewireSourceItem);
+
+    if (pause == d->pauseWhenHidden)
+        return;
+
+    d->pauseWhenHidden = pause;
+    updateStreamActivity();
+    Q_EMIT pauseWhenHiddenChanged(pause);
+}
+
+bool PipewireSourceItem::pauseWhenHidden() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->pauseWhenHidden;
+}
+
+void PipewireSourceItem::setScreenActive(bool active)
+{
+    Q_D(PipewireSourceItem);
+
+    if (active == d->screenActive)
+        return;
+
+    d->screenActive = active;
+    updateStreamActivity();
+    Q_EMIT screenActiveChanged(active);
+}
+
+bool PipewireSourceItem::screenActive() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->screenActive;
+}
+
 PipewireSourceItem::PipewireSourceItem(PipewireSourceItemPrivate &dd, QQuickItem *parent)
     : QQuickItem(dd, parent)
 {}
 
-void PipewireSourceItem::handleVisibleChanged()
+void PipewireSourceItem::setDownscaleToItem(bool downscale)
 {
     Q_D(PipewireSourceItem);
 
-    setEnabled(isVisible());
+    if (downscale == d->downscaleToItem)
+        return;
+
+    d->downscaleToItem = downscale;
+    updateDownscaleSize();
+    Q_EMIT downscaleToItemChanged(downscale);
+}
+
+bool PipewireSourceItem::downscaleToItem() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->downscaleToItem;
+}
+
+/*!
+ * Shows only \a rect of the stream, in stream pixels. CPU frames only copy and
+ * upload that part, DMA-BUF frames are cropped through texture coordinates. An
+ * invalid rectangle shows the whole stream.
+ */
+void PipewireSourceItem::setSourceRect(const QRect &rect)
+{
+    Q_D(PipewireSourceItem);
+
+    if (rect == d->sourceRect)
+        return;
+
+    d->sourceRect = rect;
+    if (d->stream)
+        d->stream->setSourceRect(rect);
+    Q_EMIT sourceRectChanged(rect);
+}
+
+QRect PipewireSourceItem::sourceRect() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->sourceRect;
+}
+
+/*!
+ * Limits the memory the producer spends on buffers for this item, in MiB. The
+ * buffer count follows the frame size and how long frames are kept, but at least
+ * two buffers are always used. 0 lifts the limit.
+ */
+void PipewireSourceItem::setBufferMemoryBudget(int megabytes)
+{
+    Q_D(PipewireSourceItem);
+
+    if (megabytes == d->bufferMemoryBudget)
+        return;
+
+    d->bufferMemoryBudget = megabytes;
+    if (d->stream)
+        d->stream->setBufferMemoryBudget(effectiveBufferBudget());
+    Q_EMIT bufferMemoryBudgetChanged(megabytes);
+}
+
+int PipewireSourceItem::bufferMemoryBudget() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->bufferMemoryBudget;
+}
+
+/*!
+ * Turns the item into a lightweight preview: frames are downsampled to
+ * previewSize on the CPU, the producer is asked for a low rate and few buffers,
+ * and frames are only taken when the shared PreviewScheduler grants them.
+ */
+void PipewireSourceItem::setPreview(bool preview)
+{
+    Q_D(PipewireSourceItem);
+
+    if (preview == d->preview)
+        return;
+
+    d->preview = preview;
+    // The stream negotiates differently for previews
+    if (d->stream)
+        refresh();
+    Q_EMIT previewChanged(preview);
+}
+
+bool PipewireSourceItem::preview() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->preview;
+}
+
+/*!
+ * Sets the pixel size previews are downsampled to, an invalid size uses the
+ * item's own pixel size.
+ */
+void PipewireSourceItem::setPreviewSize(const QSize &size)
+{
+    Q_D(PipewireSourceItem);
+
+    if (size == d->previewSize)
+        return;
+
+    d->previewSize = size;
+    updateDownscaleSize();
+    Q_EMIT previewSizeChanged(size);
+}
+
+QSize PipewireSourceItem::previewSize() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->previewSize;
+}
+
+/*!
+ * Makes the stream allocate shared memory buffers itself, backed by huge pages,
+ * rather than taking what the producer allocates. This rules out DMA-BUFs, it
+ * suits producers that render on the CPU.
+ */
+void PipewireSourceItem::setAllocateBuffers(bool allocate)
+{
+    Q_D(PipewireSourceItem);
+
+    if (allocate == d->allocateBuffers)
+        return;
+
+    d->allocateBuffers = allocate;
+    // Buffer allocation is chosen when the stream connects
     if (d->stream)
-        d->stream->setActive(isVisible());
+        refresh();
+    Q_EMIT allocateBuffersChanged(allocate);
 }
 
+bool PipewireSourceItem::allocateBuffers() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->allocateBuffers;
+}
+
+bool PipewireSourceItem::wantsPreviewFrame() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->preview && d->stream && d->streamActive && !d->previewGranted;
+}
+
+qint64 PipewireSourceItem::previewFrameCost() const
+{
+    Q_D(const PipewireSourceItem);
+
+    QSize size = d->stream ? d->stream->downscaleSize() : QSize();
+    if (!size.isValid() && d->stream)
+        size = d->stream->size();
+    return qint64(size.width()) * size.height() * 4;
+}
+
+void PipewireSourceItem::grantPreviewFrame()
+{
+    Q_D(PipewireSourceItem);
+    d->previewGranted = true;
+}
+
+/*!
+ * Sets how this item ranks against the other items of its window when their
+ * frames don't all fit in one vsync's upload budget, higher goes first.
+ */
+void PipewireSourceItem::setPriority(int priority)
+{
+    Q_D(PipewireSourceItem);
+
+    if (priority == d->priority)
+        return;
+
+    d->priority = priority;
+    Q_EMIT priorityChanged(priority);
+}
+
+int PipewireSourceItem::priority() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->priority;
+}
+
+/*!
+ * Sets the key the last frame is persisted under, for example the output name
+ * the wallpaper is shown on; node ids change between sessions and make poor keys.
+ * With a key the item shows the snapshot of the previous session as soon as it
+ * is created and crossfades to the stream once it delivers. An empty key, the
+ * default, disables snapshots.
+ */
+void PipewireSourceItem::setSnapshotKey(const QString &key)
+{
+    Q_D(PipewireSourceItem);
+
+    if (key == d->snapshotKey)
+        return;
+
+    d->snapshotKey = key;
+    if (key.isEmpty())
+        d->snapshotTimer.stop();
+    else if (isComponentComplete())
+        loadSnapshot();
+    Q_EMIT snapshotKeyChanged(key);
+}
+
+QString PipewireSourceItem::snapshotKey() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->snapshotKey;
+}
+
+/*!
+ * Shows the cursor the producer reports through stream metadata. It is off by
+ * default, as every buffer then carries room for a cursor bitmap. Toggling it
+ * renegotiates the buffers of the stream.
+ */
+void PipewireSourceItem::setCursorEnabled(bool enabled)
+{
+    Q_D(PipewireSourceItem);
+
+    if (enabled == d->cursorEnabled)
+        return;
+
+    d->cursorEnabled = enabled;
+    if (d->stream)
+        d->stream->setCursorEnabled(enabled);
+    if (!enabled) {
+        d->cursor = {};
+        update();
+    }
+    Q_EMIT cursorEnabledChanged(enabled);
+}
+
+bool PipewireSourceItem::cursorEnabled() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->cursorEnabled;
+}
+
+/*!
+ * Sets the largest cursor bitmap, in pixels per side, buffers have room for.
+ * Larger cursors arrive without a bitmap and are not drawn. Defaults to 256 and
+ * is capped at 1024.
+ */
+void PipewireSourceItem::setCursorMaxSize(int size)
+{
+    Q_D(PipewireSourceItem);
+
+    size = qBound(1, size, 1024);
+    if (size == d->cursorMaxSize)
+        return;
+
+    d->cursorMaxSize = size;
+    if (d->stream)
+        d->stream->setCursorMaxSize(size);
+    Q_EMIT cursorMaxSizeChanged(size);
+}
+
+int PipewireSourceItem::cursorMaxSize() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->cursorMaxSize;
+}
+
+/*!
+ * Maps the snapshot of the key, it is uploaded by the next updatePaintNode().
+ * Nothing is loaded once the stream delivered, its frames are newer.
+ */
+void PipewireSourceItem::loadSnapshot()
+{
+    Q_D(PipewireSourceItem);
+
+    if (d->snapshotKey.isEmpty() || d->stats.framesReceived > 0)
+        return;
+
+    d->snapshot = FrameSnapshot::load(d->snapshotKey);
+    if (!d->snapshot.isNull())
+        update();
+}
+
+/*!
+ * Saves the next frame the render thread handles as the snapshot of the key. CPU
+ * frames are scaled and written from their image on the snapshot thread.
+ */
+void PipewireSourceItem::saveSnapshot()
+{
+    Q_D(PipewireSourceItem);
+
+    if (d->snapshotKey.isEmpty() || !window() || !isVisible())
+        return;
+    if (MemoryPressureMonitor::instance()->stage() >= MemoryPressureMonitor::DropCaches)
+        return;
+
+    d->snapshotRequested = true;
+    update();
+}
+
+/*!
+ * Grabs the item at a reduced size for the snapshot, for imported frames that
+ * have no CPU image. The grab includes the cursor and damage overlays.
+ */
+void PipewireSourceItem::grabSnapshot()
+{
+    Q_D(PipewireSourceItem);
+
+    if (d->snapshotKey.isEmpty() || !window() || !isVisible())
+        return;
+
+    const QSize pixelSize = (boundingRect().size() * window()->effectiveDevicePixelRatio()).toSize();
+    const QSize target = ImageScaler::targetSize(pixelSize, maxSnapshotSize);
+    if (target.isEmpty())
+        return;
+
+    // The previous grab is released here rather than from its own ready signal
+    d->snapshotGrab = grabToImage(target);
+    if (!d->snapshotGrab)
+        return;
+
+    QQuickItemGrabResult *grab = d->snapshotGrab.data();
+    const QString key = d->snapshotKey;
+    connect(grab, &QQuickItemGrabResult::ready, this, [this, grab, key] {
+        d_func()->snapshotPool.start(new SaveSnapshotRunnable(key, grab->image(), PipeWireTransform::Normal));
+    });
+}
+
+/*!
+ * Returns frame counters: received from the stream, dropped because a newer one
+ * arrived before they were shown, shown, and deferred to a later vsync by the
+ * window's frame scheduler. Also returns how often the stream was reconnected
+ * and how many milliseconds the last recovery took from the stream stopping to
+ * its first new frame, -1 before any recovery. The current memory pressure
+ * stage and how often it changed are process wide.
+ */
+QVariantMap PipewireSourceItem::statistics() const
+{
+    Q_D(const PipewireSourceItem);
+
+    return {
+        {QStringLiteral("framesReceived"), d->stats.framesReceived},
+        {QStringLiteral("framesDropped"), d->stats.framesDropped},
+        {QStringLiteral("framesShown"), d->stats.framesShown.load(std::memory_order_relaxed)},
+        {QStringLiteral("framesDeferred"), d->stats.framesDeferred.load(std::memory_order_relaxed)},
+        {QStringLiteral("recoveries"), d->stats.recoveries},
+        {QStringLiteral("lastRecoveryTime"), d->stats.lastRecoveryTime},
+        {QStringLiteral("memoryPressureStage"), int(MemoryPressureMonitor::instance()->stage())},
+        {QStringLiteral("memoryPressureTransitions"), MemoryPressureMonitor::instance()->transitions()},
+    };
+}
+
+bool PipewireSourceItem::hasPendingFrame(bool *dmabuf) const
+{
+    Q_D(const PipewireSourceItem);
+    return d->frameSlot.hasFrame(dmabuf);
+}
+
+qint64 PipewireSourceItem::pendingFrameCost() const
+{
+    Q_D(const PipewireSourceItem);
+
+    if (!d->stream)
+        return 0;
+
+    const QSize source = d->sourceRect.isValid() ? d->sourceRect.size() : d->stream->size();
+    const QSize size = ImageScaler::targetSize(source, d->stream->downscaleSize());
+    return qint64(size.width()) * size.height() * 4;
+}
+
+int PipewireSourceItem::consecutiveDeferrals() const
+{
+    Q_D(const PipewireSourceItem);
+    return d->consecutiveDeferrals;
+}
+
+void PipewireSourceItem::deferFrame()
+{
+    Q_D(PipewireSourceItem);
+    d->frameDeferred = true;
+}
+
+/*!
+ * Returns the buffer budget in bytes, a quarter of it once memory pressure asks
+ * for fewer buffers. Without a budget the stream then gets the smallest count.
+ */
+qint64 PipewireSourceItem::effectiveBufferBudget() const
+{
+    Q_D(const PipewireSourceItem);
+
+    const qint64 budget = qint64(d->bufferMemoryBudget) * 1024 * 1024;
+    if (MemoryPressureMonitor::instance()->stage() < MemoryPressureMonitor::ReduceBuffers)
+        return budget;
+    return budget > 0 ? budget / 4 : 1;
+}
+
+int PipewireSourceItem::effectiveMaxFrameRate() const
+{
+    Q_D(const PipewireSourceItem);
+
+    int fps = d->preview ? PreviewScheduler::instance()->maxFrameRate() : 0;
+    if (MemoryPressureMonitor::instance()->stage() >= MemoryPressureMonitor::ReduceFrameRate)
+        fps = fps > 0 ? qMin(fps, pressureFrameRate) : pressureFrameRate;
+    return fps;
+}
+
+/*!
+ * Applies the memory pressure stage to the stream. Every stage also applies the
+ * ones below it, and going back a stage restores what it changed.
+ */
+void PipewireSourceItem::applyMemoryPressure()
+{
+    Q_D(PipewireSourceItem);
+
+    if (MemoryPressureMonitor::instance()->stage() >= MemoryPressureMonitor::DropCaches) {
+        // A snapshot not shown yet is dropped, the live frame follows soon anyway
+        d->snapshot = QImage();
+        d->snapshotGrab.reset();
+        if (d->stream)
+            d->stream->dropCachedImages();
+    }
+
+    if (!d->stream)
+        return;
+
+    d->stream->setBufferMemoryBudget(effectiveBufferBudget());
+    d->stream->setMaxFrameRate(effectiveMaxFrameRate());
+    updateDownscaleSize();
+    updateStreamActivity();
+}
+
+void PipewireSourceItem::updateDownscaleSize()
+{
+    Q_D(PipewireSourceItem);
+
+    if (!d->stream)
+        return;
+
+    if (d->preview && d->previewSize.isValid()) {
+        d->stream->setDownscaleSize(d->previewSize);
+        return;
+    }
+
+    // Under memory pressure CPU frames are never kept larger than they are shown
+    const bool reduce = MemoryPressureMonitor::instance()->stage() >= MemoryPressureMonitor::ReduceBuffers;
+    if ((!d->downscaleToItem && !d->preview && !reduce) || !window()) {
+        d->stream->setDownscaleSize(QSize());
+        return;
+    }
+
+    // Frames are drawn with Qt::KeepAspectRatio, so the item's pixel size bounds what is visible
+    QSize pixelSize = (size() * window()->effectiveDevicePixelRatio()).toSize();
+    // Rotated frames cover the item with their height
+    if (isTransposed(d->transform))
+        pixelSize.transpose();
+    d->stream->setDownscaleSize(pixelSize.expandedTo(QSize(1, 1)));
+}
+
+void PipewireSourceItem::handleVisibleChanged()
+{
+    setEnabled(isVisible());
+    updateStreamActivity();
+}
+
+void PipewireSourceItem::updateStreamActivity()
+{
+    Q_D(PipewireSourceItem);
+
+    if (!d->stream)
+        return;
+
+    const bool pauseHidden = d->pauseWhenHidden || MemoryPressureMonitor::instance()->stage() >= MemoryPressureMonitor::PauseHidden;
+    const bool active = !pauseHidden || isWallpaperVisible();
+    if (active == d->streamActive)
+        return;
+
+    // On resume only the newest queued buffer is shown
+    d->streamActive = active;
+    d->stream->setActive(active);
+}
+
+bool PipewireSourceItem::isWallpaperVisible() const
+{
+    Q_D(const PipewireSourceItem);
+
+    if (!isVisible() || !isComponentComplete() || !d->screenActive)
+        return false;
+
+    QQuickWindow *win = window();
+    if (!win || !win->isVisible() || !win->isExposed())
+        return false;
+
+    if (win->visibility() == QWindow::Minimized || win->visibility() == QWindow::Hidden || (win->windowStates() & Qt::WindowMinimized))
+        return false;
+
+    return !visibleSceneRect().isEmpty();
+}
+
+/*!
+ * Returns the part of the item that is inside the window and not clipped away by
+ * an ancestor, in scene coordinates.
+ */
+QRectF PipewireSourceItem::visibleSceneRect() const
+{
+    QQuickWindow *win = window();
+    if (!win)
+        return QRectF();
+
+    QRectF visibleRect = mapRectToScene(clipRect()).intersected(QRectF(0, 0, win->width(), win->height()));
+    for (QQuickItem *p = parentItem(); p && !visibleRect.isEmpty(); p = p->parentItem()) {
+        if (p->clip())
+            visibleRect = visibleRect.intersected(p->mapRectToScene(p->clipRect()));
+    }
+    return visibleRect;
+}
+
+void PipewireSourceItem::trackWindow(QQuickWindow *window)
+{
+    Q_D(PipewireSourceItem);
+
+    if (d->trackedWindow == window)
+        return;
+
+    if (d->trackedWindow) {
+        FrameScheduler::forWindow(d->trackedWindow)->removeItem(this);
+        d->trackedWindow->removeEventFilter(this);
+        for (auto &connection : d->windowConnections)
+            disconnect(connection);
+    }
+
+    d->trackedWindow = window;
+    if (!window)
+        return;
+
+    FrameScheduler::forWindow(window)->addItem(this);
+
+    // QWindow has no signal for exposure changes, so watch its expose events
+    window->installEventFilter(this);
+    d->windowConnections[0] = connect(window, &QWindow::visibilityChanged, this, &PipewireSourceItem::updateStreamActivity);
+    d->windowConnections[1] = connect(window, &QWindow::windowStateChanged, this, &PipewireSourceItem::updateStreamActivity);
+    d->windowConnections[2] = connect(window, &QWindow::widthChanged, this, &PipewireSourceItem::updateStreamActivity);
+    d->windowConnections[3] = connect(window, &QWindow::heightChanged, this, &PipewireSourceItem::updateStreamActivity);
+    // Ancestors change what is visible without telling us, the GUI thread is blocked here
+    d->windowConnections[4] = connect(window, &QQuickWindow::beforeSynchronizing, this, [this] {
+        Q_D(PipewireSourceItem);
+        const bool visible = isWallpaperVisible();
+        if (visible != d->syncedVisible) {
+            d->syncedVisible = visible;
+            QMetaObject::invokeMethod(this, &PipewireSourceItem::updateStreamActivity, Qt::QueuedConnection);
+        }
+    }, Qt::DirectConnection);
+}
+
+bool PipewireSourceItem::eventFilter(QObject *watched, QEvent *event)
+{
+    Q_D(PipewireSourceItem);
+
+    if (watched == d->trackedWindow && event->type() == QEvent::Expose) {
+        // Let the window handle the expose first, isExposed() is updated there
+        QMetaObject::invokeMethod(this, &PipewireSourceItem::updateStreamActivity, Qt::QueuedConnection);
+    }
+
+    return QQuickItem::eventFilter(watched, event);
+}
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+void PipewireSourceItem::geometryChanged(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+    QQuickItem::geometryChanged(newGeometry, oldGeometry);
+    updateStreamActivity();
+    if (newGeometry.size() != oldGeometry.size())
+        updateDownscaleSize();
+    // Moving a tiled frame around can bring other tiles into view
+    if (d_func()->tiled)
+        update();
+}
+#else
+void PipewireSourceItem::geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+    QQuickItem::geometryChange(newGeometry, oldGeometry);
+    updateStreamActivity();
+    if (newGeometry.size() != oldGeometry.size())
+        updateDownscaleSize();
+    // Moving a tiled frame around can bring other tiles into view
+    if (d_func()->tiled)
+        update();
+}
+#endif
+
 void PipewireSourceItem::componentComplete()
 {
     Q_D(const PipewireSourceItem);
 
     QQuickItem::componentComplete();
+    // Shown while the stream connects, which takes several round trips to the daemon
+    loadSnapshot();
     if (d->nodeId != 0) {
         refresh();
     }
@@ -161,45 +1008,235 @@ void PipewireSourceItem::releaseResources()
 {
     Q_D(PipewireSourceItem);
 
-    if (window()) {
-        window()->scheduleRenderJob(new DiscardEglPixmapRunnable(d->image, d->texture.take()), QQuickWindow::NoStage);
-        d->image = EGL_NO_IMAGE_KHR;
+    if (window() && d->backend) {
+        // The backend owns native graphics resources, release them on the render thread
+        window()->scheduleRenderJob(new DiscardTextureBackendRunnable(d->backend.take()), QQuickWindow::NoStage);
+    }
+    if (window() && d->provider) {
+        window()->scheduleRenderJob(new DiscardTextureProviderRunnable(d->provider), QQuickWindow::NoStage);
+        d->provider = nullptr;
+    }
+    if (window() && d->atlasTile) {
+        // Frees the tile's place in the atlas of the window the item leaves
+        if (d->createNextTexture == d->atlasTile)
+            d->createNextTexture = nullptr;
+        window()->scheduleRenderJob(new DiscardTextureRunnable(d->atlasTile), QQuickWindow::NoStage);
+        d->atlasTile = nullptr;
+        d->atlasFits = false;
+    }
+}
+
+/*!
+ * Called on the render thread when the scene graph goes away, together with the
+ * textures the provider pointed at.
+ */
+void PipewireSourceItem::invalidateSceneGraph()
+{
+    Q_D(PipewireSourceItem);
+
+    delete d->provider;
+    d->provider = nullptr;
+    delete d->atlasTile;
+    d->atlasTile = nullptr;
+    d->atlasFits = false;
+    d->backend.reset();
+    d->createNextTexture = nullptr;
+    // Frames written into upload buffers point into memory the context takes along
+    d->snapshotPool.waitForDone();
+    d->frameSlot.dropImages();
+    d->tiledFrame = QImage();
+}
+
+bool PipewireSourceItem::isTextureProvider() const
+{
+    return true;
+}
+
+/*!
+ * Returns a provider for the texture the newest frame was imported or uploaded
+ * into, so that effects can sample the stream without a layer in between. It is
+ * updated in updatePaintNode(), the item must therefore stay visible; use it
+ * with an opacity of 0 to only show the stream through the consumer. Frames too
+ * large for a single texture are shown as tiles and provide no texture.
+ */
+QSGTextureProvider *PipewireSourceItem::textureProvider() const
+{
+    // With layer.enabled the layer is the provider
+    if (QQuickItem::isTextureProvider())
+        return QQuickItem::textureProvider();
+
+    Q_D(const PipewireSourceItem);
+    if (!d->provider) {
+        d->provider = new PipeWireTextureProvider;
+        d->provider->setTexture(d->tiled ? nullptr : d->createNextTexture);
     }
+    return d->provider;
 }
 
 QSGNode *PipewireSourceItem::updatePaintNode(QSGNode *node, UpdatePaintNodeData *data)
 {
     Q_D(PipewireSourceItem);
 
-    if (Q_UNLIKELY(!d->createNextTexture)) {
-        return node;
+    FrameTraceScope trace("updatePaintNode", d->nodeId);
+
+    if (!d->backend) {
+        d->backend.reset(TextureBackend::create(window()));
+        // EGL modifiers are queried by the stream itself, other APIs have to report theirs
+        if (d->backend->graphicsApi() != QSGRendererInterface::OpenGL) {
+            d->videoFormats = d->backend->videoFormats();
+            d->dmaBufModifiers = d->backend->dmaBufModifiers(d->videoFormats);
+            d->dmaBufModifiersKnown = true;
+            if (d->stream) {
+                d->stream->setVideoFormats(d->videoFormats);
+                d->stream->setDmaBufModifiers(d->dmaBufModifiers);
+            }
+            if (d->streamWaitsForBackend)
+                QMetaObject::invokeMethod(this, &PipewireSourceItem::refresh, Qt::QueuedConnection);
+        }
     }
 
-    auto texture = d->createNextTexture;
-    if (!texture) {
-        delete node;
-        return nullptr;
+    if (d->dmaBufsInvalidated) {
+        d->backend->clearDmaBufs();
+        d->dmaBufsInvalidated = false;
+    }
+    for (quint64 id : qAsConst(d->removedDmaBufs)) {
+        d->backend->removeDmaBuf(id);
+    }
+    d->removedDmaBufs.clear();
+    if (d->stream)
+        d->backend->setMaxDmaBufs(d->stream->bufferCount());
+
+    PipeWireFrame frame;
+    PipeWireFrame previous;
+    if (d->frameDeferred) {
+        // Other items of the window used this vsync's budget, the frame waits for the next
+        d->frameDeferred = false;
+        ++d->consecutiveDeferrals;
+        d->stats.framesDeferred.fetch_add(1, std::memory_order_relaxed);
+        QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+    } else if (d->frameSlot.take(&frame, &previous)) {
+        d->consecutiveDeferrals = 0;
+        d->stats.framesShown.fetch_add(1, std::memory_order_relaxed);
+
+        // An imported DMA-BUF is read by the GPU until the next frame replaces it
+        if (previous.dmabuf && d->stream)
+            d->stream->releaseBuffer(previous.buffer);
+
+        d->damage = frame.damage.value_or(PipeWireDamage());
+        d->frameSourceRect = frame.sourceRect;
+        d->frameTransform = frame.transform;
+        if (frame.dmabuf)
+            importDmaBuf(frame);
+        else
+            uploadFrame(frame);
+    }
+
+    const bool hasFrame = d->createNextTexture || d->tiled;
+    if (Q_UNLIKELY(!hasFrame && !d->snapshotVisible && d->snapshot.isNull())) {
+        return node;
     }
 
-    QSGImageNode *screenNode;
     auto pwNode = dynamic_cast<PipeWireRenderNode *>(node);
     if (!pwNode) {
         delete node;
         pwNode = new PipeWireRenderNode;
-        screenNode = window()->createImageNode();
-        screenNode->setOwnsTexture(true);
-        pwNode->appendChildNode(screenNode);
-    } else {
-        screenNode = static_cast<QSGImageNode *>(pwNode->childAtIndex(0));
     }
-    screenNode->setTexture(texture);
+    const bool software = d->backend->graphicsApi() == QSGRendererInterface::Software;
 
     const auto br = boundingRect().toRect();
-    QRect rect({0, 0}, texture->textureSize().scaled(br.size(), Qt::KeepAspectRatio));
-    rect.moveCenter(br.center());
-    screenNode->setRect(rect);
+    QSize frameSize;
+    QRect rect;
+    if (d->tiled) {
+        if (d->provider)
+            d->provider->setTexture(nullptr);
+        pwNode->discardScreen();
+        pwNode->discardAtlas();
+        TiledTextureNode *tiledNode = pwNode->tiledNode(software ? softwareTileSize : frameTileSize);
+        if (!d->tiledFrame.isNull()) {
+            // After a frame that was never shown every tile is uploaded again
+            QRegion damage;
+            if (!d->fullTileRefresh) {
+                for (const QRect &damageRect : qAsConst(d->damage)) {
+                    damage += damageRect;
+                }
+            }
+            tiledNode->setFrame(d->tiledFrame, damage);
+            d->tiledFrame = QImage();
+            d->fullTileRefresh = false;
+        }
 
-    if (d->cursor.position.isNull() || d->cursor.texture.isNull()) {
+        frameSize = tiledNode->frameSize();
+        rect = contentRect(frameSize, br, d->frameTransform);
+
+        // Only tiles in the part of the frame that can be seen get a texture
+        const QMatrix4x4 toContent = contentMatrix(d->frameTransform, QRectF(rect).center()).inverted();
+        const QRectF visible = toContent.mapRect(mapRectFromScene(visibleSceneRect())).intersected(rect);
+        const qreal scale = qreal(frameSize.width()) / rect.width();
+        const QRect visibleSource = QRectF((visible.x() - rect.x()) * scale, (visible.y() - rect.y()) * scale, visible.width() * scale, visible.height() * scale)
+                                            .toAlignedRect();
+        tiledNode->update(window(), rect, visibleSource);
+    } else if (d->createNextTexture) {
+        pwNode->discardTiles();
+        auto texture = d->createNextTexture;
+        QSGImageNode *screenNode;
+        if (texture == d->atlasTile) {
+            pwNode->discardScreen();
+            // Setting the tile again picks up its new place after the atlas was repacked
+            screenNode = pwNode->atlasNode(window());
+            screenNode->setTexture(texture);
+        } else {
+            pwNode->discardAtlas();
+            screenNode = pwNode->screenNode(window());
+            // The node owns its texture, handing the same one back would delete it
+            if (screenNode->texture() != texture)
+                screenNode->setTexture(texture);
+        }
+        // Emits textureChanged once per new frame texture
+        if (d->provider)
+            d->provider->setTexture(texture);
+
+        // Imported buffers hold the whole stream and are cropped here
+        const QRectF sourceRect = d->textureSourceRect.isValid() ? d->textureSourceRect : QRectF({0, 0}, texture->textureSize());
+        frameSize = sourceRect.size().toSize();
+        rect = contentRect(frameSize, br, d->frameTransform);
+        screenNode->setSourceRect(sourceRect);
+        screenNode->setRect(rect);
+    }
+    pwNode->setContentMatrix(contentMatrix(d->frameTransform, QRectF(rect).center()));
+
+    // The tile is only kept while frames fit it, its node is gone by now
+    if (d->atlasTile && !d->atlasFits) {
+        delete d->atlasTile;
+        d->atlasTile = nullptr;
+    }
+
+    if (!d->snapshot.isNull()) {
+        // The texture keeps the mapped image for as long as it needs it
+        pwNode->snapshotNode(window())->setTexture(window()->createTextureFromImage(d->snapshot));
+        d->snapshot = QImage();
+        d->snapshotVisible = true;
+        d->snapshotFade.invalidate();
+    }
+    if (d->snapshotVisible) {
+        // Fades out once the stream shows its first frame
+        if (hasFrame && !d->snapshotFade.isValid())
+            d->snapshotFade.start();
+        const qreal opacity = d->snapshotFade.isValid() ? 1 - qreal(d->snapshotFade.elapsed()) / snapshotFadeDuration : 1;
+        QSGImageNode *snapshotNode = pwNode->snapshotNode(window());
+        if (opacity <= 0 || !snapshotNode->texture()) {
+            pwNode->discardSnapshot();
+            d->snapshotVisible = false;
+        } else {
+            QRect snapshotRect({0, 0}, snapshotNode->texture()->textureSize().scaled(br.size(), Qt::KeepAspectRatio));
+            snapshotRect.moveCenter(br.center());
+            snapshotNode->setRect(snapshotRect);
+            pwNode->setSnapshotOpacity(opacity);
+            if (d->snapshotFade.isValid())
+                QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+        }
+    }
+
+    if (d->cursor.position.isNull() || d->cursor.texture.isNull() || !d->frameSourceRect.contains(d->cursor.position)) {
         pwNode->discardCursor();
     } else {
         QSGImageNode *cursorNode = pwNode->cursorNode(window());
@@ -207,25 +1244,40 @@ QSGNode *PipewireSourceItem::updatePaintNode(QSGNode *node, UpdatePaintNodeData
             cursorNode->setTexture(window()->createTextureFromImage(d->cursor.texture));
             d->cursor.dirty = false;
         }
-        const qreal scale = qreal(rect.width()) / texture->textureSize().width();
-        cursorNode->setRect(QRectF{rect.topLeft() + (d->cursor.position * scale), d->cursor.texture.size() * scale});
+        // Cursor metadata is in stream coordinates, the frame may be cropped and downscaled
+        const qreal scale = qreal(rect.width()) / d->frameSourceRect.width();
+        const QPoint position = d->cursor.position - d->frameSourceRect.topLeft();
+        cursorNode->setRect(QRectF{rect.topLeft() + (position * scale), d->cursor.texture.size() * scale});
         Q_ASSERT(cursorNode->texture());
     }
 
-    if (d->damage.isNull() || d->damage.isEmpty()) {
+    // The software renderer would repaint the previous frame's rects along with them
+    if (d->damage.isEmpty() || frameSize.isEmpty() || software) {
         pwNode->discardDamage();
     } else {
-        auto *damageNode = pwNode->damageNode(window());
-        QImage damageImage(texture->textureSize(), QImage::Format_RGBA64_Premultiplied);
-        damageImage.fill(Qt::transparent);
-        QPainter p(&damageImage);
-        p.setBrush(Qt::red);
-        for (auto rect : d->damage) {
-            p.drawRect(rect);
+        // Rectangles instead of an image of the frame, which tiled frames are too large for
+        QSGNode *damageNode = pwNode->damageNode();
+        const qreal scaleX = qreal(rect.width()) / frameSize.width();
+        const qreal scaleY = qreal(rect.height()) / frameSize.height();
+        QSGNode *child = damageNode->firstChild();
+        for (const QRect &damageRect : qAsConst(d->damage)) {
+            auto rectNode = static_cast<QSGRectangleNode *>(child);
+            if (!rectNode) {
+                rectNode = window()->createRectangleNode();
+                rectNode->setColor(Qt::red);
+                damageNode->appendChildNode(rectNode);
+            }
+            rectNode->setRect(QRectF(rect.x() + damageRect.x() * scaleX, rect.y() + damageRect.y() * scaleY,
+                                     damageRect.width() * scaleX, damageRect.height() * scaleY));
+            child = rectNode->nextSibling();
+        }
+        // Rects left over from a frame with more damage
+        while (child) {
+            QSGNode *next = child->nextSibling();
+            damageNode->removeChildNode(child);
+            delete child;
+            child = next;
         }
-        damageNode->setTexture(window()->createTextureFromImage(damageImage));
-        damageNode->setRect(rect);
-        Q_ASSERT(damageNode->texture());
     }
     return pwNode;
 }
@@ -237,12 +1289,17 @@ void PipewireSourceItem::itemChange(ItemChange change, const ItemChangeData &dat
     switch (change) {
     case ItemVisibleHasChanged:
         setEnabled(isVisible());
-        if (d->stream)
-            d->stream->setActive(isVisible() && data.boolValue && isComponentComplete());
+        updateStreamActivity();
         break;
     case ItemSceneChange:
-        d->needsRecreateTexture = true;
         releaseResources();
+        TextureBackend::configureWindow(data.window);
+        trackWindow(data.window);
+        updateStreamActivity();
+        updateDownscaleSize();
+        break;
+    case ItemDevicePixelRatioHasChanged:
+        updateDownscaleSize();
         break;
     default:
         break;
@@ -253,8 +1310,21 @@ void PipewireSourceItem::processFrame(const PipeWireFrame &frame)
 {
     Q_D(PipewireSourceItem);
 
-    d->damage = frame.damage.value();
+    FrameTraceScope trace("publish", d->nodeId);
+    trace.setFrame(frame.presentationTimestamp, frame.sequential);
+
+    const bool hasContent = frame.dmabuf || frame.image || frame.buffer;
+    if (d->preview && hasContent) {
+        // Not this preview's turn, the buffer goes straight back to the producer
+        if (!d->previewGranted) {
+            d->stream->releaseBuffer(frame.buffer);
+            d->frameSlot.requestFullUpdate();
+            return;
+        }
+        d->previewGranted = false;
+    }
 
+    // Only metadata is handled here, pixels are imported or copied on the render thread
     if (frame.cursor) {
         d->cursor.position = frame.cursor->position;
         d->cursor.hotspot = frame.cursor->hotspot;
@@ -264,10 +1334,28 @@ void PipewireSourceItem::processFrame(const PipeWireFrame &frame)
         }
     }
 
-    if (frame.dmabuf) {
-        updateTextureDmaBuf(frame.dmabuf.value(), frame.format);
-    } else if (frame.image) {
-        updateTextureImage(frame.image.value());
+    if (hasContent) {
+        // A rotation by 90 degrees swaps what the downscale size bounds
+        const bool transposedChanged = isTransposed(frame.transform) != isTransposed(d->transform);
+        d->transform = frame.transform;
+        if (transposedChanged)
+            updateDownscaleSize();
+        if (d->recoveryTimer.isValid()) {
+            ++d->stats.recoveries;
+            d->stats.lastRecoveryTime = d->recoveryTimer.elapsed();
+            d->recoveryTimer.invalidate();
+        }
+        d->reconnectAttempts = 0;
+        ++d->stats.framesReceived;
+        if (!d->snapshotKey.isEmpty() && !d->snapshotTimer.isActive())
+            d->snapshotTimer.start(snapshotInterval);
+        PipeWireFrame dropped;
+        if (d->frameSlot.publish(frame, &dropped)) {
+            ++d->stats.framesDropped;
+            d->stream->releaseBuffer(dropped.buffer);
+        }
+        if (frame.dmabuf)
+            setEnabled(true);
     }
 
     if (window() && window()->isVisible()) {
@@ -275,72 +1363,111 @@ void PipewireSourceItem::processFrame(const PipeWireFrame &frame)
     }
 }
 
-void PipewireSourceItem::updateTextureDmaBuf(const DmaBufAttributes &attribs, spa_video_format format)
+void PipewireSourceItem::importDmaBuf(const PipeWireFrame &frame)
 {
     Q_D(PipewireSourceItem);
 
-    if (!window()) {
-        qWarning() << "Window not available" << this;
+    FrameTraceScope trace("import", d->nodeId);
+    trace.setFrame(frame.presentationTimestamp, frame.sequential);
+
+    // The buffer is gone when the stream renegotiated since the frame was published
+    if (!d->stream || !d->stream->isBufferHeld(frame.buffer)) {
+        d->fullTileRefresh = true;
         return;
     }
 
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-    const auto openglContext = window()->openglContext();
-#else
-    const auto openglContext = static_cast<QOpenGLContext *>(window()->rendererInterface()->getResource(window(), QSGRendererInterface::OpenGLContextResource));
-#endif
-    if (!openglContext || !d->stream) {
-        qWarning() << "need a window and a context" << window();
+    // Linear buffers the backend can't import are mapped, so the producer keeps exporting DMA-BUFs
+    const DmaBufAttributes &attribs = frame.dmabuf.value();
+    const bool mappable = PipewireSourceStream::isDmaBufMappable(frame);
+    if (mappable && (!d->backend->supportsDmaBuf() || d->dmaBufImportFailed)) {
+        uploadFrame(frame);
         return;
     }
 
-    const EGLDisplay display = static_cast<EGLDisplay>(QGuiApplication::platformNativeInterface()->nativeResourceForIntegration("egldisplay"));
-    if (d->image) {
-        eglDestroyImage(display, d->image);
-    }
-    const auto size = d->stream->size();
-    const EGLContext context = static_cast<EGLContext>(QGuiApplication::platformNativeInterface()->nativeResourceForIntegration("eglcontext"));
-    d->image = EGLHelpers::createImage(display, context, attribs, PipewireSourceStream::spaVideoFormatToDrmFormat(format), size);
-    if (d->image == EGL_NO_IMAGE_KHR) {
-        d->stream->renegotiateModifierFailed(format, attribs.modifier);
-        d->createNextTexture = nullptr;
-    }
-    if (!d->texture) {
-        d->texture.reset(new QOpenGLTexture(QOpenGLTexture::Target2D));
-        bool created = d->texture->create();
-        Q_ASSERT(created);
+    QSGTexture *texture = d->backend->importDmaBuf(window(), attribs, frame.format, d->stream->size());
+    if (!texture) {
+        if (mappable) {
+            d->dmaBufImportFailed = true;
+            uploadFrame(frame);
+            return;
+        }
+        d->stream->renegotiateModifierFailed(frame.format, attribs.modifier);
+        d->fullTileRefresh = true;
+        return;
     }
 
-    d->texture->bind();
-
-    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)d->image);
-
-    d->texture->setWrapMode(QOpenGLTexture::ClampToEdge);
-    d->texture->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
-    d->texture->release();
-    d->texture->setSize(size.width(), size.height());
+    d->tiled = false;
+    d->atlasFits = false;
+    d->textureSourceRect = frame.sourceRect;
+    d->createNextTexture = texture;
 
-    int textureId = d->texture->textureId();
-    QQuickWindow::CreateTextureOption textureOption =
-            format == SPA_VIDEO_FORMAT_ARGB || format == SPA_VIDEO_FORMAT_BGRA ? QQuickWindow::TextureHasAlphaChannel : QQuickWindow::TextureIsOpaque;
-    setEnabled(true);
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-    d->createNextTexture = window()->createTextureFromNativeObject(QQuickWindow::NativeObjectTexture, &textureId, 0 /*a vulkan thing?*/, size, textureOption);
-#else
-    d->createNextTexture = QNativeInterface::QSGOpenGLTexture::fromNative(textureId, window(), size, textureOption);
-#endif
+    if (d->snapshotRequested) {
+        d->snapshotRequested = false;
+        QMetaObject::invokeMethod(this, &PipewireSourceItem::grabSnapshot, Qt::QueuedConnection);
+    }
 }
 
-void PipewireSourceItem::updateTextureImage(const QImage &image)
+void PipewireSourceItem::uploadFrame(const PipeWireFrame &frame)
 {
     Q_D(PipewireSourceItem);
 
-    if (!window()) {
-        qWarning() << "pass";
+    FrameTraceScope trace("upload", d->nodeId);
+    trace.setFrame(frame.presentationTimestamp, frame.sequential);
+
+    QImage image;
+    std::optional<PipeWireDamage> damage = frame.damage;
+    if (frame.image) {
+        image = frame.image.value();
+    } else if (d->stream) {
+        // Held buffers go back once copied, mapped DMA-BUFs included
+        image = d->stream->frameImage(frame, &damage);
+        d->stream->releaseBuffer(frame.buffer);
+        if (frame.dmabuf)
+            d->frameSlot.releaseCurrentBuffer();
+    }
+    if (image.isNull()) {
+        d->fullTileRefresh = true;
+        return;
+    }
+    d->damage = damage.value_or(PipeWireDamage());
+
+    if (d->snapshotRequested) {
+        d->snapshotRequested = false;
+        d->snapshotPool.start(new SaveSnapshotRunnable(d->snapshotKey, image, d->frameTransform));
+    }
+
+    // Huge frames go through tiles, and so does everything in software, where only
+    // damaged tiles get repainted
+    const bool software = d->backend->graphicsApi() == QSGRendererInterface::Software;
+    if (software || TiledTextureNode::needsTiling(image.size(), d->backend->maxTextureSize())) {
+        d->tiled = true;
+        d->atlasFits = false;
+        d->tiledFrame = image;
+        d->createNextTexture = nullptr;
         return;
     }
 
-    d->createNextTexture = window()->createTextureFromImage(image, QQuickWindow::TextureIsOpaque);
+    d->tiled = false;
+    d->textureSourceRect = QRectF({0, 0}, image.size());
+
+    // Small frames share one texture with the window's other small streams, so they batch,
+    // of the same byte order. A tile of another atlas is replaced once the node let go of it
+    TextureAtlas *atlas = TextureAtlas::fits(image.size()) ? TextureAtlas::forWindow(window(), image.format()) : nullptr;
+    d->atlasFits = atlas && (!d->atlasTile || atlas->hasTile(d->atlasTile));
+    if (d->atlasFits) {
+        if (!d->atlasTile)
+            d->atlasTile = atlas->createTile(this);
+        if (atlas->upload(d->atlasTile, image)) {
+            d->createNextTexture = d->atlasTile;
+            return;
+        }
+    }
+    d->createNextTexture = d->backend->uploadImage(window(), image);
+
+    // Later frames are copied straight into the upload buffers
+    const QExplicitlySharedDataPointer<PboFrameWriter> writer = d->backend->frameWriter();
+    if (d->stream && d->stream->frameWriter() != writer)
+        d->stream->setFrameWriter(writer);
 }
 
 void PipewireSourceItem::refresh()
@@ -353,19 +1480,133 @@ void PipewireSourceItem::refresh()
         return;
     }
 
+    // Published frames refer to buffers of the stream that is replaced
+    d->frameSlot.clear();
+    d->previewGranted = false;
+    d->streamWaitsForBackend = false;
+    d->dmaBufsInvalidated = true;
+    d->removedDmaBufs.clear();
     if (d->nodeId == 0) {
+        PreviewScheduler::instance()->removePreview(this);
         d->stream.reset(nullptr);
+        d->streamActive = false;
         d->createNextTexture = nullptr;
     } else {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        // Without GL only the texture backend knows what can be imported, connecting
+        // before it exists would negotiate shared memory and renegotiate right after
+        if (QQuickWindow::graphicsApi() != QSGRendererInterface::OpenGL && !d->dmaBufModifiersKnown) {
+            d->stream.reset(nullptr);
+            d->streamActive = false;
+            d->streamWaitsForBackend = true;
+            update();
+            return;
+        }
+#endif
         d->stream.reset(new PipewireSourceStream(this));
+        d->dmaBufImportFailed = false;
+        d->stream->setHoldBuffers(true);
+        if (d->lastFormat)
+            d->stream->setPreferredFormat(*d->lastFormat);
+        d->stream->setPreviewMode(d->preview);
+        d->stream->setAllocateBuffers(d->allocateBuffers);
+        d->stream->setCursorEnabled(d->cursorEnabled);
+        d->stream->setCursorMaxSize(d->cursorMaxSize);
+        d->stream->setMaxFrameRate(effectiveMaxFrameRate());
+        d->stream->setSourceRect(d->sourceRect);
+        d->stream->setBufferMemoryBudget(effectiveBufferBudget());
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        // Without GL the stream can't ask EGL, only the texture backend knows what can be imported
+        // and which formats it uploads without a conversion
+        if (QQuickWindow::graphicsApi() != QSGRendererInterface::OpenGL) {
+            d->stream->setVideoFormats(d->videoFormats);
+            d->stream->setDmaBufModifiers(d->dmaBufModifiers);
+        }
+#else
+        // The software renderer reads frames on the CPU, only DMA-BUFs the stream can map work
+        if (QQuickWindow::sceneGraphBackend() == QLatin1String("software"))
+            d->stream->setDmaBufModifiers(PipewireSourceStream::mappableDmaBufModifiers(PipewireSourceStream::supportedVideoFormats()));
+#endif
         d->stream->createStream(d->nodeId, d->fd);
         if (!d->stream->error().isEmpty()) {
             d->stream.reset(nullptr);
+            // While recovering the daemon may just not be back yet
+            if (d->recoveryTimer.isValid() && scheduleReconnect())
+                return;
             d->nodeId = 0;
             return;
         }
-        d->stream->setActive(isVisible() && isComponentComplete());
+        // pw_stream_connect() leaves the stream active, pause it if it can't be seen
+        d->streamActive = true;
+        updateStreamActivity();
+        updateDownscaleSize();
+        if (d->preview)
+            PreviewScheduler::instance()->addPreview(this);
+        else
+            PreviewScheduler::instance()->removePreview(this);
 
-        connect(d->stream.data(), &PipewireSourceStream::frameReceived, this, &PipewireSourceItem::processFrame);
+        // Frames are recycled by the stream, they are only valid during the call
+        connect(d->stream.data(), &PipewireSourceStream::frameReceived, this, &PipewireSourceItem::processFrame, Qt::DirectConnection);
+        connect(d->stream.data(), &PipewireSourceStream::stopStreaming, this, &PipewireSourceItem::handleStreamStopped);
+        connect(d->stream.data(), &PipewireSourceStream::streamParametersChanged, this, [d] {
+            d->lastFormat = d->stream->videoFormat();
+            d->dmaBufsInvalidated = true;
+            d->removedDmaBufs.clear();
+        });
+        connect(d->stream.data(), &PipewireSourceStream::bufferRemoved, this, [this, d](pw_buffer *buffer) {
+            const spa_buffer *spaBuffer = buffer->buffer;
+            if (spaBuffer->n_datas > 0 && spaBuffer->datas[0].type == SPA_DATA_DmaBuf) {
+                d->removedDmaBufs.append(TextureBackend::dmaBufId(spaBuffer->datas[0].fd));
+                update();
+            }
+        }, Qt::DirectConnection);
     }
 }
+
+/*!
+ * Starts recovering a stream that stopped on its own. The texture shown last
+ * stays up until the reconnected stream delivers a frame.
+ */
+void PipewireSourceItem::handleStreamStopped()
+{
+    Q_D(PipewireSourceItem);
+
+    if (!d->stream || d->nodeId == 0 || d->reconnectTimer.isActive())
+        return;
+
+    // A core that failed closed the fd it was given, only a new one from the portal helps
+    if (d->fd > 0 && !d->stream->error().isEmpty()) {
+        qWarning() << "PipeWire connection of node" << d->nodeId << "lost, waiting for a new fd";
+        return;
+    }
+
+    if (!d->recoveryTimer.isValid())
+        d->recoveryTimer.start();
+    scheduleReconnect();
+}
+
+bool PipewireSourceItem::scheduleReconnect()
+{
+    Q_D(PipewireSourceItem);
+
+    if (d->reconnectAttempts >= maxReconnectAttempts) {
+        qWarning() << "giving up reconnecting to node" << d->nodeId << "after" << d->reconnectAttempts << "attempts";
+        d->recoveryTimer.invalidate();
+        return false;
+    }
+
+    d->reconnectTimer.start(qMin(reconnectBaseDelay << d->reconnectAttempts, reconnectMaxDelay));
+    ++d->reconnectAttempts;
+    return true;
+}
+
+void PipewireSourceItem::reconnect()
+{
+    Q_D(PipewireSourceItem);
+
+    // The old stream keeps the shared PipeWire core alive until the new stream got hold of it
+    QScopedPointer<PipewireSourceStream> previous(d->stream.take());
+    if (previous)
+        previous->disconnect(this);
+    refresh();
+}
@@ -5,6 +5,7 @@
 #include "pipewiresourcestream.h"
 
 #include <QQuickItem>
+#include <QVariantMap>
 
 class  PipewireSourceItemPrivate;
 class WSM_WALLPAPER_EXPORT PipewireSourceItem : public QQuickItem
@@ -12,6 +13,18 @@ class WSM_WALLPAPER_EXPORT PipewireSourceItem : public QQuickItem
     Q_OBJECT
     Q_PROPERTY(uint nodeId READ nodeId WRITE setNodeId NOTIFY nodeIdChanged)
     Q_PROPERTY(uint fd READ fd WRITE setFd NOTIFY fdChanged)
+    Q_PROPERTY(bool pauseWhenHidden READ pauseWhenHidden WRITE setPauseWhenHidden NOTIFY pauseWhenHiddenChanged)
+    Q_PROPERTY(bool screenActive READ screenActive WRITE setScreenActive NOTIFY screenActiveChanged)
+    Q_PROPERTY(bool downscaleToItem READ downscaleToItem WRITE setDownscaleToItem NOTIFY downscaleToItemChanged)
+    Q_PROPERTY(QRect sourceRect READ sourceRect WRITE setSourceRect NOTIFY sourceRectChanged)
+    Q_PROPERTY(int bufferMemoryBudget READ bufferMemoryBudget WRITE setBufferMemoryBudget NOTIFY bufferMemoryBudgetChanged)
+    Q_PROPERTY(bool preview READ preview WRITE setPreview NOTIFY previewChanged)
+    Q_PROPERTY(QSize previewSize READ previewSize WRITE setPreviewSize NOTIFY previewSizeChanged)
+    Q_PROPERTY(int priority READ priority WRITE setPriority NOTIFY priorityChanged)
+    Q_PROPERTY(QString snapshotKey READ snapshotKey WRITE setSnapshotKey NOTIFY snapshotKeyChanged)
+    Q_PROPERTY(bool cursorEnabled READ cursorEnabled WRITE setCursorEnabled NOTIFY cursorEnabledChanged)
+    Q_PROPERTY(int cursorMaxSize READ cursorMaxSize WRITE setCursorMaxSize NOTIFY cursorMaxSizeChanged)
+    Q_PROPERTY(bool allocateBuffers READ allocateBuffers WRITE setAllocateBuffers NOTIFY allocateBuffersChanged)
     QML_ELEMENT
 public:
     PipewireSourceItem(QQuickItem *parent=nullptr);
@@ -24,27 +37,110 @@ public:
     void setFd(uint fd);
     uint fd() const;
 
+    void setPauseWhenHidden(bool pause);
+    bool pauseWhenHidden() const;
+
+    void setScreenActive(bool active);
+    bool screenActive() const;
+
+    void setDownscaleToItem(bool downscale);
+    bool downscaleToItem() const;
+
+    void setSourceRect(const QRect &rect);
+    QRect sourceRect() const;
+
+    void setBufferMemoryBudget(int megabytes);
+    int bufferMemoryBudget() const;
+
+    void setPreview(bool preview);
+    bool preview() const;
+
+    void setPreviewSize(const QSize &size);
+    QSize previewSize() const;
+
+    void setPriority(int priority);
+    int priority() const;
+
+    void setSnapshotKey(const QString &key);
+    QString snapshotKey() const;
+
+    void setCursorEnabled(bool enabled);
+    bool cursorEnabled() const;
+
+    void setCursorMaxSize(int size);
+    int cursorMaxSize() const;
+
+    void setAllocateBuffers(bool allocate);
+    bool allocateBuffers() const;
+
+    Q_INVOKABLE QVariantMap statistics() const;
+
     void componentComplete() override;
     void releaseResources() override;
+
+    bool isTextureProvider() const override;
+    QSGTextureProvider *textureProvider() const override;
 Q_SIGNALS:
     void nodeIdChanged(uint nodeId);
     void fdChanged(uint fd);
+    void pauseWhenHiddenChanged(bool pause);
+    void screenActiveChanged(bool active);
+    void downscaleToItemChanged(bool downscale);
+    void sourceRectChanged(const QRect &rect);
+    void bufferMemoryBudgetChanged(int megabytes);
+    void previewChanged(bool preview);
+    void previewSizeChanged(const QSize &size);
+    void priorityChanged(int priority);
+    void snapshotKeyChanged(const QString &key);
+    void cursorEnabledChanged(bool enabled);
+    void cursorMaxSizeChanged(int size);
+    void allocateBuffersChanged(bool allocate);
 
 protected:
     PipewireSourceItem(PipewireSourceItemPrivate &dd, QQuickItem *parent);
     QSGNode *updatePaintNode(QSGNode *node, UpdatePaintNodeData *data) override;
+    bool eventFilter(QObject *watched, QEvent *event) override;
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    void geometryChanged(const QRectF &newGeometry, const QRectF &oldGeometry) override;
+#else
+    void geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry) override;
+#endif
 
 private:
     void refresh();
     void itemChange(ItemChange change, const ItemChangeData &data) override;
     void processFrame(const PipeWireFrame &frame);
-    void updateTextureDmaBuf(const DmaBufAttributes &attribs, spa_video_format format);
-    void updateTextureImage(const QImage &image);
+    void importDmaBuf(const PipeWireFrame &frame);
+    void uploadFrame(const PipeWireFrame &frame);
+    void trackWindow(QQuickWindow *window);
+    bool isWallpaperVisible() const;
+    QRectF visibleSceneRect() const;
+    void updateDownscaleSize();
+    qint64 effectiveBufferBudget() const;
+    int effectiveMaxFrameRate() const;
+    bool wantsPreviewFrame() const;
+    qint64 previewFrameCost() const;
+    void grantPreviewFrame();
+    bool hasPendingFrame(bool *dmabuf) const;
+    qint64 pendingFrameCost() const;
+    int consecutiveDeferrals() const;
+    void deferFrame();
+    void loadSnapshot();
+    bool scheduleReconnect();
 
 private Q_SLOTS:
     void handleVisibleChanged();
+    void handleStreamStopped();
+    void reconnect();
+    void saveSnapshot();
+    void grabSnapshot();
+    void applyMemoryPressure();
+    void updateStreamActivity();
+    void invalidateSceneGraph();
 
 private:
+    friend class PreviewScheduler;
+    friend class FrameScheduler;
     Q_DECLARE_PRIVATE(PipewireSourceItem)
     Q_DISABLE_COPY(PipewireSourceItem)
 };
@@ -1,12 +1,16 @@
+#include "frametrace.h"
 #include "pipewirecore.h"
 #include "pipewiresourcestream.h"
 #include "private/pipewiresourcestream_p.h"
 
 #include <fcntl.h>
 #include <libdrm/drm_fourcc.h>
+#include <linux/dma-buf.h>
 #include <spa/utils/result.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <EGL/egl.h>
@@ -15,6 +19,7 @@
 #include <QDateTime>
 #include <QGuiApplication>
 #include <QLoggingCategory>
+#include <QMetaMethod>
 #include <QOpenGLTexture>
 #include <QSocketNotifier>
 #include <QVersionNumber>
@@ -43,21 +48,502 @@ static const QVersionNumber kDmaBufMinVersion = {0, 3, 24};
 static const QVersionNumber kDmaBufModifierMinVersion = {0, 3, 33};
 static const QVersionNumber kDropSingleModifierMinVersion = {0, 3, 40};
 static const int videoDamageRegionCount = 16;
-
+static const int minBufferCount = 2;
+static const int maxBufferCount = 16;
+// Cache line sized, rows then start where the SIMD scaler and uploads want them
+static const int bufferAlignment = 64;
+static const qint64 bufferGrowDelay = 1000;
+static const qint64 bufferShrinkDelay = 5000;
+static const qint64 defaultFrameInterval = 16666667;
+
+/*!
+ * Returns the QImage format with the byte layout of \a format, so that frames
+ * are copied and uploaded without a conversion. The 32 bit blue first formats
+ * rely on a little endian host. Other formats give QImage::Format_Invalid, they
+ * are never read on the CPU rather than reinterpreted.
+ */
 static QImage::Format SpaToQImageFormat(quint32 format)
 {
     switch (format) {
+    case SPA_VIDEO_FORMAT_RGB:
+        return QImage::Format_RGB888;
     case SPA_VIDEO_FORMAT_BGR:
         return QImage::Format_BGR888;
     case SPA_VIDEO_FORMAT_RGBx:
         return QImage::Format_RGBX8888;
     case SPA_VIDEO_FORMAT_RGBA:
         return QImage::Format_RGBA8888_Premultiplied;
-    default:
+    case SPA_VIDEO_FORMAT_BGRA:
+        return QImage::Format_ARGB32_Premultiplied;
+    case SPA_VIDEO_FORMAT_BGRx:
         return QImage::Format_RGB32;
+    default:
+        return QImage::Format_Invalid;
+    }
+}
+
+/*!
+ * Returns the negotiated frame interval in nanoseconds, 60 Hz when the producer
+ * didn't say.
+ */
+qint64 PipewireSourceStreamPrivate::frameInterval() const
+{
+    return videoFormat.max_framerate.num > 0
+            ? qint64(videoFormat.max_framerate.denom) * 1000000000 / videoFormat.max_framerate.num
+            : defaultFrameInterval;
+}
+
+/*!
+ * Returns how many buffers to ask the producer for: one it renders into, one on
+ * its way to us, the ones the consumer keeps, and as many as it holds during one
+ * frame interval on average. Consumers holding buffers keep the shown frame's and
+ * the waiting frame's, the copy thread the copied and the waiting frame's. The
+ * memory budget caps the count, but never below two.
+ */
+int PipewireSourceStreamPrivate::bufferCountFor(qint64 holdTime) const
+{
+    const int kept = holdBuffers || downscaleSize.isValid() ? 2 : 1;
+    if (previewMode)
+        return 1 + kept;
+
+    const qint64 frameBytes = qint64(videoFormat.size.width) * videoFormat.size.height * 4;
+    const qint64 interval = frameInterval();
+
+    qint64 count = 2 + qMax<qint64>(kept, (holdTime + interval - 1) / interval);
+    if (frameBytes > 0 && bufferBudget > 0)
+        count = qMin(count, bufferBudget / frameBytes);
+    return int(qBound<qint64>(minBufferCount, count, maxBufferCount));
+}
+
+int PipewireSourceStreamPrivate::preferredBufferCount() const
+{
+    return bufferCountFor(holdTime);
+}
+
+/*!
+ * Folds how long the consumer kept a buffer into a moving average.
+ */
+void PipewireSourceStreamPrivate::recordHoldTime(qint64 nsecs)
+{
+    holdTime = holdTime ? (holdTime * 7 + nsecs) / 8 : nsecs;
+}
+
+/*!
+ * Returns the part of the buffer that has to be shown: the producer's crop, if
+ * any, intersected with the consumer's region of interest.
+ */
+QRect PipewireSourceStreamPrivate::frameRect(spa_buffer *buffer) const
+{
+    QRect rect(0, 0, videoFormat.size.width, videoFormat.size.height);
+
+    auto crop = static_cast<spa_meta_region *>(spa_buffer_find_meta_data(buffer, SPA_META_VideoCrop, sizeof(spa_meta_region)));
+    if (crop && spa_meta_region_is_valid(crop)) {
+        rect &= QRect(crop->region.position.x, crop->region.position.y, crop->region.size.width, crop->region.size.height);
+    }
+
+    if (sourceRect.isValid()) {
+        const QRect interest = rect & sourceRect;
+        // A region outside of the frame shows the whole frame rather than nothing
+        if (!interest.isEmpty())
+            rect = interest;
+    }
+    return rect;
+}
+
+/*!
+ * Returns a pool image of \a size and \a format that no consumer holds anymore,
+ * preferring the one written last. Only when every image is still in use is a
+ * new one allocated.
+ */
+QImage *PipewireSourceStreamPrivate::acquireImage(const QSize &size, QImage::Format format)
+{
+    for (int i = 0; i < imagePoolSize; ++i) {
+        const int index = (currentImage + i) % imagePoolSize;
+        QImage &image = imagePool[index];
+        if (!image.isNull() && !image.isDetached())
+            continue;
+
+        if (image.size() != size || image.format() != format)
+            image = QImage(size, format);
+        currentImage = index;
+        return &image;
+    }
+
+    currentImage = (currentImage + 1) % imagePoolSize;
+    imagePool[currentImage] = QImage(size, format);
+    return &imagePool[currentImage];
+}
+
+/*!
+ * Copies the \a rect part of a CPU frame out of the producer's buffer, \a data
+ * points to its top left pixel. The copy goes into a pool image, and when that
+ * image still holds the previous frame only the damaged part is written. When a
+ * downscale size is set the frame is box filtered instead of copied and the
+ * damage is then reported in the coordinates of the returned image.
+ */
+QImage PipewireSourceStreamPrivate::copyFrame(const uchar *data, int stride, const QRect &rect, std::optional<PipeWireDamage> *damage)
+{
+    const QSize size = rect.size();
+    const QImage::Format format = SpaToQImageFormat(videoFormat.format);
+    const QSize target = ImageScaler::targetSize(size, downscaleSize);
+    const bool scaled = target != size;
+    const int bytesPerPixel = QImage::toPixelFormat(format).bitsPerPixel() / 8;
+    const bool damaged = damage && *damage && !(*damage)->isEmpty();
+
+    // Only the image written last, still holding the same geometry, can be patched
+    const int previousImage = currentImage;
+    const bool sameGeometry = imagePool[previousImage].size() == target && imagePool[previousImage].format() == format && currentImageRect == rect;
+    // Writer images are uploaded without another copy, they always get the whole frame
+    QImage written = frameWriter ? frameWriter->acquireImage(target, format) : QImage();
+    QImage *image = written.isNull() ? acquireImage(target, format) : &written;
+    const bool partial = damaged && sameGeometry && written.isNull() && currentImage == previousImage;
+    currentImageRect = written.isNull() ? rect : QRect();
+
+    const QRect full(QPoint(0, 0), target);
+    PipeWireDamage dirty;
+    if (scaled && damaged) {
+        for (const QRect &damageRect : qAsConst(**damage)) {
+            dirty.append(ImageScaler::mapToTarget(damageRect, size, target));
+        }
+        **damage = dirty;
+    } else if (damaged) {
+        dirty = **damage;
+    }
+    if (!partial) {
+        dirty.clear();
+        dirty.append(full);
+    }
+
+    // The image is not shared, bits() does not detach
+    uchar *dst = image->bits();
+    const int dstStride = image->bytesPerLine();
+    for (const QRect &dirtyRect : qAsConst(dirty)) {
+        if (scaled) {
+            scaler.scale(data, stride, size, dst, dstStride, target, bytesPerPixel, dirtyRect);
+            continue;
+        }
+
+        const QRect copyRect = dirtyRect & full;
+        for (int y = copyRect.top(); y <= copyRect.bottom(); ++y) {
+            memcpy(dst + qsizetype(y) * dstStride + copyRect.x() * bytesPerPixel,
+                   data + qsizetype(y) * stride + copyRect.x() * bytesPerPixel,
+                   copyRect.width() * bytesPerPixel);
+        }
+    }
+    return *image;
+}
+
+/*!
+ * \brief Read access to the \a rect part of a MemFd or MemPtr buffer.
+ *
+ * MemPtr buffers are already mapped, of MemFd buffers only the rows of the
+ * region are mapped, from a page aligned offset, for as long as this lives.
+ */
+class FrameMapping
+{
+public:
+    FrameMapping(spa_data *data, const QRect &rect, int bytesPerPixel)
+    {
+        const int stride = data->chunk->stride;
+        // Buffers we allocated are mapped for as long as they exist
+        if (data->type == SPA_DATA_MemPtr || data->data) {
+            m_pixels = static_cast<uint8_t *>(data->data) + qsizetype(rect.top()) * stride + rect.left() * bytesPerPixel;
+            return;
+        }
+
+        static const size_t pageSize = sysconf(_SC_PAGESIZE);
+        const size_t begin = data->mapoffset + size_t(rect.top()) * stride;
+        const size_t end = qMin<size_t>(data->mapoffset + size_t(rect.bottom() + 1) * stride, data->mapoffset + data->maxsize);
+        const size_t mapBegin = begin & ~(pageSize - 1);
+
+        void *map = mmap(nullptr, end - mapBegin, PROT_READ, MAP_PRIVATE, data->fd, mapBegin);
+        if (map == MAP_FAILED) {
+            qDebug() << "Failed to mmap the memory: " << strerror(errno);
+            return;
+        }
+        m_map = map;
+        m_mapSize = end - mapBegin;
+        m_pixels = static_cast<const uint8_t *>(map) + (begin - mapBegin) + rect.left() * bytesPerPixel;
+    }
+
+    ~FrameMapping()
+    {
+        if (m_map)
+            munmap(m_map, m_mapSize);
+    }
+
+    const uint8_t *pixels() const { return m_pixels; }
+
+private:
+    void *m_map = nullptr;
+    size_t m_mapSize = 0;
+    const uint8_t *m_pixels = nullptr;
+
+    Q_DISABLE_COPY(FrameMapping)
+};
+
+DmaBufMapping::DmaBufMapping(int fd)
+{
+    m_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (m_fd < 0)
+        return;
+
+    // Seeking to the end is how a DMA-BUF reports its size
+    const off_t size = lseek(m_fd, 0, SEEK_END);
+    if (size <= 0)
+        return;
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        qDebug() << "Failed to mmap the DMA-BUF: " << strerror(errno);
+        return;
+    }
+    m_map = map;
+    m_size = size;
+}
+
+DmaBufMapping::~DmaBufMapping()
+{
+    if (m_map)
+        munmap(m_map, m_size);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+static void syncDmaBuf(int fd, quint64 flags)
+{
+    dma_buf_sync sync = {flags};
+    while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            qDebug() << "DMA_BUF_IOCTL_SYNC failed: " << strerror(errno);
+            return;
+        }
+    }
+}
+
+void DmaBufMapping::beginRead()
+{
+    syncDmaBuf(m_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+}
+
+void DmaBufMapping::endRead()
+{
+    syncDmaBuf(m_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+/*!
+ * Copies the \a rect part of a MemFd or MemPtr buffer, see copyFrame().
+ */
+QImage PipewireSourceStreamPrivate::readImage(spa_buffer *buffer, const QRect &rect, std::optional<PipeWireDamage> *damage)
+{
+    FrameTraceScope trace("copy", pwNodeId);
+    const int bytesPerPixel = QImage::toPixelFormat(SpaToQImageFormat(videoFormat.format)).bitsPerPixel() / 8;
+    if (!bytesPerPixel)
+        return QImage();
+    const FrameMapping mapping(buffer->datas, rect, bytesPerPixel);
+    if (!mapping.pixels())
+        return QImage();
+
+    return copyFrame(mapping.pixels(), buffer->datas->chunk->stride, rect, damage);
+}
+
+/*!
+ * Copies the \a rect part of a linear DMA-BUF through a cached mapping, the
+ * read is bracketed for the duration of the copy, see copyFrame().
+ */
+QImage PipewireSourceStreamPrivate::readDmaBuf(pw_buffer *buffer, const QRect &rect, std::optional<PipeWireDamage> *damage)
+{
+    FrameTraceScope trace("map", pwNodeId);
+    const spa_data *data = buffer->buffer->datas;
+    QSharedPointer<DmaBufMapping> &mapping = dmaBufMappings[buffer];
+    if (!mapping)
+        mapping.reset(new DmaBufMapping(data->fd));
+    if (!mapping->isValid())
+        return QImage();
+
+    const int bytesPerPixel = QImage::toPixelFormat(SpaToQImageFormat(videoFormat.format)).bitsPerPixel() / 8;
+    if (!bytesPerPixel)
+        return QImage();
+    const int stride = data->chunk->stride;
+    const size_t begin = data->chunk->offset + size_t(rect.top()) * stride + size_t(rect.left()) * bytesPerPixel;
+    const size_t end = data->chunk->offset + size_t(rect.bottom()) * stride + size_t(rect.right() + 1) * bytesPerPixel;
+    if (stride <= 0 || end > mapping->size())
+        return QImage();
+
+    mapping->beginRead();
+    const QImage image = copyFrame(mapping->data() + begin, stride, rect, damage);
+    mapping->endRead();
+    return image;
+}
+
+/*!
+ * Hands a borrowed view of \a frame to the sinks, CPU frames are mapped once
+ * for all of them.
+ */
+void PipewireSourceStreamPrivate::feedSinks(spa_buffer *buffer, const PipeWireFrame &frame)
+{
+    FrameTraceScope trace("sinks", pwNodeId);
+    trace.setFrame(frame.presentationTimestamp, frame.sequential);
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    PipeWireFrameView view;
+    view.format = frame.format;
+    view.size = frame.sourceRect.size();
+    view.sourceRect = frame.sourceRect;
+    view.sequential = frame.sequential;
+    view.presentationTimestamp = frame.presentationTimestamp;
+    view.damage = frame.damage ? &*frame.damage : nullptr;
+    view.cursor = frame.cursor ? &*frame.cursor : nullptr;
+    view.dmabuf = frame.dmabuf ? &*frame.dmabuf : nullptr;
+    view.deadline = qint64(now.tv_sec) * 1000000000 + now.tv_nsec + frameInterval();
+
+    std::optional<FrameMapping> mapping;
+    spa_data *data = buffer->datas;
+    const int bytesPerPixel = QImage::toPixelFormat(SpaToQImageFormat(videoFormat.format)).bitsPerPixel() / 8;
+    if (data->chunk->size > 0 && bytesPerPixel && (data->type == SPA_DATA_MemFd || data->type == SPA_DATA_MemPtr)) {
+        view.bytesPerPixel = bytesPerPixel;
+        view.stride = data->chunk->stride;
+        mapping.emplace(data, frame.sourceRect, view.bytesPerPixel);
+        view.data = mapping->pixels();
+    }
+
+    for (PipeWireFrameSink *sink : qAsConst(sinks)) {
+        sink->consumeFrame(view);
     }
 }
 
+/*!
+ * \brief The stream's copy thread, it waits for one copy job at a time.
+ */
+class CopyFrameThread : public QThread
+{
+public:
+    explicit CopyFrameThread(PipewireSourceStreamPrivate *d)
+        : m_d(d)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        QMutexLocker locker(&m_d->copyQueueMutex);
+        while (true) {
+            while (!m_d->copyRequested && !m_d->copyQuit)
+                m_d->copyCondition.wait(&m_d->copyQueueMutex);
+            if (m_d->copyQuit)
+                return;
+            m_d->copyRequested = false;
+
+            locker.unlock();
+            m_d->runCopy();
+            locker.relock();
+        }
+    }
+
+private:
+    PipewireSourceStreamPrivate *m_d;
+};
+
+/*!
+ * Copies \a frame out of the held \a buffer on the copy thread. While a copy runs
+ * the frame waits, replacing and releasing the one that waited before it.
+ */
+void PipewireSourceStreamPrivate::queueCopy(const PipeWireFrame &frame, pw_buffer *buffer)
+{
+    Q_Q(PipewireSourceStream);
+
+    CopyJob job = {frame, buffer};
+    if (!copyRunning) {
+        copyJob = job;
+        startCopy();
+        return;
+    }
+
+    if (pendingCopyJob.buffer) {
+        PipewireSourceStream::mergeDamage(&job.frame, pendingCopyJob.frame);
+        q->releaseBuffer(pendingCopyJob.buffer);
+    }
+    pendingCopyJob = job;
+}
+
+/*!
+ * Hands copyJob to the copy thread. The thread and the eventfd it reports back
+ * through are created for the first copy, later copies allocate nothing.
+ */
+void PipewireSourceStreamPrivate::startCopy()
+{
+    Q_Q(PipewireSourceStream);
+
+    if (!copyThread) {
+        copyEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        copyNotifier.reset(new QSocketNotifier(copyEventFd, QSocketNotifier::Read));
+        QObject::connect(copyNotifier.data(), &QSocketNotifier::activated, q, [this] {
+            eventfd_t value;
+            if (eventfd_read(copyEventFd, &value) == 0)
+                finishCopy();
+        });
+        copyThread.reset(new CopyFrameThread(this));
+        copyThread->start();
+    }
+
+    copyRunning = true;
+    QMutexLocker locker(&copyQueueMutex);
+    copyRequested = true;
+    copyCondition.wakeOne();
+}
+
+void PipewireSourceStreamPrivate::runCopy()
+{
+    {
+        QMutexLocker locker(&copyMutex);
+        copyDamage = copyJob.frame.damage;
+        // The buffer is gone when the stream removed it in the meantime
+        copyResult = copyJob.buffer ? readImage(copyJob.buffer->buffer, copyJob.frame.sourceRect, &copyDamage) : QImage();
+    }
+    eventfd_write(copyEventFd, 1);
+}
+
+void PipewireSourceStreamPrivate::finishCopy()
+{
+    Q_Q(PipewireSourceStream);
+
+    copyRunning = false;
+    pw_buffer *buffer = copyJob.buffer;
+    if (buffer && !copyResult.isNull()) {
+        PipeWireFrame &frame = copyJob.frame;
+        frame.image = copyResult;
+        frame.damage = copyDamage;
+        frame.buffer = nullptr;
+        Q_EMIT q->frameReceived(frame);
+    }
+    copyJob = {};
+    copyResult = QImage();
+    q->releaseBuffer(buffer);
+
+    if (pendingCopyJob.buffer) {
+        copyJob = std::exchange(pendingCopyJob, {});
+        startCopy();
+    }
+}
+
+void PipewireSourceStreamPrivate::stopCopyThread()
+{
+    if (!copyThread)
+        return;
+
+    {
+        QMutexLocker locker(&copyQueueMutex);
+        copyQuit = true;
+        copyCondition.wakeOne();
+    }
+    copyThread->wait();
+    copyNotifier.reset();
+    close(copyEventFd);
+    copyEventFd = -1;
+}
+
 static void onProcess(void *data)
 {
     PipewireSourceStream *stream = static_cast<PipewireSourceStream *>(data);
@@ -123,7 +609,7 @@ static QHash<spa_video_format, QVector<uint64_t>> queryDmaBufModifiers(EGLDispla
     return ret;
 }
 
-static spa_pod *buildFormat(spa_pod_builder *builder, spa_video_format format, const QVector<uint64_t> &modifiers, bool withDontFixate)
+static spa_pod *buildFormat(spa_pod_builder *builder, spa_video_format format, const QVector<uint64_t> &modifiers, bool withDontFixate, int maxFrameRate)
 {
     spa_pod_frame f[2];
     const spa_rectangle pw_min_screen_bounds{1, 1};
@@ -134,6 +620,13 @@ static spa_pod *buildFormat(spa_pod_builder *builder, spa_video_format format, c
     spa_pod_builder_add(builder, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
     spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_format, SPA_POD_Id(format), 0);
     spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&pw_min_screen_bounds, &pw_min_screen_bounds, &pw_max_screen_bounds), 0);
+    if (maxFrameRate > 0) {
+        // Producers that honour it render less often, others are throttled by the consumer
+        const spa_fraction minRate{0, 1};
+        const spa_fraction maxRate{uint32_t(maxFrameRate), 1};
+        spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&minRate), 0);
+        spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&maxRate, &minRate, &maxRate), 0);
+    }
 
     if (modifiers.size() == 1 && modifiers[0] == DRM_FORMAT_MOD_INVALID) {
         // we only support implicit modifiers, use shortpath to skip fixation phase
@@ -162,15 +655,34 @@ static spa_pod *buildFormat(spa_pod_builder *builder, spa_video_format format, c
 
 
 
+// Offers exactly a previously negotiated format, which the producer can accept
+// without another fixation round trip
+static spa_pod *buildFixedFormat(spa_pod_builder *builder, const spa_video_info_raw &info)
+{
+    spa_pod_frame f;
+    spa_pod_builder_push_object(builder, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+    spa_pod_builder_add(builder, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+    spa_pod_builder_add(builder, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+    spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_format, SPA_POD_Id(info.format), 0);
+    spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&info.size), 0);
+    if (info.flags & SPA_VIDEO_FLAG_MODIFIER) {
+        spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
+        spa_pod_builder_long(builder, info.modifier);
+    }
+    return static_cast<spa_pod *>(spa_pod_builder_pop(builder, &f));
+}
+
 PipewireSourceStream::PipewireSourceStream(QObject *parent)
     : QObject(*new PipewireSourceStreamPrivate, parent)
 {
-    qRegisterMetaType<QVector<DmaBufPlane>>();
-
     pwStreamEvents.version = PW_VERSION_STREAM_EVENTS;
     pwStreamEvents.process = &onProcess;
     pwStreamEvents.state_changed = &PipewireSourceStream::onStreamStateChanged;
     pwStreamEvents.param_changed = &PipewireSourceStream::onStreamParamChanged;
+    pwStreamEvents.add_buffer = &PipewireSourceStream::onAddBuffer;
+    pwStreamEvents.remove_buffer = &PipewireSourceStream::onRemoveBuffer;
+
+    d_func()->clock.start();
 }
 
 PipewireSourceStream::~PipewireSourceStream()
@@ -178,9 +690,13 @@ PipewireSourceStream::~PipewireSourceStream()
     Q_D(PipewireSourceStream);
 
     d->stopped = true;
+    d->stopCopyThread();
     if (d->renegotiateEvent) {
         pw_loop_destroy_source(d->pwCore->loop(), d->renegotiateEvent);
     }
+    if (d->releaseEvent) {
+        pw_loop_destroy_source(d->pwCore->loop(), d->releaseEvent);
+    }
     if (d->pwStream) {
         pw_stream_destroy(d->pwStream);
     }
@@ -221,7 +737,8 @@ bool PipewireSourceStream::createStream(uint nodeid, int fd)
 {
     Q_D(PipewireSourceStream);
 
-    d->availableModifiers.clear();
+    if (!d->externalModifiers)
+        d->availableModifiers.clear();
     d->pwCore = PipewireCore::fetch(fd);
     if (!d->pwCore->error().isEmpty()) {
         qDebug() << "received error while creating the stream" << d->pwCore->error();
@@ -241,15 +758,19 @@ bool PipewireSourceStream::createStream(uint nodeid, int fd)
     pw_stream_add_listener(d->pwStream, &d->streamListener, &pwStreamEvents, this);
 
     d->renegotiateEvent = pw_loop_add_event(d->pwCore->loop(), onRenegotiate, this);
+    d->releaseEvent = pw_loop_add_event(d->pwCore->loop(), onReleaseBuffers, this);
 
     QVector<const spa_pod *> params = createFormatsParams();
     pw_stream_flags s = (pw_stream_flags)(PW_STREAM_FLAG_DONT_RECONNECT | PW_STREAM_FLAG_AUTOCONNECT);
+    if (d->allocateBuffers)
+        s = (pw_stream_flags)(s | PW_STREAM_FLAG_ALLOC_BUFFERS);
     if (pw_stream_connect(d->pwStream, PW_DIRECTION_INPUT, d->pwNodeId, s, params.data(), params.size()) != 0) {
         qDebug() << "Could not connect to stream";
         pw_stream_destroy(d->pwStream);
         d->pwStream = nullptr;
         return false;
     }
+    advertiseSourceRect();
     qDebug() << "created successfully" << nodeid;
     return true;
 }
@@ -258,7 +779,9 @@ void PipewireSourceStream::setActive(bool active)
 {
     Q_D(PipewireSourceStream);
 
-    Q_ASSERT(d->pwStream);
+    if (!d->pwStream)
+        return;
+
     pw_stream_set_active(d->pwStream, active);
 }
 
@@ -269,36 +792,486 @@ void PipewireSourceStream::setDamageEnabled(bool withDamage)
     d->withDamage = withDamage;
 }
 
+/*!
+ * Limits the size of CPU frames, larger frames are downscaled before they are
+ * handed out. An invalid size disables downscaling.
+ */
+void PipewireSourceStream::setDownscaleSize(const QSize &size)
+{
+    Q_D(PipewireSourceStream);
+
+    QMutexLocker locker(&d->copyMutex);
+    d->downscaleSize = size;
+}
+
+QSize PipewireSourceStream::downscaleSize() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->downscaleSize;
+}
+
+/*!
+ * Restricts frames to \a rect, in stream coordinates. CPU frames only copy this
+ * part of the buffer and the rectangle is advertised to the producer through
+ * the stream properties, so that it can render less. An invalid rectangle
+ * shows the whole stream.
+ */
+void PipewireSourceStream::setSourceRect(const QRect &rect)
+{
+    Q_D(PipewireSourceStream);
+
+    if (d->sourceRect == rect)
+        return;
+
+    d->sourceRect = rect;
+    advertiseSourceRect();
+}
+
+QRect PipewireSourceStream::sourceRect() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->sourceRect;
+}
+
+void PipewireSourceStream::advertiseSourceRect()
+{
+    Q_D(PipewireSourceStream);
+
+    if (!d->pwStream)
+        return;
+
+    const QByteArray value = d->sourceRect.isValid()
+            ? QByteArray::number(d->sourceRect.x()) + ',' + QByteArray::number(d->sourceRect.y()) + ',' + QByteArray::number(d->sourceRect.width()) + 'x'
+                    + QByteArray::number(d->sourceRect.height())
+            : QByteArray();
+    const spa_dict_item items[] = {SPA_DICT_ITEM_INIT("wallpaper.source-rect", value.isEmpty() ? nullptr : value.constData())};
+    const spa_dict dict = SPA_DICT_INIT_ARRAY(items);
+    pw_stream_update_properties(d->pwStream, &dict);
+}
+
+void PipewireSourceStream::setDmaBufModifiers(const QHash<spa_video_format, QVector<uint64_t>> &modifiers)
+{
+    Q_D(PipewireSourceStream);
+
+    // Every format still has to be offered, at least without DMA-BUF
+    d->availableModifiers.clear();
+    for (spa_video_format format : qAsConst(d->videoFormats))
+        d->availableModifiers.insert(format, modifiers.value(format));
+    d->externalModifiers = true;
+
+    if (d->pwStream && d->renegotiateEvent) {
+        pw_loop_signal_event(d->pwCore->loop(), d->renegotiateEvent);
+    }
+}
+
+/*!
+ * Limits the formats offered to the producer to \a formats, those the texture
+ * backend uploads without converting them first.
+ */
+void PipewireSourceStream::setVideoFormats(const QVector<spa_video_format> &formats)
+{
+    Q_D(PipewireSourceStream);
+
+    if (d->videoFormats == formats)
+        return;
+
+    d->videoFormats = formats;
+    for (auto it = d->availableModifiers.begin(); it != d->availableModifiers.end();) {
+        if (formats.contains(it.key()))
+            ++it;
+        else
+            it = d->availableModifiers.erase(it);
+    }
+
+    if (d->pwStream && d->renegotiateEvent) {
+        pw_loop_signal_event(d->pwCore->loop(), d->renegotiateEvent);
+    }
+}
+
+/*!
+ * Limits the memory the producer's buffers may take, in bytes. At least two
+ * buffers are always asked for, 0 lifts the limit.
+ */
+void PipewireSourceStream::setBufferMemoryBudget(qint64 bytes)
+{
+    Q_D(PipewireSourceStream);
+
+    if (d->bufferBudget == bytes)
+        return;
+
+    d->bufferBudget = bytes;
+    updateBufferCount();
+}
+
+qint64 PipewireSourceStream::bufferMemoryBudget() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->bufferBudget;
+}
+
+/*!
+ * Returns how many buffers were asked for, the producer allocates at most that many.
+ */
+int PipewireSourceStream::bufferCount() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->bufferCount;
+}
+
+/*!
+ * Makes the stream suited for small previews: only shared memory buffers, which
+ * are downsampled on the CPU, as few buffers as possible and no cursor or damage
+ * metadata. This has to be set before the stream is created.
+ */
+void PipewireSourceStream::setPreviewMode(bool preview)
+{
+    Q_D(PipewireSourceStream);
+
+    d->previewMode = preview;
+}
+
+bool PipewireSourceStream::previewMode() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->previewMode;
+}
+
+/*!
+ * Copies CPU frames into images of \a writer as they arrive, instead of into the
+ * stream's pool or leaving them in held buffers. The stream falls back to its pool
+ * while the writer has no free image.
+ */
+void PipewireSourceStream::setFrameWriter(const QExplicitlySharedDataPointer<PboFrameWriter> &writer)
+{
+    Q_D(PipewireSourceStream);
+
+    QMutexLocker locker(&d->copyMutex);
+    d->frameWriter = writer;
+}
+
+QExplicitlySharedDataPointer<PboFrameWriter> PipewireSourceStream::frameWriter() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->frameWriter;
+}
+
+/*!
+ * Makes the stream allocate its buffers itself, as sealed memfds backed by huge
+ * pages where possible, instead of the producer. Only shared memory is negotiated
+ * then. This has to be set before the stream is created.
+ */
+void PipewireSourceStream::setAllocateBuffers(bool allocate)
+{
+    Q_D(PipewireSourceStream);
+
+    d->allocateBuffers = allocate;
+    if (!allocate)
+        d->bufferPool.clear();
+}
+
+bool PipewireSourceStream::allocateBuffers() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->allocateBuffers;
+}
+
+/*!
+ * Calls \a sink for every frame on the thread that processes the stream, until
+ * it is removed. The stream does not take ownership. Metadata the sink asks for
+ * is negotiated from the next buffer renegotiation on.
+ */
+void PipewireSourceStream::addFrameSink(PipeWireFrameSink *sink)
+{
+    Q_D(PipewireSourceStream);
+
+    if (!sink || d->sinks.contains(sink))
+        return;
+
+    d->sinks.append(sink);
+    updateSinkMetadata();
+}
+
+void PipewireSourceStream::removeFrameSink(PipeWireFrameSink *sink)
+{
+    Q_D(PipewireSourceStream);
+
+    if (d->sinks.removeAll(sink))
+        updateSinkMetadata();
+}
+
+void PipewireSourceStream::updateSinkMetadata()
+{
+    Q_D(PipewireSourceStream);
+
+    PipeWireFrameSink::MetadataFlags metadata;
+    for (PipeWireFrameSink *sink : qAsConst(d->sinks)) {
+        metadata |= sink->metadata();
+    }
+    if (metadata == d->sinkMetadata)
+        return;
+
+    d->sinkMetadata = metadata;
+    if (d->pwStream && d->bufferTypes)
+        updateBufferParams();
+}
+
+/*!
+ * Negotiates cursor metadata, which is off by default. Changing it renegotiates
+ * the buffers of a running stream.
+ */
+void PipewireSourceStream::setCursorEnabled(bool enabled)
+{
+    Q_D(PipewireSourceStream);
+
+    if (enabled == d->cursorEnabled)
+        return;
+
+    const bool wanted = d->wantsCursor();
+    d->cursorEnabled = enabled;
+    if (wanted != d->wantsCursor() && d->pwStream && d->bufferTypes)
+        updateBufferParams();
+}
+
+bool PipewireSourceStream::cursorEnabled() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->cursorEnabled;
+}
+
+/*!
+ * Sets the largest cursor bitmap in pixels per side that buffers have room for,
+ * every buffer carries one so this bounds the metadata memory.
+ */
+void PipewireSourceStream::setCursorMaxSize(int size)
+{
+    Q_D(PipewireSourceStream);
+
+    size = qBound(1, size, 1024);
+    if (size == d->cursorMaxSize)
+        return;
+
+    d->cursorMaxSize = size;
+    if (d->wantsCursor() && d->pwStream && d->bufferTypes)
+        updateBufferParams();
+}
+
+int PipewireSourceStream::cursorMaxSize() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->cursorMaxSize;
+}
+
+/*!
+ * Asks the producer for at most \a fps frames per second, 0 for no limit. A
+ * running stream renegotiates its format.
+ */
+void PipewireSourceStream::setMaxFrameRate(int fps)
+{
+    Q_D(PipewireSourceStream);
+
+    if (d->maxFrameRate == fps)
+        return;
+
+    d->maxFrameRate = fps;
+    if (d->pwStream && d->renegotiateEvent) {
+        pw_loop_signal_event(d->pwCore->loop(), d->renegotiateEvent);
+    }
+}
+
+int PipewireSourceStream::maxFrameRate() const
+{
+    Q_D(const PipewireSourceStream);
+    return d->maxFrameRate;
+}
+
+/*!
+ * Frees the images CPU frames were copied into that no consumer holds anymore,
+ * the next frame is then copied in full.
+ */
+void PipewireSourceStream::dropCachedImages()
+{
+    Q_D(PipewireSourceStream);
+
+    QMutexLocker locker(&d->copyMutex);
+    for (QImage &image : d->imagePool) {
+        if (image.isDetached())
+            image = QImage();
+    }
+    d->currentImageRect = QRect();
+}
+
+/*!
+ * Offers \a format ahead of all others when the stream is created, used to
+ * reconnect with the format a previous stream of the same node negotiated.
+ */
+void PipewireSourceStream::setPreferredFormat(const spa_video_info_raw &format)
+{
+    Q_D(PipewireSourceStream);
+
+    d->preferredFormat = format;
+}
+
+/*!
+ * Makes frames keep their buffer dequeued until the consumer releases it. CPU
+ * frames then come without an image, the consumer copies it with frameImage()
+ * on the thread it uploads from, and DMA-BUFs can't be reused by the producer
+ * while they are imported.
+ */
+void PipewireSourceStream::setHoldBuffers(bool hold)
+{
+    Q_D(PipewireSourceStream);
+
+    d->holdBuffers = hold;
+}
+
+/*!
+ * Returns whether \a buffer is still held for a frame. Buffers are taken away when
+ * the stream renegotiates, a frame whose buffer is gone can't be used anymore.
+ * Held buffers only change on the GUI thread, so other threads may only ask while
+ * it is blocked, as it is during the scene graph synchronization.
+ */
+bool PipewireSourceStream::isBufferHeld(pw_buffer *buffer) const
+{
+    Q_D(const PipewireSourceStream);
+    return buffer && d->heldBuffers.contains(buffer);
+}
+
+/*!
+ * Hands a held buffer back to the producer, this may be called from any thread.
+ */
+void PipewireSourceStream::releaseBuffer(pw_buffer *buffer)
+{
+    Q_D(PipewireSourceStream);
+
+    if (!buffer)
+        return;
+
+    QMutexLocker locker(&d->releaseMutex);
+    d->releasedBuffers.append(buffer);
+    if (d->releaseEvent)
+        pw_loop_signal_event(d->pwCore->loop(), d->releaseEvent);
+}
+
+/*!
+ * Copies the image of a CPU \a frame whose buffer is held, the damage is updated
+ * like for frames copied by the stream itself. Mappable DMA-BUF frames are copied
+ * through their mapping.
+ */
+QImage PipewireSourceStream::frameImage(const PipeWireFrame &frame, std::optional<PipeWireDamage> *damage)
+{
+    Q_D(PipewireSourceStream);
+
+    if (!isBufferHeld(frame.buffer))
+        return QImage();
+
+    QMutexLocker locker(&d->copyMutex);
+    if (frame.dmabuf)
+        return isDmaBufMappable(frame) ? d->readDmaBuf(frame.buffer, frame.sourceRect, damage) : QImage();
+    return d->readImage(frame.buffer->buffer, frame.sourceRect, damage);
+}
+
+/*!
+ * Returns whether the CPU can read \a frame from its DMA-BUF, which takes a
+ * single plane without tiling or compression.
+ */
+bool PipewireSourceStream::isDmaBufMappable(const PipeWireFrame &frame)
+{
+    return frame.dmabuf && frame.dmabuf->modifier == DRM_FORMAT_MOD_LINEAR && frame.dmabuf->planes.size() == 1;
+}
+
+/*!
+ * Adds the damage of \a dropped, a frame that is skipped, to \a frame so that
+ * what changed in between is updated as well. Without damage on either of them,
+ * or with a different source rect, \a frame is damaged entirely.
+ */
+void PipewireSourceStream::mergeDamage(PipeWireFrame *frame, const PipeWireFrame &dropped)
+{
+    if (!frame->damage || !dropped.damage || frame->sourceRect != dropped.sourceRect) {
+        frame->damage.reset();
+        return;
+    }
+
+    for (const QRect &rect : qAsConst(*dropped.damage)) {
+        if (frame->damage->size() < videoDamageRegionCount)
+            frame->damage->append(rect);
+        else
+            frame->damage->last() |= rect;
+    }
+}
+
+/*!
+ * Returns the modifiers of DMA-BUFs the stream maps itself, for consumers that
+ * can't import any.
+ */
+QHash<spa_video_format, QVector<uint64_t>> PipewireSourceStream::mappableDmaBufModifiers(const QVector<spa_video_format> &formats)
+{
+    QHash<spa_video_format, QVector<uint64_t>> ret;
+    for (spa_video_format format : formats) {
+        ret.insert(format, {DRM_FORMAT_MOD_LINEAR});
+    }
+    return ret;
+}
+
 void PipewireSourceStream::handleFrame(pw_buffer *buffer)
 {
     Q_D(PipewireSourceStream);
 
     spa_buffer *spaBuffer = buffer->buffer;
 
-    PipeWireFrame frame;
+    PipeWireFrame &frame = d->frame;
+    frame = {};
     frame.format = d->videoFormat.format;
+    static const QMetaMethod frameReceivedSignal = QMetaMethod::fromSignal(&PipewireSourceStream::frameReceived);
+    const bool hasReceivers = isSignalConnected(frameReceivedSignal);
 
+    FrameTraceScope trace("handleFrame", d->pwNodeId);
     struct spa_meta_header *h = (struct spa_meta_header *)spa_buffer_find_meta_data(spaBuffer, SPA_META_Header, sizeof(*h));
     if (h) {
         d->currentPresentationTimestamp = h->pts;
         frame.presentationTimestamp = h->pts;
         frame.sequential = h->seq;
+        trace.setFrame(h->pts, h->seq);
     } else {
-        d->currentPresentationTimestamp = QDateTime::currentDateTime().toMSecsSinceEpoch() * 1000000;
+        d->currentPresentationTimestamp = QDateTime::currentMSecsSinceEpoch() * 1000000;
     }
 
-    if (spa_meta *vd = spa_buffer_find_meta(spaBuffer, SPA_META_VideoDamage)) {
-        frame.damage = QRegion();
+    const QRect crop = d->frameRect(spaBuffer);
+    frame.sourceRect = crop;
+
+#if PW_CHECK_VERSION(0, 3, 57)
+    auto videoTransform = static_cast<spa_meta_videotransform *>(spa_buffer_find_meta_data(spaBuffer, SPA_META_VideoTransform, sizeof(spa_meta_videotransform)));
+    if (videoTransform && videoTransform->transform <= quint32(PipeWireTransform::Flipped270))
+        frame.transform = PipeWireTransform(videoTransform->transform);
+#endif
+
+    spa_meta *vd = d->wantsDamage() ? spa_buffer_find_meta(spaBuffer, SPA_META_VideoDamage) : nullptr;
+    if (vd) {
+        frame.damage.emplace();
         spa_meta_region *mr;
         spa_meta_for_each(mr, vd)
         {
-            *frame.damage += QRect(mr->region.position.x, mr->region.position.y, mr->region.size.width, mr->region.size.height);
+            if (!spa_meta_region_is_valid(mr))
+                break;
+            // Damage is reported relative to the part of the stream the frame shows
+            const QRect rect = QRect(mr->region.position.x, mr->region.position.y, mr->region.size.width, mr->region.size.height) & crop;
+            if (rect.isEmpty())
+                continue;
+            if (frame.damage->size() < videoDamageRegionCount)
+                frame.damage->append(rect.translated(-crop.topLeft()));
+            else
+                frame.damage->last() |= rect.translated(-crop.topLeft());
         }
     }
 
-    { // process cursor
+    // The damage of skipped buffers is unknown, the whole frame has to be updated
+    if (d->damageLost && spaBuffer->datas->chunk->size != 0) {
+        frame.damage.reset();
+        d->damageLost = false;
+    }
+
+    if (d->wantsCursor()) { // process cursor
         struct spa_meta_cursor *cursor = static_cast<struct spa_meta_cursor *>(spa_buffer_find_meta_data(spaBuffer, SPA_META_Cursor, sizeof(*cursor)));
-        if (spa_meta_cursor_is_valid(cursor)) {
+        if (cursor && spa_meta_cursor_is_valid(cursor)) {
             struct spa_meta_bitmap *bitmap = nullptr;
 
             if (cursor->bitmap_offset)
@@ -307,7 +1280,8 @@ void PipewireSourceStream::handleFrame(pw_buffer *buffer)
             QImage cursorTexture;
             if (bitmap && bitmap->size.width > 0 && bitmap->size.height > 0) {
                 const uint8_t *bitmap_data = SPA_MEMBER(bitmap, bitmap->offset, uint8_t);
-                cursorTexture = QImage(bitmap_data, bitmap->size.width, bitmap->size.height, bitmap->stride, SpaToQImageFormat(bitmap->format));
+                // The bitmap only comes with shape changes, the buffer goes back to the producer
+                cursorTexture = QImage(bitmap_data, bitmap->size.width, bitmap->size.height, bitmap->stride, SpaToQImageFormat(bitmap->format)).copy();
             }
             frame.cursor = {{cursor->position.x, cursor->position.y}, {cursor->hotspot.x, cursor->hotspot.y}, cursorTexture};
         } else {
@@ -315,46 +1289,45 @@ void PipewireSourceStream::handleFrame(pw_buffer *buffer)
         }
     }
 
+    bool copyLater = false;
     if (spaBuffer->datas->chunk->size == 0) {
         // do not get a frame
-    } else if (spaBuffer->datas->type == SPA_DATA_MemFd) {
-        if (spaBuffer->datas->chunk->size == 0)
-            return;
-
-        uint8_t *map =
-                static_cast<uint8_t *>(mmap(nullptr, spaBuffer->datas->maxsize + spaBuffer->datas->mapoffset, PROT_READ, MAP_PRIVATE, spaBuffer->datas->fd, 0));
-
-        if (map == MAP_FAILED) {
-            qDebug() << "Failed to mmap the memory: " << strerror(errno);
-            return;
+    } else if (spaBuffer->datas->type == SPA_DATA_MemFd || spaBuffer->datas->type == SPA_DATA_MemPtr) {
+        // Held buffers are copied by the consumer unless it takes a frame writer,
+        // frames that are downscaled always go through the copy thread
+        if (!hasReceivers) {
+            // Only sinks look at this frame, they read it in place
+        } else if (d->copyRunning || ImageScaler::targetSize(crop.size(), d->downscaleSize) != crop.size()) {
+            // Downscaling is too slow for the loop's and the render thread, see queueCopy()
+            frame.buffer = buffer;
+            copyLater = true;
+        } else if (d->holdBuffers && !d->frameWriter) {
+            frame.buffer = buffer;
+        } else {
+            QMutexLocker locker(&d->copyMutex);
+            const QImage image = d->readImage(spaBuffer, crop, &frame.damage);
+            if (image.isNull())
+                return;
+            frame.image = image;
         }
-        QImage img(map, d->videoFormat.size.width, d->videoFormat.size.height, spaBuffer->datas->chunk->stride, SpaToQImageFormat(d->videoFormat.format));
-        frame.image = img.copy();
-
-        munmap(map, spaBuffer->datas->maxsize + spaBuffer->datas->mapoffset);
     } else if (spaBuffer->datas->type == SPA_DATA_DmaBuf) {
-        DmaBufAttributes attribs;
-        attribs.planes.reserve(spaBuffer->n_datas);
+        DmaBufAttributes &attribs = frame.dmabuf.emplace();
         attribs.format = spaVideoFormatToDrmFormat(d->videoFormat.format);
         attribs.modifier = d->videoFormat.modifier;
         ;
-        for (uint i = 0; i < spaBuffer->n_datas; ++i) {
+        for (uint i = 0; i < qMin<uint>(spaBuffer->n_datas, 4); ++i) {
             const auto &data = spaBuffer->datas[i];
 
             DmaBufPlane plane;
             plane.fd = data.fd;
             plane.stride = data.chunk->stride;
             plane.offset = data.chunk->offset;
-            attribs.planes += plane;
+            attribs.planes.append(plane);
         }
         Q_ASSERT(!attribs.planes.isEmpty());
-        frame.dmabuf = attribs;
-    } else if (spaBuffer->datas->type == SPA_DATA_MemPtr) {
-        frame.image = QImage(static_cast<uint8_t *>(spaBuffer->datas->data),
-                             d->videoFormat.size.width,
-                             d->videoFormat.size.height,
-                             spaBuffer->datas->chunk->stride,
-                             SpaToQImageFormat(d->videoFormat.format));
+        // The producer must not render into the buffer while it is being imported
+        if (d->holdBuffers)
+            frame.buffer = buffer;
     } else {
         if (spaBuffer->datas->type == SPA_ID_INVALID)
             qDebug() << "invalid buffer type";
@@ -365,22 +1338,53 @@ void PipewireSourceStream::handleFrame(pw_buffer *buffer)
         frame.image = errorImage;
     }
 
-    Q_EMIT frameReceived(frame);
+    if (frame.buffer && hasReceivers) {
+        d->heldBuffers.append(buffer);
+        d->heldSince.append(d->clock.nsecsElapsed());
+    }
+
+    if (!d->sinks.isEmpty())
+        d->feedSinks(spaBuffer, frame);
+    if (copyLater)
+        d->queueCopy(frame, buffer);
+    else if (hasReceivers)
+        Q_EMIT frameReceived(frame);
+
+    // Drop the references so the pool image is free once the consumer is done with it
+    frame.image.reset();
+    frame.cursor.reset();
 }
 
 void PipewireSourceStream::process()
 {
     Q_D(PipewireSourceStream);
 
+    FrameTraceScope trace("process", d->pwNodeId);
+    const qint64 dequeueBegin = FrameTrace::isEnabled() ? FrameTrace::now() : 0;
+
     pw_buffer *buf = pw_stream_dequeue_buffer(d->pwStream);
     if (!buf) {
         qDebug() << "out of buffers";
         return;
     }
 
+    // Only the newest of several queued buffers is worth handling
+    while (pw_buffer *next = pw_stream_dequeue_buffer(d->pwStream)) {
+        pw_stream_queue_buffer(d->pwStream, buf);
+        buf = next;
+        d->damageLost = true;
+    }
+    if (dequeueBegin)
+        FrameTrace::record("dequeue", dequeueBegin, FrameTrace::now(), d->pwNodeId);
+
+    const qint64 start = d->clock.nsecsElapsed();
     handleFrame(buf);
 
-    pw_stream_queue_buffer(d->pwStream, buf);
+    if (!d->heldBuffers.contains(buf)) {
+        d->recordHoldTime(d->clock.nsecsElapsed() - start);
+        pw_stream_queue_buffer(d->pwStream, buf);
+        updateBufferCount();
+    }
 }
 
 void PipewireSourceStream::renegotiateModifierFailed(spa_video_format format, quint64 modifier)
@@ -423,6 +1427,11 @@ uint32_t PipewireSourceStream::spaVideoFormatToDrmFormat(spa_video_format spa_fo
     }
 }
 
+QVector<spa_video_format> PipewireSourceStream::supportedVideoFormats()
+{
+    return {SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGR};
+}
+
 bool PipewireSourceStream::allowDmaBuf()
 {
     Q_D(const PipewireSourceStream);
@@ -460,30 +1469,59 @@ void PipewireSourceStream::onStreamParamChanged(void *data, uint32_t id, const s
     }
 
     PipewireSourceStream *pw = static_cast<PipewireSourceStream *>(data);
-    spa_video_info_raw video_info_raw = pw->videoFormat();
-    spa_format_video_raw_parse(format, &video_info_raw);
-
-    uint8_t paramsBuffer[1024];
-    spa_pod_builder pod_builder = SPA_POD_BUILDER_INIT(paramsBuffer, sizeof(paramsBuffer));
+    PipewireSourceStreamPrivate *d = pw->d_func();
+    const spa_video_info_raw previousFormat = d->videoFormat;
+    {
+        QMutexLocker locker(&d->copyMutex);
+        spa_format_video_raw_parse(format, &d->videoFormat);
+    }
+    // Idle blocks only fit frames of the previous format and size
+    if (d->videoFormat.format != previousFormat.format
+            || d->videoFormat.size.width != previousFormat.size.width
+            || d->videoFormat.size.height != previousFormat.size.height)
+        d->bufferPool.clear();
+    if (SpaToQImageFormat(d->videoFormat.format) == QImage::Format_Invalid)
+        qWarning() << "video format" << d->videoFormat.format << "can only be shown as a DMA-BUF";
 
     // When SPA_FORMAT_VIDEO_modifier is present we can use DMA-BUFs as
     // the server announces support for it.
     // See https://github.com/PipeWire/pipewire/blob/master/doc/dma-buf.dox
 
-    const auto bufferTypes = pw->allowDmaBuf() && spa_pod_find_prop(format, nullptr, SPA_FORMAT_VIDEO_modifier)
+    d->bufferTypes = d->allocateBuffers
+            ? (1 << SPA_DATA_MemFd)
+            : pw->allowDmaBuf() && spa_pod_find_prop(format, nullptr, SPA_FORMAT_VIDEO_modifier)
             ? (1 << SPA_DATA_DmaBuf) | (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr)
             : (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr);
 
+    pw->updateBufferParams();
+    Q_EMIT pw->streamParametersChanged();
+}
+
+/*!
+ * Sends the buffer and meta parameters for the negotiated format, asking for as
+ * many buffers as preferredBufferCount() allows.
+ */
+void PipewireSourceStream::updateBufferParams()
+{
+    Q_D(PipewireSourceStream);
+
+    uint8_t paramsBuffer[1024];
+    spa_pod_builder pod_builder = SPA_POD_BUILDER_INIT(paramsBuffer, sizeof(paramsBuffer));
+
+    d->bufferCount = d->preferredBufferCount();
+    d->lastBufferUpdate = d->clock.elapsed();
+    qDebug() << "asking for" << d->bufferCount << "buffers of" << size();
+
     QVarLengthArray<const spa_pod *> params = {
         (spa_pod *)spa_pod_builder_add_object(&pod_builder,
         SPA_TYPE_OBJECT_ParamBuffers,
         SPA_PARAM_Buffers,
         SPA_PARAM_BUFFERS_buffers,
-        SPA_POD_CHOICE_RANGE_Int(16, 2, 16),
+        SPA_POD_CHOICE_RANGE_Int(d->bufferCount, minBufferCount, d->bufferCount),
         SPA_PARAM_BUFFERS_align,
-        SPA_POD_Int(16),
+        SPA_POD_Int(bufferAlignment),
         SPA_PARAM_BUFFERS_dataType,
-        SPA_POD_CHOICE_FLAGS_Int(bufferTypes)),
+        SPA_POD_CHOICE_FLAGS_Int(d->bufferTypes)),
         (spa_pod *)spa_pod_builder_add_object(&pod_builder,
         SPA_TYPE_OBJECT_ParamMeta,
         SPA_PARAM_Meta,
@@ -495,12 +1533,37 @@ void PipewireSourceStream::onStreamParamChanged(void *data, uint32_t id, const s
         SPA_TYPE_OBJECT_ParamMeta,
         SPA_PARAM_Meta,
         SPA_PARAM_META_type,
-        SPA_POD_Id(SPA_META_Cursor),
+        SPA_POD_Id(SPA_META_VideoCrop),
         SPA_PARAM_META_size,
-        SPA_POD_CHOICE_RANGE_Int(CURSOR_META_SIZE(64, 64), CURSOR_META_SIZE(1, 1), CURSOR_META_SIZE(1024, 1024))),
+        SPA_POD_Int(sizeof(struct spa_meta_region))),
     };
 
-    if (pw->withDamage()) {
+#if PW_CHECK_VERSION(0, 3, 57)
+    // Producers of rotated outputs leave the rotation to us, it is free in the scene graph
+    params.append((spa_pod *)spa_pod_builder_add_object(&pod_builder,
+                                                        SPA_TYPE_OBJECT_ParamMeta,
+                                                        SPA_PARAM_Meta,
+                                                        SPA_PARAM_META_type,
+                                                        SPA_POD_Id(SPA_META_VideoTransform),
+                                                        SPA_PARAM_META_size,
+                                                        SPA_POD_Int(sizeof(struct spa_meta_videotransform))));
+#endif
+
+    // Previews show neither the cursor nor damage
+    if (d->wantsCursor() && !d->previewMode) {
+        const int defaultSize = qMin(64, d->cursorMaxSize);
+        params.append((spa_pod *)spa_pod_builder_add_object(&pod_builder,
+                                                            SPA_TYPE_OBJECT_ParamMeta,
+                                                            SPA_PARAM_Meta,
+                                                            SPA_PARAM_META_type,
+                                                            SPA_POD_Id(SPA_META_Cursor),
+                                                            SPA_PARAM_META_size,
+                                                            SPA_POD_CHOICE_RANGE_Int(CURSOR_META_SIZE(defaultSize, defaultSize),
+                                                                                     CURSOR_META_SIZE(1, 1),
+                                                                                     CURSOR_META_SIZE(d->cursorMaxSize, d->cursorMaxSize))));
+    }
+
+    if (d->wantsDamage() && !d->previewMode) {
         params.append((spa_pod *)spa_pod_builder_add_object(&pod_builder,
                                                             SPA_TYPE_OBJECT_ParamMeta,
                                                             SPA_PARAM_Meta,
@@ -512,8 +1575,35 @@ void PipewireSourceStream::onStreamParamChanged(void *data, uint32_t id, const s
                                                                                      sizeof(struct spa_meta_region) * videoDamageRegionCount)));
     }
 
-    pw_stream_update_params(pw->pwStream(), params.data(), params.count());
-    Q_EMIT pw->streamParametersChanged();
+    pw_stream_update_params(d->pwStream, params.data(), params.count());
+}
+
+/*!
+ * Renegotiates the buffers when the preferred count changed. More buffers are
+ * asked for right away, giving some back waits a few seconds so that a couple
+ * of slow frames don't reallocate the pool back and forth.
+ */
+void PipewireSourceStream::updateBufferCount()
+{
+    Q_D(PipewireSourceStream);
+
+    if (!d->pwStream || !d->bufferTypes)
+        return;
+
+    const int count = d->preferredBufferCount();
+    const qint64 sinceUpdate = d->clock.elapsed() - d->lastBufferUpdate;
+    if (count > d->bufferCount) {
+        if (sinceUpdate < bufferGrowDelay)
+            return;
+    } else if (count < d->bufferCount) {
+        // Shrinking waits until the hold time is clearly below what the count was for
+        if (sinceUpdate < bufferShrinkDelay || d->bufferCountFor(d->holdTime + d->holdTime / 4) >= d->bufferCount)
+            return;
+    } else {
+        return;
+    }
+
+    updateBufferParams();
 }
 
 void PipewireSourceStream::onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message)
@@ -524,6 +1614,9 @@ void PipewireSourceStream::onStreamStateChanged(void *data, pw_stream_state old,
     switch (state) {
     case PW_STREAM_STATE_ERROR:
         qWarning() << "Stream error: " << error_message;
+        if (!pw->stopped()) {
+            Q_EMIT pw->stopStreaming();
+        }
         break;
     case PW_STREAM_STATE_PAUSED:
         Q_EMIT pw->streamReady();
@@ -548,6 +1641,88 @@ void PipewireSourceStream::onRenegotiate(void *data, uint64_t)
     pw_stream_update_params(pw->pwStream(), params.data(), params.size());
 }
 
+/*!
+ * Gives \a buffer memory from the pool when the stream allocates its buffers.
+ * Rows are padded to the buffer alignment, so that the SIMD scaler and uploads
+ * read whole cache lines.
+ */
+void PipewireSourceStream::onAddBuffer(void *data, pw_buffer *buffer)
+{
+    PipewireSourceStream *pw = static_cast<PipewireSourceStream *>(data);
+    PipewireSourceStreamPrivate *d = pw->d_func();
+
+    spa_data *spaData = buffer->buffer->datas;
+    if (!d->allocateBuffers || buffer->buffer->n_datas < 1 || !(spaData->type & (1 << SPA_DATA_MemFd)))
+        return;
+
+    const int bytesPerPixel = QImage::toPixelFormat(SpaToQImageFormat(d->videoFormat.format)).bitsPerPixel() / 8;
+    if (!bytesPerPixel)
+        return;
+    const size_t stride = SPA_ROUND_UP_N(size_t(d->videoFormat.size.width) * bytesPerPixel, size_t(bufferAlignment));
+    const size_t size = qMax<size_t>(spaData->maxsize, stride * d->videoFormat.size.height);
+
+    const MemFdBufferPool::Block block = d->bufferPool.acquire(size);
+    if (!block.isValid())
+        return;
+
+    spaData->type = SPA_DATA_MemFd;
+    spaData->flags = SPA_DATA_FLAG_READWRITE;
+    spaData->fd = block.fd;
+    spaData->mapoffset = 0;
+    spaData->maxsize = block.size;
+    spaData->data = block.data;
+    d->allocatedBuffers.insert(buffer, block);
+}
+
+void PipewireSourceStream::onRemoveBuffer(void *data, pw_buffer *buffer)
+{
+    PipewireSourceStream *pw = static_cast<PipewireSourceStream *>(data);
+    PipewireSourceStreamPrivate *d = pw->d_func();
+
+    Q_EMIT pw->bufferRemoved(buffer);
+    d->bufferPool.release(d->allocatedBuffers.take(buffer));
+
+    if (d->copyRunning && d->copyJob.buffer == buffer) {
+        // Waits for a copy that is reading the buffer
+        QMutexLocker locker(&d->copyMutex);
+        d->copyJob.buffer = nullptr;
+    }
+    if (d->pendingCopyJob.buffer == buffer)
+        d->pendingCopyJob = {};
+
+    const int index = d->heldBuffers.indexOf(buffer);
+    if (index >= 0) {
+        d->heldBuffers.remove(index);
+        d->heldSince.remove(index);
+    }
+    d->dmaBufMappings.remove(buffer);
+    QMutexLocker locker(&d->releaseMutex);
+    d->releasedBuffers.removeAll(buffer);
+}
+
+void PipewireSourceStream::onReleaseBuffers(void *data, uint64_t)
+{
+    PipewireSourceStream *pw = static_cast<PipewireSourceStream *>(data);
+    PipewireSourceStreamPrivate *d = pw->d_func();
+
+    {
+        QMutexLocker locker(&d->releaseMutex);
+        const qint64 now = d->clock.nsecsElapsed();
+        for (pw_buffer *buffer : qAsConst(d->releasedBuffers)) {
+            const int index = d->heldBuffers.indexOf(buffer);
+            if (index < 0)
+                continue;
+            d->recordHoldTime(now - d->heldSince.at(index));
+            d->heldBuffers.remove(index);
+            d->heldSince.remove(index);
+            pw_stream_queue_buffer(d->pwStream, buffer);
+        }
+        d->releasedBuffers.clear();
+    }
+
+    pw->updateBufferCount();
+}
+
 QVector<const spa_pod *> PipewireSourceStream::createFormatsParams()
 {
     Q_D(PipewireSourceStream);
@@ -555,8 +1730,7 @@ QVector<const spa_pod *> PipewireSourceStream::createFormatsParams()
     const auto pwServerVersion = d->pwCore->serverVersion();
     uint8_t buffer[4096];
     spa_pod_builder podBuilder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-    const QVector<spa_video_format> formats =
-    {SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGR};
+    const QVector<spa_video_format> &formats = d->videoFormats;
     QVector<const spa_pod *> params;
     params.reserve(formats.size() * 2);
     const EGLDisplay display = static_cast<EGLDisplay>(QGuiApplication::platformNativeInterface()->nativeResourceForIntegration("egldisplay"));
@@ -564,16 +1738,25 @@ QVector<const spa_pod *> PipewireSourceStream::createFormatsParams()
     d->allowDmaBuf = pwServerVersion.isNull() || (pwClientVersion >= kDmaBufMinVersion && pwServerVersion >= kDmaBufMinVersion);
     const bool withDontFixate = pwServerVersion.isNull() || (pwClientVersion >= kDmaBufModifierMinVersion && pwServerVersion >= kDmaBufModifierMinVersion);
 
-    if (d->availableModifiers.isEmpty()) {
+    if (!d->externalModifiers && d->availableModifiers.isEmpty()) {
         d->availableModifiers = queryDmaBufModifiers(display, formats);
     }
 
+    // The format of a previous connection goes first, as long as it can still be taken
+    if (d->preferredFormat && formats.contains(d->preferredFormat->format)) {
+        const spa_video_info_raw &preferred = *d->preferredFormat;
+        const bool withModifier = preferred.flags & SPA_VIDEO_FLAG_MODIFIER;
+        if (!withModifier || (d->allowDmaBuf && !d->previewMode && !d->allocateBuffers && d->availableModifiers.value(preferred.format).contains(preferred.modifier)))
+            params += buildFixedFormat(&podBuilder, preferred);
+    }
+
     for (auto it = d->availableModifiers.constBegin(), itEnd = d->availableModifiers.constEnd(); it != itEnd; ++it) {
-        if (d->allowDmaBuf && !it->isEmpty()) {
-            params += buildFormat(&podBuilder, it.key(), it.value(), withDontFixate);
+        // Previews and streams whose buffers we allocate never need a DMA-BUF
+        if (d->allowDmaBuf && !d->previewMode && !d->allocateBuffers && !it->isEmpty()) {
+            params += buildFormat(&podBuilder, it.key(), it.value(), withDontFixate, d->maxFrameRate);
         }
 
-        params += buildFormat(&podBuilder, it.key(), {}, withDontFixate);
+        params += buildFormat(&podBuilder, it.key(), {}, withDontFixate, d->maxFrameRate);
     }
     return params;
 }
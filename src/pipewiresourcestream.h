@@ -10,12 +10,15 @@
 #include <spa/param/props.h>
 #include <spa/param/video/format-utils.h>
 
+#include <QExplicitlySharedDataPointer>
 #include <QHash>
 #include <QImage>
 #include <QObject>
 #include <QPoint>
+#include <QRect>
 #include <QSharedPointer>
 #include <QSize>
+#include <QVarLengthArray>
 
 struct DmaBufPlane {
     int fd;
@@ -29,7 +32,24 @@ struct DmaBufAttributes {
     uint32_t format = 0;
     uint64_t modifier = 0;
 
-    QVector<DmaBufPlane> planes;
+    // Stored inline, a buffer never has more than four planes
+    QVarLengthArray<DmaBufPlane, 4> planes;
+};
+
+// Damage rectangles are stored inline, producers are asked for at most 16 of them
+using PipeWireDamage = QVarLengthArray<QRect, 16>;
+
+// Mirrors spa_meta_videotransform_value, which older PipeWire headers lack. The
+// frame has to be flipped around its vertical axis, then rotated counter-clockwise.
+enum class PipeWireTransform : quint32 {
+    Normal,
+    Rotate90,
+    Rotate180,
+    Rotate270,
+    Flipped,
+    Flipped90,
+    Flipped180,
+    Flipped270,
 };
 
 struct PipeWireCursor {
@@ -44,8 +64,16 @@ struct PipeWireFrame {
     qint64 presentationTimestamp;
     std::optional<DmaBufAttributes> dmabuf;
     std::optional<QImage> image;
-    std::optional<QRegion> damage;
+    std::optional<PipeWireDamage> damage;
     std::optional<PipeWireCursor> cursor;
+    // Part of the stream the frame shows, in stream coordinates. CPU frames only
+    // contain this part, DMA-BUFs contain the whole buffer.
+    QRect sourceRect;
+    // How the producer wants the buffer turned for display
+    PipeWireTransform transform = PipeWireTransform::Normal;
+    // Set when the stream holds buffers for the consumer, who has to hand it back
+    // with PipewireSourceStream::releaseBuffer()
+    pw_buffer *buffer = nullptr;
 };
 
 struct Fraction {
@@ -53,6 +81,8 @@ struct Fraction {
     const quint32 denominator;
 };
 
+class PboFrameWriter;
+class PipeWireFrameSink;
 class PipewireSourceStreamPrivate;
 
 class WSM_WALLPAPER_EXPORT PipewireSourceStream : public QObject
@@ -70,12 +100,47 @@ public:
     bool createStream(uint nodeid, int fd);
     void setActive(bool active);
     void setDamageEnabled(bool withDamage);
+    void setDownscaleSize(const QSize &size);
+    QSize downscaleSize() const;
+    void setSourceRect(const QRect &rect);
+    QRect sourceRect() const;
+    void setDmaBufModifiers(const QHash<spa_video_format, QVector<uint64_t>> &modifiers);
+    void setVideoFormats(const QVector<spa_video_format> &formats);
+    void setBufferMemoryBudget(qint64 bytes);
+    qint64 bufferMemoryBudget() const;
+    int bufferCount() const;
+    void setPreviewMode(bool preview);
+    bool previewMode() const;
+    void setAllocateBuffers(bool allocate);
+    bool allocateBuffers() const;
+    void setFrameWriter(const QExplicitlySharedDataPointer<PboFrameWriter> &writer);
+    QExplicitlySharedDataPointer<PboFrameWriter> frameWriter() const;
+
+    void addFrameSink(PipeWireFrameSink *sink);
+    void removeFrameSink(PipeWireFrameSink *sink);
+
+    void setCursorEnabled(bool enabled);
+    bool cursorEnabled() const;
+    void setCursorMaxSize(int size);
+    int cursorMaxSize() const;
+    void setMaxFrameRate(int fps);
+    int maxFrameRate() const;
+    void setPreferredFormat(const spa_video_info_raw &format);
+    void setHoldBuffers(bool hold);
+    void dropCachedImages();
+    bool isBufferHeld(pw_buffer *buffer) const;
+    void releaseBuffer(pw_buffer *buffer);
+    QImage frameImage(const PipeWireFrame &frame, std::optional<PipeWireDamage> *damage);
+    static bool isDmaBufMappable(const PipeWireFrame &frame);
+    static void mergeDamage(PipeWireFrame *frame, const PipeWireFrame &dropped);
 
     void handleFrame(struct pw_buffer *buffer);
     void process();
     void renegotiateModifierFailed(spa_video_format format, quint64 modifier);
     qint64 currentPresentationTimestamp() const;
     static uint32_t spaVideoFormatToDrmFormat(spa_video_format spa_format);
+    static QVector<spa_video_format> supportedVideoFormats();
+    static QHash<spa_video_format, QVector<uint64_t>> mappableDmaBufModifiers(const QVector<spa_video_format> &formats);
 
     bool allowDmaBuf();
     bool withDamage();
@@ -88,13 +153,24 @@ Q_SIGNALS:
     void startStreaming();
     void stopStreaming();
     void streamParametersChanged();
+    // The frame is recycled once the signal returns, receivers must be directly
+    // connected and copy what they keep
     void frameReceived(const PipeWireFrame &frame);
+    // Emitted before PipeWire frees the buffer, its file descriptors are still open
+    void bufferRemoved(pw_buffer *buffer);
 
 private:
     static void onStreamParamChanged(void *data, uint32_t id, const struct spa_pod *format);
     static void onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message);
     static void onRenegotiate(void *data, uint64_t);
+    static void onAddBuffer(void *data, pw_buffer *buffer);
+    static void onRemoveBuffer(void *data, pw_buffer *buffer);
+    static void onReleaseBuffers(void *data, uint64_t);
     QVector<const spa_pod *> createFormatsParams();
+    void advertiseSourceRect();
+    void updateBufferParams();
+    void updateSinkMetadata();
+    void updateBufferCount();
 
     void coreFailed(const QString &errorMessage);
 
@@ -103,6 +179,4 @@ private:
     Q_DISABLE_COPY(PipewireSourceStream)
 };
 
-Q_DECLARE_METATYPE(QVector<DmaBufPlane>);
-
 #endif // PIPEWIRESOURCESTREAM_H
@@ -0,0 +1,109 @@
+#include "previewscheduler.h"
+#include "pipewiresourceitem.h"
+
+#include <algorithm>
+
+#include <QCoreApplication>
+
+static const int tickInterval = 50;
+
+PreviewScheduler::PreviewScheduler(QObject *parent)
+    : QObject(parent)
+{
+    m_timer.setInterval(tickInterval);
+    connect(&m_timer, &QTimer::timeout, this, &PreviewScheduler::tick);
+    m_clock.start();
+}
+
+PreviewScheduler *PreviewScheduler::instance()
+{
+    static PreviewScheduler *scheduler = new PreviewScheduler(qApp);
+    return scheduler;
+}
+
+void PreviewScheduler::addPreview(PipewireSourceItem *item)
+{
+    for (const Preview &preview : qAsConst(m_previews)) {
+        if (preview.item == item)
+            return;
+    }
+
+    m_previews.append({item, -1});
+    if (!m_timer.isActive())
+        m_timer.start();
+}
+
+void PreviewScheduler::removePreview(PipewireSourceItem *item)
+{
+    for (int i = 0; i < m_previews.size(); ++i) {
+        if (m_previews.at(i).item == item) {
+            m_previews.remove(i);
+            if (m_next > i)
+                --m_next;
+            break;
+        }
+    }
+
+    if (m_previews.isEmpty())
+        m_timer.stop();
+}
+
+/*!
+ * Sets how many bytes of preview frames may be copied per second, all previews
+ * together.
+ */
+void PreviewScheduler::setBudget(qint64 bytesPerSecond)
+{
+    m_budget = qMax<qint64>(bytesPerSecond, 0);
+}
+
+/*!
+ * Sets how often a single preview refreshes at most, even when the budget allows
+ * more.
+ */
+void PreviewScheduler::setMaxFrameRate(int fps)
+{
+    m_maxFrameRate = qMax(fps, 1);
+}
+
+void PreviewScheduler::tick()
+{
+    const qint64 now = m_clock.elapsed();
+    const qint64 minInterval = 1000 / m_maxFrameRate;
+    qint64 remaining = m_budget * tickInterval / 1000;
+
+    const int count = m_previews.size();
+    int served = -1;
+    for (int i = 0; i < count && remaining > 0; ++i) {
+        const int index = (m_next + i) % count;
+        Preview &preview = m_previews[index];
+        if (!preview.item || !preview.item->wantsPreviewFrame())
+            continue;
+        if (preview.lastGrant >= 0 && now - preview.lastGrant < minInterval)
+            continue;
+
+        const qint64 cost = preview.item->previewFrameCost();
+        // The first candidate of a tick is always served, a preview larger than
+        // the whole share would otherwise never refresh
+        if (cost > remaining && served >= 0)
+            break;
+
+        remaining -= cost;
+        preview.lastGrant = now;
+        preview.item->grantPreviewFrame();
+        served = index;
+    }
+
+    if (served >= 0)
+        m_next = (served + 1) % count;
+
+    // Drop previews that were deleted without unregistering
+    m_previews.erase(std::remove_if(m_previews.begin(), m_previews.end(), [](const Preview &preview) {
+                         return !preview.item;
+                     }),
+                     m_previews.end());
+    if (m_next >= m_previews.size())
+        m_next = 0;
+    if (m_previews.isEmpty())
+        m_timer.stop();
+}
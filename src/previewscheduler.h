@@ -0,0 +1,55 @@
+#ifndef PREVIEWSCHEDULER_H
+#define PREVIEWSCHEDULER_H
+
+#include "wallpaperglobal.h"
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QPointer>
+#include <QTimer>
+#include <QVector>
+
+class PipewireSourceItem;
+
+/*!
+ * \brief Shares one refresh budget between all previews of the process.
+ *
+ * On every tick the previews are visited round-robin, starting after the last
+ * one served, and granted a frame as long as the tick's share of the budget
+ * covers their frame size. A preview is not served again before its minimum
+ * interval has passed, so a large grid refreshes slower instead of costing more.
+ */
+class WSM_WALLPAPER_EXPORT PreviewScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    static PreviewScheduler *instance();
+
+    void addPreview(PipewireSourceItem *item);
+    void removePreview(PipewireSourceItem *item);
+
+    void setBudget(qint64 bytesPerSecond);
+    qint64 budget() const { return m_budget; }
+
+    void setMaxFrameRate(int fps);
+    int maxFrameRate() const { return m_maxFrameRate; }
+
+private:
+    explicit PreviewScheduler(QObject *parent = nullptr);
+
+    void tick();
+
+    struct Preview {
+        QPointer<PipewireSourceItem> item;
+        qint64 lastGrant = -1;
+    };
+
+    QVector<Preview> m_previews;
+    int m_next = 0;
+    qint64 m_budget = 32 * 1024 * 1024;
+    int m_maxFrameRate = 4;
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+};
+
+#endif // PREVIEWSCHEDULER_H
@@ -4,15 +4,24 @@
 #include "wallpaperglobal.h"
 #include "pipewiresourceitem.h"
 #include "pipewiresourcestream.h"
-
-#include <EGL/egl.h>
+#include "texturebackend.h"
+#include "frameslot.h"
 
 #include <private/qquickitem_p.h>
 
+#include <QElapsedTimer>
 #include <QImage>
 #include <QSGImageNode>
-#include <QOpenGLTexture>
+#include <QPointer>
+#include <QQuickItemGrabResult>
 #include <QScopedPointer>
+#include <QThreadPool>
+#include <QTimer>
+
+#include <atomic>
+#include <optional>
+
+class PipeWireTextureProvider;
 
 class WSM_WALLPAPER_EXPORT PipewireSourceItemPrivate : public QQuickItemPrivate
 {
@@ -33,15 +42,115 @@ public:
     uint nodeId = 0;
     uint fd = 0;
 
-    QSGTexture *createNextTexture;
+    QSGTexture *createNextTexture = nullptr;
     QScopedPointer<PipewireSourceStream> stream;
-    QScopedPointer<QOpenGLTexture> texture;
 
-    EGLImage image = nullptr;
-    bool needsRecreateTexture = false;
+    // Created on the render thread for the window's graphics API
+    QScopedPointer<TextureBackend> backend;
+    mutable PipeWireTextureProvider *provider = nullptr;
+    QHash<spa_video_format, QVector<uint64_t>> dmaBufModifiers;
+    QVector<spa_video_format> videoFormats;
+    // Set on the render thread once the backend reported its formats and modifiers, streams
+    // of other APIs than GL wait for that before they connect
+    bool dmaBufModifiersKnown = false;
+    bool streamWaitsForBackend = false;
+    // DMA-BUFs of buffers the stream removed, or all of them after a renegotiation,
+    // the backend forgets them on the render thread
+    QVector<quint64> removedDmaBufs;
+    bool dmaBufsInvalidated = false;
+    // Set once a linear DMA-BUF failed to import, later ones are mapped right away
+    bool dmaBufImportFailed = false;
+
+    // Frames wait here until the render thread imports or uploads them
+    FrameSlot frameSlot;
+
+    // Set while frames are shown through a TiledTextureNode
+    bool tiled = false;
+    QImage tiledFrame;
+    // Set on the render thread when a frame is lost, its damage is then unknown
+    bool fullTileRefresh = false;
+
+    // Small CPU frames go into the window's TextureAtlas, the tile lives on the render thread
+    QSGTexture *atlasTile = nullptr;
+    bool atlasFits = false;
 
     Cursor cursor;
-    QRegion damage;
+    // Wallpapers rarely show the cursor, its metadata is only negotiated on request
+    bool cursorEnabled = false;
+    int cursorMaxSize = 256;
+    // Buffers come from our own hugepage backed pool instead of the producer
+    bool allocateBuffers = false;
+    // Render thread state of the frame shown last
+    PipeWireDamage damage;
+
+    // Occlusion tracking: the stream is paused while the wallpaper cannot be seen
+    QPointer<QQuickWindow> trackedWindow;
+    QMetaObject::Connection windowConnections[5];
+    // Last visibility seen while synchronizing, ancestors moving or clipping change it
+    bool syncedVisible = false;
+    bool pauseWhenHidden = true;
+    bool screenActive = true;
+    bool streamActive = false;
+
+    // Shrink CPU frames to the item's pixel size before they are uploaded
+    bool downscaleToItem = false;
+
+    // Requested region of interest, and what the newest frame and texture show of it
+    QRect sourceRect;
+    QRect frameSourceRect;
+    QRectF textureSourceRect;
+
+    // Rotation and flip of the newest frame, and of the one the render thread shows
+    PipeWireTransform transform = PipeWireTransform::Normal;
+    PipeWireTransform frameTransform = PipeWireTransform::Normal;
+
+    // Memory the producer may spend on buffers for this item, in MiB
+    int bufferMemoryBudget = 64;
+
+    // Previews only take the frames the PreviewScheduler grants them
+    bool preview = false;
+    QSize previewSize;
+    bool previewGranted = false;
+
+    // Set by the window's FrameScheduler when the pending frame waits for the next vsync
+    int priority = 0;
+    bool frameDeferred = false;
+    int consecutiveDeferrals = 0;
+
+    // Stream recovery: the last texture stays up while the stream reconnects with backoff
+    QTimer reconnectTimer;
+    int reconnectAttempts = 0;
+    QElapsedTimer recoveryTimer;
+    std::optional<spa_video_info_raw> lastFormat;
+
+    void resetRecovery()
+    {
+        reconnectTimer.stop();
+        reconnectAttempts = 0;
+        recoveryTimer.invalidate();
+        lastFormat.reset();
+    }
+
+    // Snapshot of a previous session, shown until the stream delivers and then faded out
+    QString snapshotKey;
+    QImage snapshot;
+    bool snapshotVisible = false;
+    QElapsedTimer snapshotFade;
+    QTimer snapshotTimer;
+    QSharedPointer<QQuickItemGrabResult> snapshotGrab;
+    // Set on the GUI thread, the render thread saves the next frame it handles
+    bool snapshotRequested = false;
+    QThreadPool snapshotPool;
+
+    struct Statistics {
+        quint64 framesReceived = 0;
+        quint64 framesDropped = 0;
+        // Counted on the render thread, statistics() reads them on the GUI thread
+        std::atomic<quint64> framesShown{0};
+        std::atomic<quint64> framesDeferred{0};
+        quint64 recoveries = 0;
+        qint64 lastRecoveryTime = -1;
+    } stats;
 };
 
 #endif // PIPEWIRESOURCEITEM_P_H
@@ -4,9 +4,48 @@
 #include "wallpaperglobal.h"
 #include "pipewiresourcestream.h"
 #include "pipewirecore.h"
+#include "imagescaler.h"
+#include "memfdbufferpool.h"
+#include "pbotextureuploader.h"
+#include "pipewireframesink.h"
 
 #include <private/qobject_p.h>
 
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QWaitCondition>
+
+/*!
+ * \brief Read only CPU mapping of a DMA-BUF plane.
+ *
+ * Reads are bracketed with DMA_BUF_IOCTL_SYNC, which makes the CPU caches
+ * coherent with what the producer rendered. The file descriptor is duplicated,
+ * so the mapping outlives the buffer PipeWire removes.
+ */
+class DmaBufMapping
+{
+public:
+    explicit DmaBufMapping(int fd);
+    ~DmaBufMapping();
+
+    bool isValid() const { return m_map; }
+    const uchar *data() const { return static_cast<const uchar *>(m_map); }
+    size_t size() const { return m_size; }
+
+    void beginRead();
+    void endRead();
+
+private:
+    int m_fd = -1;
+    void *m_map = nullptr;
+    size_t m_size = 0;
+
+    Q_DISABLE_COPY(DmaBufMapping)
+};
+
 class WSM_WALLPAPER_EXPORT PipewireSourceStreamPrivate : public QObjectPrivate
 {
     Q_DECLARE_PUBLIC(PipewireSourceStream)
@@ -23,15 +62,114 @@ public:
     uint32_t pwNodeId = 0;
     bool stopped = false;
 
-    spa_video_info_raw videoFormat;
+    spa_video_info_raw videoFormat = {};
     QString error;
     bool allowDmaBuf = true;
     qint64 currentPresentationTimestamp;
 
     QHash<spa_video_format, QVector<uint64_t>> availableModifiers;
+    // Formats the texture backend uploads as they are, only these are offered
+    QVector<spa_video_format> videoFormats = PipewireSourceStream::supportedVideoFormats();
+    // Set when the texture backend provides the modifiers instead of EGL
+    bool externalModifiers = false;
     spa_source *renegotiateEvent = nullptr;
 
     bool withDamage = false;
+    // Set when buffers were skipped, their damage is not part of the next frame's
+    bool damageLost = false;
+    bool previewMode = false;
+    // Cursor metadata costs a bitmap per buffer, it is only negotiated when asked for
+    bool cursorEnabled = false;
+    int cursorMaxSize = 256;
+    int maxFrameRate = 0;
+    std::optional<spa_video_info_raw> preferredFormat;
+
+    // CPU frames larger than this are downscaled before they leave the stream
+    QSize downscaleSize;
+    ImageScaler scaler;
+
+    // Recycled for every buffer, together with the images CPU frames are copied
+    // into, so that handing out a frame does not allocate once the pool is warm
+    PipeWireFrame frame = {};
+    static constexpr int imagePoolSize = 3;
+    QImage imagePool[imagePoolSize];
+    int currentImage = 0;
+    QRect currentImageRect;
+    QExplicitlySharedDataPointer<PboFrameWriter> frameWriter;
+    // Taken around every copy out of a buffer, copies run on the GUI, the render
+    // and the copy thread
+    QMutex copyMutex;
+
+    // Downscaled frames are copied on a worker while their buffer stays held. One
+    // copy runs at a time, a newer frame replaces the one waiting for it. The
+    // worker reports back through an eventfd, neither side allocates per frame.
+    struct CopyJob {
+        PipeWireFrame frame;
+        pw_buffer *buffer = nullptr;
+    };
+    QScopedPointer<QThread> copyThread;
+    QMutex copyQueueMutex;
+    QWaitCondition copyCondition;
+    bool copyRequested = false;
+    bool copyQuit = false;
+    int copyEventFd = -1;
+    QScopedPointer<QSocketNotifier> copyNotifier;
+    CopyJob copyJob;
+    CopyJob pendingCopyJob;
+    bool copyRunning = false;
+    QImage copyResult;
+    std::optional<PipeWireDamage> copyDamage;
+
+    // Region of interest requested by the consumer, invalid for the whole stream
+    QRect sourceRect;
+
+    // Buffers handed out with frames stay dequeued until the consumer releases
+    // them, which may happen on another thread
+    bool holdBuffers = false;
+    QVector<pw_buffer *> heldBuffers;
+    QVector<qint64> heldSince;
+    QMutex releaseMutex;
+    QVector<pw_buffer *> releasedBuffers;
+    spa_source *releaseEvent = nullptr;
+
+    // Linear DMA-BUFs are mapped on their first CPU read and stay mapped until removed
+    QHash<pw_buffer *, QSharedPointer<DmaBufMapping>> dmaBufMappings;
+
+    // Buffers we allocate ourselves, the pool keeps them mapped across renegotiations
+    bool allocateBuffers = false;
+    MemFdBufferPool bufferPool;
+    QHash<pw_buffer *, MemFdBufferPool::Block> allocatedBuffers;
+
+    // Buffer count negotiation, the count follows the frame size, how long the
+    // consumer keeps buffers and the memory budget
+    QElapsedTimer clock;
+    qint64 bufferBudget = 64 * 1024 * 1024;
+    qint64 holdTime = 0;
+    qint64 lastBufferUpdate = 0;
+    int bufferCount = 0;
+    int bufferTypes = 0;
+
+    // Headless consumers, called for every frame before frameReceived is emitted
+    QVector<PipeWireFrameSink *> sinks;
+    PipeWireFrameSink::MetadataFlags sinkMetadata;
+
+    bool wantsDamage() const { return withDamage || sinkMetadata.testFlag(PipeWireFrameSink::Damage); }
+    bool wantsCursor() const { return cursorEnabled || sinkMetadata.testFlag(PipeWireFrameSink::Cursor); }
+    qint64 frameInterval() const;
+    int bufferCountFor(qint64 holdTime) const;
+    int preferredBufferCount() const;
+    void recordHoldTime(qint64 nsecs);
+    QRect frameRect(spa_buffer *buffer) const;
+    QImage readImage(spa_buffer *buffer, const QRect &rect, std::optional<PipeWireDamage> *damage);
+    QImage readDmaBuf(pw_buffer *buffer, const QRect &rect, std::optional<PipeWireDamage> *damage);
+    QImage *acquireImage(const QSize &size, QImage::Format format);
+    QImage copyFrame(const uchar *data, int stride, const QRect &rect, std::optional<PipeWireDamage> *damage);
+    void feedSinks(spa_buffer *buffer, const PipeWireFrame &frame);
+    void queueCopy(const PipeWireFrame &frame, pw_buffer *buffer);
+    void startCopy();
+    void runCopy();
+    void finishCopy();
+    void stopCopyThread();
 };
 
 #endif // PIPEWIRESOURCESTREAM_P_H
@@ -1,4 +1,5 @@
 HEADERS += \
     $$PWD/pipewiresourceitem_p.h \
-    $$PWD/pipewiresourcestream_p.h
+    $$PWD/pipewiresourcestream_p.h \
+    $$PWD/slideshowsourceitem_p.h
 
@@ -0,0 +1,50 @@
+#ifndef SLIDESHOWSOURCEITEM_P_H
+#define SLIDESHOWSOURCEITEM_P_H
+
+#include "wallpaperglobal.h"
+#include "slideshowsourceitem.h"
+
+#include <private/qquickitem_p.h>
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QTimer>
+
+class WSM_WALLPAPER_EXPORT SlideshowSourceItemPrivate : public QQuickItemPrivate
+{
+    Q_DECLARE_PUBLIC(SlideshowSourceItem)
+
+public:
+    SlideshowSourceItemPrivate()
+    {
+    }
+
+    QStringList sources;
+    int currentIndex = -1;
+    int interval = 60000;
+    int transitionDuration = 1000;
+    int prefetchCount = 2;
+    bool running = true;
+    QTimer timer;
+
+    // Pixel size images are decoded for, the item's size on its screen
+    QSize targetSize;
+
+    // Index whose image is being decoded to be shown next, -1 when none is
+    int requestedIndex = -1;
+    // Decoded image the render thread uploads next, and the one shown last,
+    // which is uploaded again when the scene graph comes back
+    QImage pendingImage;
+    QImage shownImage;
+
+    // Render thread state of the crossfade: the next image is first drawn under
+    // the current one, which uploads it, and the current one then fades out
+    enum class Transition {
+        None,
+        Prepared,
+        Fading,
+    } transition = Transition::None;
+    QElapsedTimer fade;
+};
+
+#endif // SLIDESHOWSOURCEITEM_P_H
@@ -0,0 +1,443 @@
+#include "slideshowsourceitem.h"
+#include "private/slideshowsourceitem_p.h"
+#include "decodedimagecache.h"
+
+#include <QDebug>
+#include <QQuickWindow>
+#include <QSGImageNode>
+#include <QSGOpacityNode>
+#include <QUrl>
+
+/*!
+ * Returns the part of an image of \a imageSize that covers \a target with the
+ * image's aspect ratio, centered.
+ */
+static QRectF coverSourceRect(const QSize &imageSize, const QSizeF &target)
+{
+    if (target.isEmpty())
+        return QRectF({0, 0}, imageSize);
+
+    const QSizeF crop = target.scaled(imageSize, Qt::KeepAspectRatio);
+    return QRectF(QPointF((imageSize.width() - crop.width()) / 2, (imageSize.height() - crop.height()) / 2), crop);
+}
+
+class SlideshowNode : public QSGNode
+{
+public:
+    bool hasFront() const
+    {
+        return m_front;
+    }
+
+    void setFront(QQuickWindow *window, QSGTexture *texture)
+    {
+        if (!m_front) {
+            m_frontOpacity = new QSGOpacityNode;
+            m_front = window->createImageNode();
+            m_front->setOwnsTexture(true);
+            m_frontOpacity->appendChildNode(m_front);
+            appendChildNode(m_frontOpacity);
+        }
+        m_front->setTexture(texture);
+        m_frontOpacity->setOpacity(1);
+    }
+
+    // Drawn under the front image, which is enough to have it uploaded
+    void setBack(QQuickWindow *window, QSGTexture *texture)
+    {
+        if (!m_back) {
+            m_back = window->createImageNode();
+            m_back->setOwnsTexture(true);
+            prependChildNode(m_back);
+        }
+        m_back->setTexture(texture);
+    }
+
+    void setFrontOpacity(qreal opacity)
+    {
+        if (m_frontOpacity)
+            m_frontOpacity->setOpacity(opacity);
+    }
+
+    // Ends a transition, the back image becomes the front one
+    void promoteBack(QQuickWindow *window)
+    {
+        if (!m_back)
+            return;
+
+        QSGTexture *texture = m_back->texture();
+        m_back->setOwnsTexture(false);
+        removeChildNode(m_back);
+        delete m_back;
+        m_back = nullptr;
+        setFront(window, texture);
+    }
+
+    void layout(const QRectF &rect)
+    {
+        for (QSGImageNode *node : {m_front, m_back}) {
+            if (!node || !node->texture())
+                continue;
+            node->setSourceRect(coverSourceRect(node->texture()->textureSize(), rect.size()));
+            node->setRect(rect);
+        }
+    }
+
+private:
+    QSGOpacityNode *m_frontOpacity = nullptr;
+    QSGImageNode *m_front = nullptr;
+    QSGImageNode *m_back = nullptr;
+};
+
+SlideshowSourceItem::SlideshowSourceItem(QQuickItem *parent)
+    : QQuickItem(*(new SlideshowSourceItemPrivate), parent)
+{
+    Q_D(SlideshowSourceItem);
+
+    setFlag(ItemHasContents, true);
+
+    d->timer.setInterval(d->interval);
+    connect(&d->timer, &QTimer::timeout, this, &SlideshowSourceItem::advance);
+    connect(DecodedImageCache::instance(), &DecodedImageCache::imageDecoded, this, &SlideshowSourceItem::handleImageDecoded);
+}
+
+SlideshowSourceItem::SlideshowSourceItem(SlideshowSourceItemPrivate &dd, QQuickItem *parent)
+    : QQuickItem(dd, parent)
+{}
+
+/*!
+ * Sets the images to show, as local paths or file URLs.
+ */
+void SlideshowSourceItem::setSources(const QStringList &sources)
+{
+    Q_D(SlideshowSourceItem);
+
+    if (sources == d->sources)
+        return;
+
+    d->sources = sources;
+    d->requestedIndex = -1;
+    if (isComponentComplete()) {
+        showIndex(sources.isEmpty() ? -1 : 0);
+        restartTimer();
+    }
+    Q_EMIT sourcesChanged(sources);
+}
+
+QStringList SlideshowSourceItem::sources() const
+{
+    Q_D(const SlideshowSourceItem);
+    return d->sources;
+}
+
+/*!
+ * Shows the image at \a index once it is decoded, and restarts the interval.
+ */
+void SlideshowSourceItem::setCurrentIndex(int index)
+{
+    Q_D(SlideshowSourceItem);
+
+    if (index == d->currentIndex || index < 0 || index >= d->sources.size())
+        return;
+
+    if (isComponentComplete()) {
+        showIndex(index);
+        restartTimer();
+    } else {
+        d->currentIndex = index;
+        Q_EMIT currentIndexChanged(index);
+    }
+}
+
+int SlideshowSourceItem::currentIndex() const
+{
+    Q_D(const SlideshowSourceItem);
+    return d->currentIndex;
+}
+
+void SlideshowSourceItem::setInterval(int msecs)
+{
+    Q_D(SlideshowSourceItem);
+
+    msecs = qMax(msecs, 1);
+    if (msecs == d->interval)
+        return;
+
+    d->interval = msecs;
+    d->timer.setInterval(msecs);
+    Q_EMIT intervalChanged(msecs);
+}
+
+int SlideshowSourceItem::interval() const
+{
+    Q_D(const SlideshowSourceItem);
+    return d->interval;
+}
+
+void SlideshowSourceItem::setTransitionDuration(int msecs)
+{
+    Q_D(SlideshowSourceItem);
+
+    msecs = qMax(msecs, 0);
+    if (msecs == d->transitionDuration)
+        return;
+
+    d->transitionDuration = msecs;
+    Q_EMIT transitionDurationChanged(msecs);
+}
+
+int SlideshowSourceItem::transitionDuration() const
+{
+    Q_D(const SlideshowSourceItem);
+    return d->transitionDuration;
+}
+
+/*!
+ * Sets how many of the following images are decoded ahead of time, 2 by default.
+ */
+void SlideshowSourceItem::setPrefetchCount(int count)
+{
+    Q_D(SlideshowSourceItem);
+
+    count = qMax(count, 0);
+    if (count == d->prefetchCount)
+        return;
+
+    d->prefetchCount = count;
+    prefetchAhead();
+    Q_EMIT prefetchCountChanged(count);
+}
+
+int SlideshowSourceItem::prefetchCount() const
+{
+    Q_D(const SlideshowSourceItem);
+    return d->prefetchCount;
+}
+
+void SlideshowSourceItem::setRunning(bool running)
+{
+    Q_D(SlideshowSourceItem);
+
+    if (running == d->running)
+        return;
+
+    d->running = running;
+    restartTimer();
+    Q_EMIT runningChanged(running);
+}
+
+bool SlideshowSourceItem::running() const
+{
+    Q_D(const SlideshowSourceItem);
+    return d->running;
+}
+
+void SlideshowSourceItem::componentComplete()
+{
+    Q_D(SlideshowSourceItem);
+
+    QQuickItem::componentComplete();
+    updateTargetSize();
+    if (!d->sources.isEmpty())
+        showIndex(qBound(0, d->currentIndex, d->sources.size() - 1));
+    restartTimer();
+}
+
+void SlideshowSourceItem::restartTimer()
+{
+    Q_D(SlideshowSourceItem);
+
+    if (d->running && isComponentComplete() && d->sources.size() > 1)
+        d->timer.start();
+    else
+        d->timer.stop();
+}
+
+QString SlideshowSourceItem::sourcePath(int index) const
+{
+    Q_D(const SlideshowSourceItem);
+
+    const QString &source = d->sources.at(index);
+    const QUrl url(source);
+    return url.isLocalFile() ? url.toLocalFile() : source;
+}
+
+/*!
+ * Shows \a index right away when its image is cached, otherwise once it is
+ * decoded. The current image stays up in the meantime.
+ */
+void SlideshowSourceItem::showIndex(int index)
+{
+    Q_D(SlideshowSourceItem);
+
+    if (index < 0 || index >= d->sources.size()) {
+        d->requestedIndex = -1;
+        return;
+    }
+
+    d->requestedIndex = index;
+    if (d->targetSize.isEmpty())
+        return;
+
+    const QString path = sourcePath(index);
+    const QImage image = DecodedImageCache::instance()->image(path, d->targetSize);
+    if (image.isNull()) {
+        DecodedImageCache::instance()->prefetch(path, d->targetSize);
+        return;
+    }
+
+    d->pendingImage = image;
+    d->shownImage = image;
+    d->requestedIndex = -1;
+    update();
+    prefetchAhead();
+
+    if (index != d->currentIndex) {
+        d->currentIndex = index;
+        Q_EMIT currentIndexChanged(index);
+    }
+}
+
+void SlideshowSourceItem::advance()
+{
+    Q_D(SlideshowSourceItem);
+
+    if (d->sources.isEmpty())
+        return;
+
+    // A slow decode doesn't hold the slideshow back, the next tick moves past it
+    const int from = d->requestedIndex >= 0 ? d->requestedIndex : d->currentIndex;
+    showIndex((from + 1) % d->sources.size());
+}
+
+void SlideshowSourceItem::handleImageDecoded(const QString &path, const QSize &size)
+{
+    Q_D(SlideshowSourceItem);
+
+    if (d->requestedIndex < 0 || size != d->targetSize || path != sourcePath(d->requestedIndex))
+        return;
+
+    if (DecodedImageCache::instance()->image(path, size).isNull()) {
+        // Failed to decode, the image is skipped by the next tick
+        return;
+    }
+    showIndex(d->requestedIndex);
+}
+
+void SlideshowSourceItem::prefetchAhead()
+{
+    Q_D(SlideshowSourceItem);
+
+    if (d->sources.isEmpty() || d->targetSize.isEmpty() || d->currentIndex < 0)
+        return;
+
+    const int count = qMin(d->prefetchCount, d->sources.size() - 1);
+    for (int i = 1; i <= count; ++i) {
+        DecodedImageCache::instance()->prefetch(sourcePath((d->currentIndex + i) % d->sources.size()), d->targetSize);
+    }
+}
+
+/*!
+ * Decodes for the item's pixel size, images are only scaled again on the GPU
+ * while the item is resized.
+ */
+void SlideshowSourceItem::updateTargetSize()
+{
+    Q_D(SlideshowSourceItem);
+
+    if (!window())
+        return;
+
+    const QSize size = (QSizeF(width(), height()) * window()->effectiveDevicePixelRatio()).toSize();
+    if (size == d->targetSize)
+        return;
+
+    d->targetSize = size;
+    if (!isComponentComplete() || d->sources.isEmpty())
+        return;
+
+    // The current image keeps showing until it is decoded at the new size
+    showIndex(d->requestedIndex >= 0 ? d->requestedIndex : d->currentIndex);
+}
+
+void SlideshowSourceItem::itemChange(ItemChange change, const ItemChangeData &data)
+{
+    QQuickItem::itemChange(change, data);
+
+    switch (change) {
+    case ItemSceneChange:
+    case ItemDevicePixelRatioHasChanged:
+        updateTargetSize();
+        break;
+    default:
+        break;
+    }
+}
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+void SlideshowSourceItem::geometryChanged(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+    QQuickItem::geometryChanged(newGeometry, oldGeometry);
+    if (newGeometry.size() != oldGeometry.size()) {
+        updateTargetSize();
+        update();
+    }
+}
+#else
+void SlideshowSourceItem::geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+    QQuickItem::geometryChange(newGeometry, oldGeometry);
+    if (newGeometry.size() != oldGeometry.size()) {
+        updateTargetSize();
+        update();
+    }
+}
+#endif
+
+QSGNode *SlideshowSourceItem::updatePaintNode(QSGNode *node, UpdatePaintNodeData *data)
+{
+    Q_UNUSED(data)
+    Q_D(SlideshowSourceItem);
+
+    auto slideshowNode = static_cast<SlideshowNode *>(node);
+    if (!slideshowNode) {
+        slideshowNode = new SlideshowNode;
+        // The scene graph was recreated, the shown image has to be uploaded again
+        if (d->pendingImage.isNull())
+            d->pendingImage = d->shownImage;
+        d->transition = SlideshowSourceItemPrivate::Transition::None;
+    }
+
+    if (!d->pendingImage.isNull()) {
+        QSGTexture *texture = window()->createTextureFromImage(d->pendingImage, QQuickWindow::TextureIsOpaque);
+        d->pendingImage = QImage();
+        if (!slideshowNode->hasFront()) {
+            slideshowNode->setFront(window(), texture);
+        } else {
+            // A transition still running is cut short, the new one starts from its image
+            if (d->transition != SlideshowSourceItemPrivate::Transition::None)
+                slideshowNode->promoteBack(window());
+            slideshowNode->setBack(window(), texture);
+            d->transition = SlideshowSourceItemPrivate::Transition::Prepared;
+            QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+        }
+    } else if (d->transition == SlideshowSourceItemPrivate::Transition::Prepared) {
+        // The back image was drawn once and is uploaded by now
+        d->transition = SlideshowSourceItemPrivate::Transition::Fading;
+        d->fade.start();
+    }
+
+    if (d->transition == SlideshowSourceItemPrivate::Transition::Fading) {
+        const qreal opacity = d->transitionDuration > 0 ? 1 - qreal(d->fade.elapsed()) / d->transitionDuration : 0;
+        if (opacity <= 0) {
+            slideshowNode->promoteBack(window());
+            d->transition = SlideshowSourceItemPrivate::Transition::None;
+        } else {
+            slideshowNode->setFrontOpacity(opacity);
+            QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+        }
+    }
+
+    slideshowNode->layout(boundingRect());
+    return slideshowNode;
+}
@@ -0,0 +1,86 @@
+#ifndef SLIDESHOWSOURCEITEM_H
+#define SLIDESHOWSOURCEITEM_H
+
+#include "wallpaperglobal.h"
+
+#include <QQuickItem>
+#include <QStringList>
+
+class SlideshowSourceItemPrivate;
+
+/*!
+ * \brief Shows a list of images in turn, crossfading between them.
+ *
+ * The next images are decoded ahead of time at the item's pixel size through the
+ * shared DecodedImageCache, so that changing the image neither decodes nor scales
+ * on the GUI thread. The next image is uploaded a frame before its transition
+ * starts, and the crossfade is an opacity node blended on the GPU.
+ */
+class WSM_WALLPAPER_EXPORT SlideshowSourceItem : public QQuickItem
+{
+    Q_OBJECT
+    Q_PROPERTY(QStringList sources READ sources WRITE setSources NOTIFY sourcesChanged)
+    Q_PROPERTY(int currentIndex READ currentIndex WRITE setCurrentIndex NOTIFY currentIndexChanged)
+    Q_PROPERTY(int interval READ interval WRITE setInterval NOTIFY intervalChanged)
+    Q_PROPERTY(int transitionDuration READ transitionDuration WRITE setTransitionDuration NOTIFY transitionDurationChanged)
+    Q_PROPERTY(int prefetchCount READ prefetchCount WRITE setPrefetchCount NOTIFY prefetchCountChanged)
+    Q_PROPERTY(bool running READ running WRITE setRunning NOTIFY runningChanged)
+    QML_ELEMENT
+public:
+    SlideshowSourceItem(QQuickItem *parent = nullptr);
+
+    void setSources(const QStringList &sources);
+    QStringList sources() const;
+
+    void setCurrentIndex(int index);
+    int currentIndex() const;
+
+    void setInterval(int msecs);
+    int interval() const;
+
+    void setTransitionDuration(int msecs);
+    int transitionDuration() const;
+
+    void setPrefetchCount(int count);
+    int prefetchCount() const;
+
+    void setRunning(bool running);
+    bool running() const;
+
+    void componentComplete() override;
+
+Q_SIGNALS:
+    void sourcesChanged(const QStringList &sources);
+    void currentIndexChanged(int index);
+    void intervalChanged(int msecs);
+    void transitionDurationChanged(int msecs);
+    void prefetchCountChanged(int count);
+    void runningChanged(bool running);
+
+protected:
+    SlideshowSourceItem(SlideshowSourceItemPrivate &dd, QQuickItem *parent);
+    QSGNode *updatePaintNode(QSGNode *node, UpdatePaintNodeData *data) override;
+    void itemChange(ItemChange change, const ItemChangeData &data) override;
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    void geometryChanged(const QRectF &newGeometry, const QRectF &oldGeometry) override;
+#else
+    void geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry) override;
+#endif
+
+private:
+    void showIndex(int index);
+    void prefetchAhead();
+    void updateTargetSize();
+    void restartTimer();
+    QString sourcePath(int index) const;
+
+private Q_SLOTS:
+    void advance();
+    void handleImageDecoded(const QString &path, const QSize &size);
+
+private:
+    Q_DECLARE_PRIVATE(SlideshowSourceItem)
+    Q_DISABLE_COPY(SlideshowSourceItem)
+};
+
+#endif // SLIDESHOWSOURCEITEM_H
@@ -17,18 +17,52 @@ DESTDIR = $$replace(uri, \., /)
 include(private/private.pri)
 
 HEADERS += \
+    decodedimagecache.h \
     eglhelpers.h \
+    framescheduler.h \
+    framesnapshot.h \
+    frametrace.h \
+    frameslot.h \
+    gltexturebackend.h \
+    imagescaler.h \
+    memfdbufferpool.h \
+    memorypressuremonitor.h \
+    pbotextureuploader.h \
     pipewirecore.h \
+    pipewireframesink.h \
     pipewiresourceitem.h \
     pipewiresourcestream.h \
+    previewscheduler.h \
+    slideshowsourceitem.h \
+    textureatlas.h \
+    texturebackend.h \
+    tiledtexturenode.h \
+    vulkantexturebackend.h \
     wallpaperglobal.h \
     wallpaper_plugin.h \
 
 SOURCES += \
+    decodedimagecache.cpp \
     eglhelpers.cpp \
+    framescheduler.cpp \
+    framesnapshot.cpp \
+    frametrace.cpp \
+    frameslot.cpp \
+    gltexturebackend.cpp \
+    imagescaler.cpp \
+    memfdbufferpool.cpp \
+    memorypressuremonitor.cpp \
+    pbotextureuploader.cpp \
     pipewirecore.cpp \
+    pipewireframesink.cpp \
     pipewiresourceitem.cpp \
     pipewiresourcestream.cpp \
+    previewscheduler.cpp \
+    slideshowsourceitem.cpp \
+    textureatlas.cpp \
+    texturebackend.cpp \
+    tiledtexturenode.cpp \
+    vulkantexturebackend.cpp \
     wallpaper_plugin.cpp \
 
 DISTFILES += \
@@ -0,0 +1,465 @@
+#include "textureatlas.h"
+
+#include <algorithm>
+
+#include <QDebug>
+#include <QHash>
+#include <QMutex>
+#include <QPointer>
+#include <QQuickItem>
+#include <QQuickWindow>
+#include <QSGRendererInterface>
+#include <QSGTexture>
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 6, 0)
+#include <rhi/qrhi.h>
+#elif QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+#include <QtGui/private/qrhi_p.h>
+#else
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#endif
+
+// Tiles are meant for thumbnails and small previews, larger frames get their own texture
+static const int atlasExtent = 2048;
+static const int maxTileExtent = 512;
+// A repack only helps while the tiles would still fit once compacted
+static const qreal maxFill = 0.85;
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0) && !defined(GL_BGRA)
+#define GL_BGRA 0x80E1
+#endif
+
+/*!
+ * Returns the format standing for the byte order of \a format, frames of one byte
+ * order share an atlas. Returns QImage::Format_Invalid for formats no atlas takes.
+ */
+static QImage::Format atlasLayout(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return QImage::Format_RGBX8888;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        return QImage::Format_RGB32;
+    default:
+        return QImage::Format_Invalid;
+    }
+}
+
+/*!
+ * Copies \a image into \a padded with a one pixel border repeating its edges. The
+ * pixels keep their format, \a padded is only allocated again when that or the size changes.
+ */
+static void padImage(const QImage &image, QImage &padded)
+{
+    const int width = image.width();
+    const QSize size(width + 2, image.height() + 2);
+    if (padded.size() != size || padded.format() != image.format())
+        padded = QImage(size, image.format());
+
+    for (int y = 0; y < padded.height(); ++y) {
+        const quint32 *src = reinterpret_cast<const quint32 *>(image.constScanLine(qBound(0, y - 1, image.height() - 1)));
+        quint32 *dst = reinterpret_cast<quint32 *>(padded.scanLine(y));
+        dst[0] = src[0];
+        memcpy(dst + 1, src, width * sizeof(quint32));
+        dst[width + 1] = src[width - 1];
+    }
+}
+
+/*!
+ * \brief A part of a TextureAtlas, owned by the item showing it.
+ */
+class TextureAtlasTile : public QSGTexture
+{
+public:
+    TextureAtlasTile(TextureAtlas *atlas, QQuickItem *owner)
+        : m_atlas(atlas)
+        , m_owner(owner)
+    {
+    }
+
+    ~TextureAtlasTile() override
+    {
+        if (m_atlas)
+            m_atlas->removeTile(this);
+        delete m_standalone;
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    qint64 comparisonKey() const override
+    {
+        // Equal for all tiles of an atlas, which is what lets the renderer batch them
+        return m_atlas ? qint64(qintptr(m_atlas->m_texture)) : qint64(qintptr(this));
+    }
+
+    QRhiTexture *rhiTexture() const override
+    {
+        return m_atlas ? m_atlas->m_texture : nullptr;
+    }
+
+    void commitTextureOperations(QRhi *rhi, QRhiResourceUpdateBatch *resourceUpdates) override
+    {
+        Q_UNUSED(rhi)
+        if (m_atlas)
+            m_atlas->commit(resourceUpdates);
+    }
+
+    QSGTexture *removedFromAtlas(QRhiResourceUpdateBatch *resourceUpdates) const override
+    {
+        Q_UNUSED(resourceUpdates)
+        return standalone();
+    }
+#else
+    int textureId() const override
+    {
+        return m_atlas ? int(m_atlas->m_texture) : 0;
+    }
+
+    void bind() override
+    {
+        if (!m_atlas)
+            return;
+        m_atlas->bind();
+        updateBindOptions(true);
+    }
+
+    QSGTexture *removedFromAtlas() const override
+    {
+        return standalone();
+    }
+#endif
+
+    QSize textureSize() const override
+    {
+        return m_image.isNull() ? QSize() : m_image.size() - QSize(2, 2);
+    }
+
+    bool hasAlphaChannel() const override
+    {
+        return false;
+    }
+
+    bool hasMipmaps() const override
+    {
+        return false;
+    }
+
+    bool isAtlasTexture() const override
+    {
+        return true;
+    }
+
+    QRectF normalizedTextureSubRect() const override
+    {
+        if (!m_atlas || m_rect.isNull())
+            return QRectF(0, 0, 1, 1);
+
+        const QSizeF size = m_atlas->size();
+        return QRectF((m_rect.x() + 1) / size.width(), (m_rect.y() + 1) / size.height(),
+                      (m_rect.width() - 2) / size.width(), (m_rect.height() - 2) / size.height());
+    }
+
+    QPointer<TextureAtlas> m_atlas;
+    QPointer<QQuickItem> m_owner;
+    // The padded frame, kept to upload it again when the atlas is repacked
+    QImage m_image;
+    // Where the padded frame is placed, null while the tile waits for a repack
+    QRect m_rect;
+    bool m_dirty = false;
+
+private:
+    // Effects wrapping the texture need one of their own, it shows the frame it was taken from
+    QSGTexture *standalone() const
+    {
+        if (!m_standalone && m_atlas && !m_image.isNull())
+            m_standalone = m_atlas->m_window->createTextureFromImage(m_image.copy(1, 1, m_image.width() - 2, m_image.height() - 2),
+                                                                     QQuickWindow::TextureIsOpaque);
+        return m_standalone;
+    }
+
+    mutable QSGTexture *m_standalone = nullptr;
+};
+
+static QMutex atlasMutex;
+static QHash<QPair<QQuickWindow *, int>, TextureAtlas *> atlases;
+
+TextureAtlas::TextureAtlas(QQuickWindow *window, QImage::Format layout, const QSize &size)
+    : m_window(window)
+    , m_layout(layout)
+    , m_size(size)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    auto rhi = static_cast<QRhi *>(window->rendererInterface()->getResource(window, QSGRendererInterface::RhiResource));
+    m_texture = rhi->newTexture(layout == QImage::Format_RGB32 ? QRhiTexture::BGRA8 : QRhiTexture::RGBA8, size);
+    if (!m_texture->create())
+        qWarning() << "failed to create texture atlas of" << size;
+#else
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    GLenum internalFormat = GL_RGBA;
+    m_uploadFormat = GL_RGBA;
+    if (layout == QImage::Format_RGB32) {
+        m_uploadFormat = GL_BGRA;
+        // GLES takes BGRA pixels only into textures of that format
+        if (context->isOpenGLES())
+            internalFormat = GL_BGRA;
+    }
+
+    QOpenGLFunctions *gl = context->functions();
+    gl->glGenTextures(1, &m_texture);
+    gl->glBindTexture(GL_TEXTURE_2D, m_texture);
+    gl->glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size.width(), size.height(), 0, m_uploadFormat, GL_UNSIGNED_BYTE, nullptr);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl->glBindTexture(GL_TEXTURE_2D, 0);
+#endif
+
+    // Both run on the render thread, the atlas goes away with the scene graph
+    connect(window, &QQuickWindow::sceneGraphInvalidated, this, [this] {
+        delete this;
+    }, Qt::DirectConnection);
+    // Repacking before any item synchronizes lets every moved tile update its node
+    connect(window, &QQuickWindow::beforeSynchronizing, this, [this] {
+        if (m_needsRepack)
+            repack();
+    }, Qt::DirectConnection);
+}
+
+TextureAtlas::~TextureAtlas()
+{
+    {
+        QMutexLocker locker(&atlasMutex);
+        atlases.remove(qMakePair(m_window, int(m_layout)));
+    }
+
+    // Tiles outliving the atlas are left empty
+    for (TextureAtlasTile *tile : qAsConst(m_tiles)) {
+        tile->m_atlas = nullptr;
+        tile->m_rect = QRect();
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    if (m_texture)
+        m_texture->deleteLater();
+#else
+    if (QOpenGLContext *context = QOpenGLContext::currentContext())
+        context->functions()->glDeleteTextures(1, &m_texture);
+#endif
+}
+
+/*!
+ * Returns the atlas of \a window for frames of \a format, created on first use.
+ * Frames with the same byte order share an atlas, so they are copied into it
+ * without a conversion. Must be called on the window's render thread. Returns
+ * nullptr when the graphics API has no atlas or can't take the format.
+ */
+TextureAtlas *TextureAtlas::forWindow(QQuickWindow *window, QImage::Format format)
+{
+    const QImage::Format layout = atlasLayout(format);
+    if (!window || layout == QImage::Format_Invalid)
+        return nullptr;
+
+    QMutexLocker locker(&atlasMutex);
+    const QPair<QQuickWindow *, int> key(window, int(layout));
+    if (TextureAtlas *atlas = atlases.value(key))
+        return atlas;
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    auto rhi = static_cast<QRhi *>(window->rendererInterface()->getResource(window, QSGRendererInterface::RhiResource));
+    if (!rhi || (layout == QImage::Format_RGB32 && !rhi->isTextureFormatSupported(QRhiTexture::BGRA8)))
+        return nullptr;
+    const int maxTextureSize = rhi->resourceLimit(QRhi::TextureSizeMax);
+#else
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    if (window->rendererInterface()->graphicsApi() != QSGRendererInterface::OpenGL || !context)
+        return nullptr;
+    if (layout == QImage::Format_RGB32 && context->isOpenGLES()
+            && !context->hasExtension(QByteArrayLiteral("GL_EXT_texture_format_BGRA8888")))
+        return nullptr;
+    GLint maxTextureSize = 0;
+    context->functions()->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+#endif
+    const int extent = qMin<int>(atlasExtent, maxTextureSize);
+    if (extent < maxTileExtent)
+        return nullptr;
+
+    auto atlas = new TextureAtlas(window, layout, QSize(extent, extent));
+    atlases.insert(key, atlas);
+    return atlas;
+}
+
+/*!
+ * Returns whether a frame of \a size is small enough for an atlas.
+ */
+bool TextureAtlas::fits(const QSize &size)
+{
+    return !size.isEmpty() && size.width() + 2 <= maxTileExtent && size.height() + 2 <= maxTileExtent;
+}
+
+/*!
+ * Returns a new, empty tile. It is owned by the caller and has to be deleted on
+ * the render thread; \a owner is updated when the tile moves.
+ */
+QSGTexture *TextureAtlas::createTile(QQuickItem *owner)
+{
+    auto tile = new TextureAtlasTile(this, owner);
+    m_tiles.append(tile);
+    return tile;
+}
+
+/*!
+ * Returns whether \a tile was created by this atlas.
+ */
+bool TextureAtlas::hasTile(QSGTexture *tile) const
+{
+    return m_tiles.contains(static_cast<TextureAtlasTile *>(tile));
+}
+
+/*!
+ * Stores \a image as the content of \a tile, it is uploaded when the atlas is
+ * bound next. Returns false when the tile has no place at the image's size yet,
+ * the caller then has to show the image some other way for this frame.
+ */
+bool TextureAtlas::upload(QSGTexture *texture, const QImage &image)
+{
+    auto tile = static_cast<TextureAtlasTile *>(texture);
+    Q_ASSERT(m_tiles.contains(tile));
+    Q_ASSERT(atlasLayout(image.format()) == m_layout);
+
+    padImage(image, tile->m_image);
+    tile->m_dirty = true;
+    if (tile->m_rect.size() == tile->m_image.size())
+        return true;
+
+    // The old place is evicted, the tile is placed again at its new size
+    release(tile);
+    if (allocate(tile))
+        return true;
+
+    qint64 area = 0;
+    for (TextureAtlasTile *other : qAsConst(m_tiles))
+        area += qint64(other->m_image.width()) * other->m_image.height();
+    if (!m_needsRepack && area <= qint64(m_size.width()) * m_size.height() * maxFill) {
+        m_needsRepack = true;
+        for (TextureAtlasTile *other : qAsConst(m_tiles)) {
+            if (other->m_owner)
+                QMetaObject::invokeMethod(other->m_owner, "update", Qt::QueuedConnection);
+        }
+    }
+    return false;
+}
+
+/*!
+ * Places \a tile on the first shelf with a gap for it, or on a new shelf.
+ */
+bool TextureAtlas::allocate(TextureAtlasTile *tile)
+{
+    const QSize size = tile->m_image.size();
+    for (Shelf &shelf : m_shelves) {
+        if (shelf.height < size.height())
+            continue;
+
+        int x = 0;
+        for (int i = 0; i <= shelf.used.size(); ++i) {
+            const int end = i < shelf.used.size() ? shelf.used[i].first : m_size.width();
+            if (end - x >= size.width()) {
+                shelf.used.insert(i, {x, size.width()});
+                tile->m_rect = QRect(QPoint(x, shelf.y), size);
+                return true;
+            }
+            if (i < shelf.used.size())
+                x = shelf.used[i].first + shelf.used[i].second;
+        }
+    }
+
+    const int y = m_shelves.isEmpty() ? 0 : m_shelves.last().y + m_shelves.last().height;
+    if (y + size.height() > m_size.height() || size.width() > m_size.width())
+        return false;
+
+    m_shelves.append({y, size.height(), {{0, size.width()}}});
+    tile->m_rect = QRect(QPoint(0, y), size);
+    return true;
+}
+
+void TextureAtlas::release(TextureAtlasTile *tile)
+{
+    if (tile->m_rect.isNull())
+        return;
+
+    for (Shelf &shelf : m_shelves) {
+        if (shelf.y != tile->m_rect.y())
+            continue;
+        for (int i = 0; i < shelf.used.size(); ++i) {
+            if (shelf.used[i].first == tile->m_rect.x()) {
+                shelf.used.remove(i);
+                break;
+            }
+        }
+        break;
+    }
+    tile->m_rect = QRect();
+
+    // Empty shelves at the bottom give their height back
+    while (!m_shelves.isEmpty() && m_shelves.last().used.isEmpty())
+        m_shelves.removeLast();
+}
+
+/*!
+ * Places all tiles again, highest first, and uploads them to their new places.
+ */
+void TextureAtlas::repack()
+{
+    m_needsRepack = false;
+    m_shelves.clear();
+
+    QVector<TextureAtlasTile *> tiles = m_tiles;
+    std::stable_sort(tiles.begin(), tiles.end(), [](TextureAtlasTile *a, TextureAtlasTile *b) {
+        return a->m_image.height() > b->m_image.height();
+    });
+    for (TextureAtlasTile *tile : qAsConst(tiles)) {
+        tile->m_rect = QRect();
+        if (!tile->m_image.isNull() && allocate(tile))
+            tile->m_dirty = true;
+        if (tile->m_owner)
+            QMetaObject::invokeMethod(tile->m_owner, "update", Qt::QueuedConnection);
+    }
+}
+
+void TextureAtlas::removeTile(TextureAtlasTile *tile)
+{
+    release(tile);
+    m_tiles.removeOne(tile);
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+void TextureAtlas::commit(QRhiResourceUpdateBatch *resourceUpdates)
+{
+    for (TextureAtlasTile *tile : qAsConst(m_tiles)) {
+        if (!tile->m_dirty || tile->m_rect.isNull())
+            continue;
+
+        QRhiTextureSubresourceUploadDescription description(tile->m_image);
+        description.setDestinationTopLeft(tile->m_rect.topLeft());
+        resourceUpdates->uploadTexture(m_texture, QRhiTextureUploadDescription(QRhiTextureUploadEntry(0, 0, description)));
+        tile->m_dirty = false;
+    }
+}
+#else
+void TextureAtlas::bind()
+{
+    QOpenGLFunctions *gl = QOpenGLContext::currentContext()->functions();
+    gl->glBindTexture(GL_TEXTURE_2D, m_texture);
+    gl->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for (TextureAtlasTile *tile : qAsConst(m_tiles)) {
+        if (!tile->m_dirty || tile->m_rect.isNull())
+            continue;
+
+        const QRect &rect = tile->m_rect;
+        gl->glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(), rect.width(), rect.height(), m_uploadFormat, GL_UNSIGNED_BYTE, tile->m_image.constBits());
+        tile->m_dirty = false;
+    }
+}
+#endif
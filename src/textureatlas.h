@@ -0,0 +1,90 @@
+#ifndef TEXTUREATLAS_H
+#define TEXTUREATLAS_H
+
+#include "wallpaperglobal.h"
+
+#include <QImage>
+#include <QObject>
+#include <QRect>
+#include <QVector>
+
+class QQuickItem;
+class QQuickWindow;
+class QSGTexture;
+class TextureAtlasTile;
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+class QRhiResourceUpdateBatch;
+class QRhiTexture;
+#endif
+
+/*!
+ * \brief Packs the frames of small streams into one texture per window and byte order.
+ *
+ * Every tile is a QSGTexture referring to a part of the shared texture, so the
+ * scene graph renderer sees the same material for all of them and batches their
+ * image nodes into a few draw calls. Tiles are placed on shelves, a tile whose
+ * size changes is evicted and placed again, and when a tile finds no space all
+ * tiles are repacked before the window synchronizes next. Tiles are padded by a
+ * pixel repeating their edges so that linear filtering doesn't bleed. RGBA and
+ * BGRA frames go into atlases of their own, none of them is converted on the CPU.
+ *
+ * Lives on the render thread, it is only available with OpenGL on Qt 5 and with
+ * the QRhi backends on Qt 6.
+ */
+class WSM_WALLPAPER_EXPORT TextureAtlas : public QObject
+{
+    Q_OBJECT
+public:
+    ~TextureAtlas() override;
+
+    static TextureAtlas *forWindow(QQuickWindow *window, QImage::Format format);
+    static bool fits(const QSize &size);
+
+    QSGTexture *createTile(QQuickItem *owner);
+    bool upload(QSGTexture *tile, const QImage &image);
+    bool hasTile(QSGTexture *tile) const;
+
+    QSize size() const { return m_size; }
+    int tileCount() const { return m_tiles.size(); }
+
+private:
+    struct Shelf {
+        int y;
+        int height;
+        // Used spans as x and width, sorted by x
+        QVector<QPair<int, int>> used;
+    };
+
+    TextureAtlas(QQuickWindow *window, QImage::Format layout, const QSize &size);
+
+    bool allocate(TextureAtlasTile *tile);
+    void release(TextureAtlasTile *tile);
+    void repack();
+    void removeTile(TextureAtlasTile *tile);
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    void commit(QRhiResourceUpdateBatch *resourceUpdates);
+#else
+    void bind();
+#endif
+
+    QQuickWindow *const m_window;
+    // QImage::Format_RGBX8888 or QImage::Format_RGB32, the byte order of the tiles
+    const QImage::Format m_layout;
+    const QSize m_size;
+    QVector<Shelf> m_shelves;
+    QVector<TextureAtlasTile *> m_tiles;
+    bool m_needsRepack = false;
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    QRhiTexture *m_texture = nullptr;
+#else
+    uint m_texture = 0;
+    uint m_uploadFormat = 0;
+#endif
+
+    friend class TextureAtlasTile;
+};
+
+#endif // TEXTUREATLAS_H
@@ -0,0 +1,258 @@
+#include "texturebackend.h"
+#include "gltexturebackend.h"
+#include "vulkantexturebackend.h"
+
+#include <limits>
+
+#include <sys/stat.h>
+
+#include <QDebug>
+#include <QSGTexture>
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 6, 0)
+#include <rhi/qrhi.h>
+#elif QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+#include <QtGui/private/qrhi_p.h>
+#endif
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+/*!
+ * \brief A frame uploaded by the scene graph's own resource update batch, straight
+ * from the image's rows, whatever their stride.
+ */
+class RhiFrameTexture : public QSGTexture
+{
+public:
+    RhiFrameTexture(QRhiTexture *texture, const QImage &image)
+        : m_texture(texture)
+        , m_image(image)
+    {
+    }
+
+    ~RhiFrameTexture() override
+    {
+        m_texture->deleteLater();
+    }
+
+    qint64 comparisonKey() const override
+    {
+        return qint64(qintptr(m_texture));
+    }
+
+    QRhiTexture *rhiTexture() const override
+    {
+        return m_texture;
+    }
+
+    void commitTextureOperations(QRhi *rhi, QRhiResourceUpdateBatch *resourceUpdates) override
+    {
+        Q_UNUSED(rhi)
+        if (m_uploaded)
+            return;
+
+        // The image outlives the batch, the rows are not copied before the upload
+        QRhiTextureSubresourceUploadDescription description(QByteArray::fromRawData(reinterpret_cast<const char *>(m_image.constBits()), m_image.sizeInBytes()));
+        description.setDataStride(m_image.bytesPerLine());
+        resourceUpdates->uploadTexture(m_texture, QRhiTextureUploadEntry(0, 0, description));
+        m_uploaded = true;
+    }
+
+    QSize textureSize() const override
+    {
+        return m_image.size();
+    }
+
+    bool hasAlphaChannel() const override
+    {
+        return false;
+    }
+
+    bool hasMipmaps() const override
+    {
+        return false;
+    }
+
+private:
+    QRhiTexture *const m_texture;
+    const QImage m_image;
+    bool m_uploaded = false;
+};
+
+/*!
+ * Returns the texture format with the byte layout of \a format, or
+ * QRhiTexture::UnknownFormat when frames of it have to be converted.
+ */
+static QRhiTexture::Format rhiTextureFormat(QRhi *rhi, QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return QRhiTexture::RGBA8;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        return rhi->isTextureFormatSupported(QRhiTexture::BGRA8) ? QRhiTexture::BGRA8 : QRhiTexture::UnknownFormat;
+    default:
+        return QRhiTexture::UnknownFormat;
+    }
+}
+#endif
+
+TextureBackend::TextureBackend(QSGRendererInterface::GraphicsApi api)
+    : m_api(api)
+{
+}
+
+TextureBackend::~TextureBackend()
+{
+}
+
+TextureBackend *TextureBackend::create(QQuickWindow *window)
+{
+    const QSGRendererInterface::GraphicsApi api = window->rendererInterface()->graphicsApi();
+    switch (api) {
+    case QSGRendererInterface::OpenGL:
+        return new GLTextureBackend;
+#if WSM_WALLPAPER_HAS_VULKAN
+    case QSGRendererInterface::Vulkan:
+        return new VulkanTextureBackend(window);
+#endif
+    default: {
+        qDebug() << "no native frame import for graphics api" << api << ", uploading through the scene graph";
+        TextureBackend *backend = new TextureBackend(api);
+        if (api == QSGRendererInterface::Software) {
+            backend->setMaxTextureSize(std::numeric_limits<int>::max());
+        }
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        else if (auto rhi = static_cast<QRhi *>(window->rendererInterface()->getResource(window, QSGRendererInterface::RhiResource))) {
+            backend->setMaxTextureSize(rhi->resourceLimit(QRhi::TextureSizeMax));
+        }
+#endif
+        return backend;
+    }
+    }
+}
+
+/*!
+ * Requests what the native import paths need from the graphics device. This only
+ * has an effect before the window's scene graph is initialized.
+ */
+void TextureBackend::configureWindow(QQuickWindow *window)
+{
+#if WSM_WALLPAPER_HAS_VULKAN
+    VulkanTextureBackend::configureWindow(window);
+#else
+    Q_UNUSED(window)
+#endif
+}
+
+/*!
+ * Returns what identifies the DMA-BUF behind \a fd, whichever process or file
+ * descriptor it is seen through, or 0 when \a fd is not valid.
+ */
+quint64 TextureBackend::dmaBufId(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return 0;
+    return st.st_ino;
+}
+
+bool TextureBackend::supportsDmaBuf() const
+{
+    return false;
+}
+
+/*!
+ * Returns the formats the stream may negotiate, which are the ones CPU frames are
+ * uploaded in without a conversion. QRhi has no texture format with three bytes
+ * per pixel, so its backends leave the 24 bit formats out.
+ */
+QVector<spa_video_format> TextureBackend::videoFormats() const
+{
+    QVector<spa_video_format> formats = PipewireSourceStream::supportedVideoFormats();
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    if (m_api != QSGRendererInterface::Software && m_api != QSGRendererInterface::OpenGL) {
+        formats.removeAll(SPA_VIDEO_FORMAT_RGB);
+        formats.removeAll(SPA_VIDEO_FORMAT_BGR);
+    }
+#endif
+    return formats;
+}
+
+/*!
+ * Returns the modifiers that can be imported per format, an empty list for a
+ * format means it can only be received through shared memory. Without a native
+ * import, linear buffers are still taken and mapped by the stream.
+ */
+QHash<spa_video_format, QVector<uint64_t>> TextureBackend::dmaBufModifiers(const QVector<spa_video_format> &formats) const
+{
+    return PipewireSourceStream::mappableDmaBufModifiers(formats);
+}
+
+QSGTexture *TextureBackend::importDmaBuf(QQuickWindow *window, const DmaBufAttributes &attribs, spa_video_format format, const QSize &size)
+{
+    Q_UNUSED(window)
+    Q_UNUSED(attribs)
+    Q_UNUSED(format)
+    Q_UNUSED(size)
+    return nullptr;
+}
+
+/*!
+ * Called when the stream removed the buffer of the DMA-BUF \a id, backends that
+ * keep imports around free what they made of it.
+ */
+void TextureBackend::removeDmaBuf(quint64 id)
+{
+    Q_UNUSED(id)
+}
+
+/*!
+ * Called when the stream renegotiated, none of the imported DMA-BUFs comes again.
+ */
+void TextureBackend::clearDmaBufs()
+{
+}
+
+/*!
+ * Sets how many buffers the stream uses at most, backends never keep imports of
+ * more DMA-BUFs than that.
+ */
+void TextureBackend::setMaxDmaBufs(int count)
+{
+    Q_UNUSED(count)
+}
+
+/*!
+ * Uploads \a image into a new texture. With QRhi, 32 bit frames go up in their
+ * own layout and row stride. 24 bit ones, which videoFormats() only offers to GL
+ * and which no texture format matches, and the software backend go through
+ * createTextureFromImage.
+ */
+QSGTexture *TextureBackend::uploadImage(QQuickWindow *window, const QImage &image)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    if (m_api != QSGRendererInterface::Software) {
+        auto rhi = static_cast<QRhi *>(window->rendererInterface()->getResource(window, QSGRendererInterface::RhiResource));
+        const QRhiTexture::Format format = rhi ? rhiTextureFormat(rhi, image.format()) : QRhiTexture::UnknownFormat;
+        if (format != QRhiTexture::UnknownFormat) {
+            QRhiTexture *texture = rhi->newTexture(format, image.size());
+            if (texture->create())
+                return new RhiFrameTexture(texture, image);
+            delete texture;
+        }
+    }
+#endif
+    return window->createTextureFromImage(image, QQuickWindow::TextureIsOpaque);
+}
+
+/*!
+ * Returns the writer CPU frames can be copied into as they arrive, so that
+ * uploading them needs no further copy, or null when the backend has none.
+ */
+QExplicitlySharedDataPointer<PboFrameWriter> TextureBackend::frameWriter() const
+{
+    return QExplicitlySharedDataPointer<PboFrameWriter>();
+}
@@ -0,0 +1,59 @@
+#ifndef TEXTUREBACKEND_H
+#define TEXTUREBACKEND_H
+
+#include "wallpaperglobal.h"
+#include "pipewiresourcestream.h"
+
+#include <QHash>
+#include <QImage>
+#include <QQuickWindow>
+#include <QSGRendererInterface>
+#include <QVector>
+
+class PboFrameWriter;
+class QSGTexture;
+
+/*!
+ * \brief Turns stream frames into scene graph textures for one graphics API.
+ *
+ * The generic implementation uploads CPU frames through a QRhi staging buffer in
+ * their own layout, and through QQuickWindow::createTextureFromImage on Qt 5 and
+ * the software backend. Subclasses add zero-copy DMA-BUF import for the APIs that
+ * support it. Textures returned by importDmaBuf() and uploadImage() are owned by
+ * the caller, while the native resources behind them stay owned by the backend,
+ * which is why a backend must be deleted on the render thread.
+ */
+class WSM_WALLPAPER_EXPORT TextureBackend
+{
+public:
+    explicit TextureBackend(QSGRendererInterface::GraphicsApi api);
+    virtual ~TextureBackend();
+
+    static TextureBackend *create(QQuickWindow *window);
+    static void configureWindow(QQuickWindow *window);
+    static quint64 dmaBufId(int fd);
+
+    QSGRendererInterface::GraphicsApi graphicsApi() const { return m_api; }
+    int maxTextureSize() const { return m_maxTextureSize; }
+
+    virtual bool supportsDmaBuf() const;
+    virtual QVector<spa_video_format> videoFormats() const;
+    virtual QHash<spa_video_format, QVector<uint64_t>> dmaBufModifiers(const QVector<spa_video_format> &formats) const;
+    virtual QSGTexture *importDmaBuf(QQuickWindow *window, const DmaBufAttributes &attribs, spa_video_format format, const QSize &size);
+    virtual void removeDmaBuf(quint64 id);
+    virtual void clearDmaBufs();
+    virtual void setMaxDmaBufs(int count);
+    virtual QSGTexture *uploadImage(QQuickWindow *window, const QImage &image);
+    virtual QExplicitlySharedDataPointer<PboFrameWriter> frameWriter() const;
+
+protected:
+    void setMaxTextureSize(int size) { m_maxTextureSize = size; }
+
+private:
+    const QSGRendererInterface::GraphicsApi m_api;
+    int m_maxTextureSize = 4096;
+
+    Q_DISABLE_COPY(TextureBackend)
+};
+
+#endif // TEXTUREBACKEND_H
@@ -0,0 +1,118 @@
+#include "tiledtexturenode.h"
+
+#include <QQuickWindow>
+#include <QSGImageNode>
+
+// Frames above 8K UHD are tiled even when the GPU could hold them in one texture
+static const qint64 kMaxUntiledArea = qint64(7680) * 4320;
+
+TiledTextureNode::TiledTextureNode(int tileSize)
+    : m_tileSize(tileSize)
+{
+}
+
+TiledTextureNode::~TiledTextureNode()
+{
+    // Child nodes and their textures are deleted by QSGNode
+}
+
+bool TiledTextureNode::needsTiling(const QSize &size, int maxTextureSize)
+{
+    return size.width() > maxTextureSize || size.height() > maxTextureSize || qint64(size.width()) * size.height() > kMaxUntiledArea;
+}
+
+/*!
+ * Takes a new frame, the tiles intersecting \a damage are uploaded again the next
+ * time they are visible. An empty damage region means the whole frame changed.
+ */
+void TiledTextureNode::setFrame(const QImage &image, const QRegion &damage)
+{
+    if (image.size() != m_image.size())
+        rebuild(image.size());
+
+    // Tiles upload from views into this image, it has to live until the next frame
+    m_image = image;
+
+    for (Tile &tile : m_tiles) {
+        if (damage.isEmpty() || damage.intersects(tile.padded))
+            tile.stale = true;
+    }
+}
+
+/*!
+ * Lays the tiles out in \a targetRect, in item coordinates, and uploads the stale
+ * ones intersecting \a visibleRect, in frame coordinates.
+ */
+void TiledTextureNode::update(QQuickWindow *window, const QRectF &targetRect, const QRect &visibleRect)
+{
+    m_uploadedTiles = 0;
+    if (m_image.isNull())
+        return;
+
+    const qreal scaleX = targetRect.width() / m_image.width();
+    const qreal scaleY = targetRect.height() / m_image.height();
+    const int bytesPerPixel = m_image.depth() / 8;
+
+    for (Tile &tile : m_tiles) {
+        if (!tile.source.intersects(visibleRect)) {
+            discardTile(tile);
+            continue;
+        }
+
+        if (!tile.node) {
+            tile.node = window->createImageNode();
+            tile.node->setOwnsTexture(true);
+            tile.node->setFiltering(QSGTexture::Linear);
+            tile.stale = true;
+        }
+
+        if (tile.stale) {
+            // A view into the frame, no copy is made before the upload
+            const QImage view(m_image.constBits() + qsizetype(tile.padded.y()) * m_image.bytesPerLine() + tile.padded.x() * bytesPerPixel,
+                              tile.padded.width(),
+                              tile.padded.height(),
+                              m_image.bytesPerLine(),
+                              m_image.format());
+            tile.node->setTexture(window->createTextureFromImage(view, QQuickWindow::TextureIsOpaque));
+            tile.node->setSourceRect(QRectF(tile.source.topLeft() - tile.padded.topLeft(), tile.source.size()));
+            tile.stale = false;
+            ++m_uploadedTiles;
+            if (!tile.node->parent())
+                appendChildNode(tile.node);
+        }
+
+        tile.node->setRect(QRectF(targetRect.x() + tile.source.x() * scaleX,
+                                  targetRect.y() + tile.source.y() * scaleY,
+                                  tile.source.width() * scaleX,
+                                  tile.source.height() * scaleY));
+    }
+}
+
+void TiledTextureNode::rebuild(const QSize &size)
+{
+    for (Tile &tile : m_tiles) {
+        discardTile(tile);
+    }
+    m_tiles.clear();
+
+    for (int y = 0; y < size.height(); y += m_tileSize) {
+        for (int x = 0; x < size.width(); x += m_tileSize) {
+            Tile tile;
+            tile.source = QRect(x, y, qMin(m_tileSize, size.width() - x), qMin(m_tileSize, size.height() - y));
+            tile.padded = tile.source.adjusted(-1, -1, 1, 1) & QRect(QPoint(0, 0), size);
+            m_tiles.append(tile);
+        }
+    }
+}
+
+void TiledTextureNode::discardTile(Tile &tile)
+{
+    if (!tile.node)
+        return;
+
+    if (tile.node->parent())
+        removeChildNode(tile.node);
+    delete tile.node;
+    tile.node = nullptr;
+    tile.stale = true;
+}
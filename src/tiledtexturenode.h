@@ -0,0 +1,56 @@
+#ifndef TILEDTEXTURENODE_H
+#define TILEDTEXTURENODE_H
+
+#include "wallpaperglobal.h"
+
+#include <QImage>
+#include <QRegion>
+#include <QSGNode>
+#include <QVector>
+
+class QQuickWindow;
+class QSGImageNode;
+
+/*!
+ * \brief Shows a frame that is too large for a single texture as a grid of tiles.
+ *
+ * Only tiles intersecting the visible part of the frame own a texture, tiles
+ * scrolled out of view drop theirs, so texture memory and upload bandwidth follow
+ * the visible area instead of the frame size. A new frame only re-uploads the
+ * visible tiles it damaged. Tiles overlap by a pixel, so that a scaled frame
+ * shows no seams between them. With the software renderer, which repaints the nodes
+ * that changed, small tiles keep repaints close to the frame's damage.
+ */
+class WSM_WALLPAPER_EXPORT TiledTextureNode : public QSGNode
+{
+public:
+    explicit TiledTextureNode(int tileSize = 1024);
+    ~TiledTextureNode() override;
+
+    static bool needsTiling(const QSize &size, int maxTextureSize);
+
+    void setFrame(const QImage &image, const QRegion &damage);
+    void update(QQuickWindow *window, const QRectF &targetRect, const QRect &visibleRect);
+
+    QSize frameSize() const { return m_image.size(); }
+    int uploadedTiles() const { return m_uploadedTiles; }
+
+private:
+    struct Tile {
+        QRect source;
+        // The source with a one pixel border of its neighbours, which filtering samples at the edges
+        QRect padded;
+        QSGImageNode *node = nullptr;
+        bool stale = true;
+    };
+
+    void rebuild(const QSize &size);
+    void discardTile(Tile &tile);
+
+    const int m_tileSize;
+    QVector<Tile> m_tiles;
+    QImage m_image;
+    int m_uploadedTiles = 0;
+};
+
+#endif // TILEDTEXTURENODE_H
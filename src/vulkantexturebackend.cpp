@@ -0,0 +1,599 @@
+#include "vulkantexturebackend.h"
+#include "frametrace.h"
+
+#if WSM_WALLPAPER_HAS_VULKAN
+
+#include <fcntl.h>
+#include <libdrm/drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <limits>
+
+#include <QDebug>
+#include <QQuickGraphicsConfiguration>
+#include <QSGTexture>
+#include <QVulkanFunctions>
+
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+    __u32 flags;
+    __s32 fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#endif
+
+static const QByteArrayList kDmaBufDeviceExtensions = {
+    QByteArrayLiteral("VK_KHR_external_memory_fd"),
+    QByteArrayLiteral("VK_EXT_external_memory_dma_buf"),
+    QByteArrayLiteral("VK_EXT_image_drm_format_modifier"),
+    QByteArrayLiteral("VK_EXT_queue_family_foreign"),
+};
+// Lets the GPU wait for the producer's rendering, the CPU waits without it
+static const QByteArray kSyncFdDeviceExtension = QByteArrayLiteral("VK_KHR_external_semaphore_fd");
+
+// Upper bound for waits on the producer and on our own submissions
+static const uint64_t kWaitTimeoutNs = 100 * 1000 * 1000;
+
+static VkFormat drmFormatToVkFormat(uint32_t drmFormat)
+{
+    switch (drmFormat) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+        return VK_FORMAT_B8G8R8A8_UNORM;
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+        return VK_FORMAT_R8G8B8A8_UNORM;
+    default:
+        return VK_FORMAT_UNDEFINED;
+    }
+}
+
+VulkanTextureBackend::VulkanTextureBackend(QQuickWindow *window)
+    : TextureBackend(QSGRendererInterface::Vulkan)
+{
+    QSGRendererInterface *rif = window->rendererInterface();
+    m_instance = window->vulkanInstance();
+    auto physicalDevice = static_cast<VkPhysicalDevice *>(rif->getResource(window, QSGRendererInterface::PhysicalDeviceResource));
+    auto device = static_cast<VkDevice *>(rif->getResource(window, QSGRendererInterface::DeviceResource));
+    if (!m_instance || !physicalDevice || !device) {
+        qWarning() << "Vulkan scene graph resources are not available, DMA-BUF import disabled";
+        return;
+    }
+
+    m_physicalDevice = *physicalDevice;
+    m_device = *device;
+    m_deviceFunctions = m_instance->deviceFunctions(m_device);
+
+    VkPhysicalDeviceProperties properties;
+    m_instance->functions()->vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+    setMaxTextureSize(int(qMin<uint32_t>(properties.limits.maxImageDimension2D, std::numeric_limits<int>::max())));
+
+    // The scene graph only enables what configureWindow() asked for and the device supports
+    uint32_t count = 0;
+    QVulkanFunctions *f = m_instance->functions();
+    f->vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &count, nullptr);
+    QVector<VkExtensionProperties> extensions(count);
+    f->vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &count, extensions.data());
+    int found = 0;
+    bool hasSyncFd = false;
+    for (const VkExtensionProperties &extension : extensions) {
+        if (kDmaBufDeviceExtensions.contains(QByteArray(extension.extensionName)))
+            ++found;
+        hasSyncFd |= kSyncFdDeviceExtension == extension.extensionName;
+    }
+
+    m_getMemoryFdProperties = reinterpret_cast<PFN_vkGetMemoryFdPropertiesKHR>(m_instance->getInstanceProcAddr("vkGetMemoryFdPropertiesKHR"));
+    m_getFormatProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFormatProperties2>(m_instance->getInstanceProcAddr("vkGetPhysicalDeviceFormatProperties2"));
+    if (!m_getFormatProperties2) {
+        m_getFormatProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFormatProperties2>(m_instance->getInstanceProcAddr("vkGetPhysicalDeviceFormatProperties2KHR"));
+    }
+
+    if (hasSyncFd)
+        m_importSemaphoreFd = reinterpret_cast<PFN_vkImportSemaphoreFdKHR>(m_instance->getInstanceProcAddr("vkImportSemaphoreFdKHR"));
+
+    m_hasDmaBufImport = found == kDmaBufDeviceExtensions.size() && m_getMemoryFdProperties && m_getFormatProperties2 && createSubmissions(window);
+    if (!m_hasDmaBufImport) {
+        qDebug() << "Vulkan device can't import DMA-BUFs, frames will be uploaded from shared memory";
+    }
+}
+
+VulkanTextureBackend::~VulkanTextureBackend()
+{
+    if (!m_deviceFunctions)
+        return;
+
+    clearCache();
+    destroyRetired(true);
+    destroySubmissions();
+}
+
+/*!
+ * Creates the command buffers ownership transfers are recorded into, for the
+ * queue the scene graph renders with.
+ */
+bool VulkanTextureBackend::createSubmissions(QQuickWindow *window)
+{
+    QSGRendererInterface *rif = window->rendererInterface();
+    auto queue = static_cast<VkQueue *>(rif->getResource(window, QSGRendererInterface::CommandQueueResource));
+    if (!queue)
+        return false;
+    m_queue = *queue;
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 1, 0)
+    auto familyIndex = static_cast<uint32_t *>(rif->getResource(window, QSGRendererInterface::GraphicsQueueFamilyIndexResource));
+    if (!familyIndex)
+        return false;
+    m_queueFamilyIndex = *familyIndex;
+#else
+    // Qt picks the first family that can do graphics
+    uint32_t count = 0;
+    QVulkanFunctions *f = m_instance->functions();
+    f->vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &count, nullptr);
+    QVector<VkQueueFamilyProperties> families(count);
+    f->vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &count, families.data());
+    for (m_queueFamilyIndex = 0; m_queueFamilyIndex < count; ++m_queueFamilyIndex) {
+        if (families[m_queueFamilyIndex].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+            break;
+    }
+#endif
+
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = m_queueFamilyIndex;
+    if (m_deviceFunctions->vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_commandPool) != VK_SUCCESS)
+        return false;
+
+    for (Submission &submission : m_submissions) {
+        VkCommandBufferAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocateInfo.commandPool = m_commandPool;
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1;
+
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        if (m_deviceFunctions->vkAllocateCommandBuffers(m_device, &allocateInfo, &submission.commandBuffer) != VK_SUCCESS
+                || m_deviceFunctions->vkCreateFence(m_device, &fenceInfo, nullptr, &submission.fence) != VK_SUCCESS
+                || m_deviceFunctions->vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &submission.semaphore) != VK_SUCCESS) {
+            qWarning() << "Failed to create the Vulkan objects for DMA-BUF ownership transfers";
+            destroySubmissions();
+            return false;
+        }
+    }
+    return true;
+}
+
+void VulkanTextureBackend::destroySubmissions()
+{
+    for (Submission &submission : m_submissions) {
+        if (submission.fence != VK_NULL_HANDLE) {
+            m_deviceFunctions->vkWaitForFences(m_device, 1, &submission.fence, VK_TRUE, kWaitTimeoutNs);
+            m_deviceFunctions->vkDestroyFence(m_device, submission.fence, nullptr);
+        }
+        if (submission.semaphore != VK_NULL_HANDLE)
+            m_deviceFunctions->vkDestroySemaphore(m_device, submission.semaphore, nullptr);
+        submission = Submission();
+    }
+    if (m_commandPool != VK_NULL_HANDLE) {
+        // Frees the command buffers along with it
+        m_deviceFunctions->vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+        m_commandPool = VK_NULL_HANDLE;
+    }
+}
+
+void VulkanTextureBackend::configureWindow(QQuickWindow *window)
+{
+    if (!window)
+        return;
+
+    QQuickGraphicsConfiguration config = window->graphicsConfiguration();
+    QByteArrayList extensions = config.deviceExtensions();
+    for (const QByteArray &extension : kDmaBufDeviceExtensions) {
+        if (!extensions.contains(extension))
+            extensions.append(extension);
+    }
+    if (!extensions.contains(kSyncFdDeviceExtension))
+        extensions.append(kSyncFdDeviceExtension);
+    config.setDeviceExtensions(extensions);
+    window->setGraphicsConfiguration(config);
+}
+
+bool VulkanTextureBackend::supportsDmaBuf() const
+{
+    return m_hasDmaBufImport;
+}
+
+QHash<spa_video_format, QVector<uint64_t>> VulkanTextureBackend::dmaBufModifiers(const QVector<spa_video_format> &formats) const
+{
+    QHash<spa_video_format, QVector<uint64_t>> ret = TextureBackend::dmaBufModifiers(formats);
+    if (!m_hasDmaBufImport)
+        return ret;
+
+    for (spa_video_format format : formats) {
+        const VkFormat vkFormat = drmFormatToVkFormat(PipewireSourceStream::spaVideoFormatToDrmFormat(format));
+        if (vkFormat == VK_FORMAT_UNDEFINED)
+            continue;
+
+        VkDrmFormatModifierPropertiesListEXT modifierList = {};
+        modifierList.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+        VkFormatProperties2 properties = {};
+        properties.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        properties.pNext = &modifierList;
+        m_getFormatProperties2(m_physicalDevice, vkFormat, &properties);
+
+        QVector<VkDrmFormatModifierPropertiesEXT> modifierProperties(modifierList.drmFormatModifierCount);
+        modifierList.pDrmFormatModifierProperties = modifierProperties.data();
+        m_getFormatProperties2(m_physicalDevice, vkFormat, &properties);
+
+        // Only single plane layouts that can be sampled, there is no implicit modifier in Vulkan
+        QVector<uint64_t> modifiers;
+        for (const VkDrmFormatModifierPropertiesEXT &modifier : modifierProperties) {
+            if (modifier.drmFormatModifierPlaneCount == 1 && (modifier.drmFormatModifierTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT))
+                modifiers.append(modifier.drmFormatModifier);
+        }
+        ret.insert(format, modifiers);
+    }
+    return ret;
+}
+
+QSGTexture *VulkanTextureBackend::importDmaBuf(QQuickWindow *window, const DmaBufAttributes &attribs, spa_video_format format, const QSize &size)
+{
+    if (!m_hasDmaBufImport || attribs.planes.isEmpty() || attribs.modifier == DRM_FORMAT_MOD_INVALID)
+        return nullptr;
+
+    const VkFormat vkFormat = drmFormatToVkFormat(attribs.format);
+    if (vkFormat == VK_FORMAT_UNDEFINED)
+        return nullptr;
+
+    destroyRetired(false);
+    if (m_cachedFormat != attribs.format || m_cachedModifier != attribs.modifier || m_cachedSize != size) {
+        clearCache();
+        m_cachedFormat = attribs.format;
+        m_cachedModifier = attribs.modifier;
+        m_cachedSize = size;
+    }
+
+    const quint64 key = dmaBufId(attribs.planes.first().fd);
+    auto it = m_cache.find(key);
+    if (it == m_cache.end()) {
+        // More DMA-BUFs than the stream has buffers, the missed removals are stale
+        if (m_maxCached > 0 && m_cache.size() >= m_maxCached)
+            clearDmaBufs();
+
+        FrameTraceScope trace("vkImportImage");
+        ImportedImage imported;
+        if (!importImage(attribs, vkFormat, size, &imported))
+            return nullptr;
+        it = m_cache.insert(key, imported);
+    }
+
+    FrameTraceScope trace("vkAcquireImage");
+    if (!acquireImage(it->image, attribs.planes.first().fd))
+        return nullptr;
+
+    const QQuickWindow::CreateTextureOptions textureOption =
+            format == SPA_VIDEO_FORMAT_ARGB || format == SPA_VIDEO_FORMAT_BGRA ? QQuickWindow::TextureHasAlphaChannel : QQuickWindow::TextureIsOpaque;
+    return QNativeInterface::QSGVulkanTexture::fromNative(it->image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, window, size, textureOption);
+}
+
+void VulkanTextureBackend::removeDmaBuf(quint64 id)
+{
+    destroyRetired(false);
+    const ImportedImage imported = m_cache.take(id);
+    if (imported.image == VK_NULL_HANDLE)
+        return;
+
+    // The scene graph samples the image shown last until a new frame replaces it
+    if (imported.image == m_acquiredImage) {
+        if (m_orphaned.image != VK_NULL_HANDLE)
+            retireImages({m_orphaned});
+        m_orphaned = imported;
+        return;
+    }
+    retireImages({imported});
+}
+
+void VulkanTextureBackend::clearDmaBufs()
+{
+    destroyRetired(false);
+    QVector<ImportedImage> images;
+    for (auto it = m_cache.cbegin(); it != m_cache.cend(); ++it) {
+        if (it->image == m_acquiredImage) {
+            if (m_orphaned.image != VK_NULL_HANDLE)
+                images.append(m_orphaned);
+            m_orphaned = it.value();
+        } else {
+            images.append(it.value());
+        }
+    }
+    m_cache.clear();
+    retireImages(images);
+}
+
+void VulkanTextureBackend::setMaxDmaBufs(int count)
+{
+    m_maxCached = count;
+}
+
+/*!
+ * Takes \a image over from the producer: releases the image shown before back to
+ * the foreign queue family and moves \a image from it into a layout the scene
+ * graph samples, once the producer's rendering into \a fd finished. This is
+ * submitted ahead of the frame, queue order makes the frame wait for it.
+ */
+bool VulkanTextureBackend::acquireImage(VkImage image, int fd)
+{
+    Submission &submission = m_submissions[m_nextSubmission];
+    m_nextSubmission = (m_nextSubmission + 1) % submissionCount;
+
+    // Submitted frames ago, practically always done
+    if (m_deviceFunctions->vkWaitForFences(m_device, 1, &submission.fence, VK_TRUE, kWaitTimeoutNs) != VK_SUCCESS) {
+        qWarning() << "Timed out waiting for a DMA-BUF ownership transfer";
+        return false;
+    }
+
+    const bool gpuWait = importImplicitFence(fd, submission.semaphore);
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    m_deviceFunctions->vkResetCommandBuffer(submission.commandBuffer, 0);
+    m_deviceFunctions->vkBeginCommandBuffer(submission.commandBuffer, &beginInfo);
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+
+    if (m_acquiredImage != VK_NULL_HANDLE) {
+        barrier.image = m_acquiredImage;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcQueueFamilyIndex = m_queueFamilyIndex;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+        m_deviceFunctions->vkCmdPipelineBarrier(submission.commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                                                0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+
+    // Producers leave their buffers in GENERAL, UNDEFINED would allow the driver to discard the pixels
+    barrier.image = image;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+    barrier.dstQueueFamilyIndex = m_queueFamilyIndex;
+    m_deviceFunctions->vkCmdPipelineBarrier(submission.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                            0, 0, nullptr, 0, nullptr, 1, &barrier);
+    m_deviceFunctions->vkEndCommandBuffer(submission.commandBuffer);
+
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.waitSemaphoreCount = gpuWait ? 1 : 0;
+    submitInfo.pWaitSemaphores = &submission.semaphore;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &submission.commandBuffer;
+
+    m_deviceFunctions->vkResetFences(m_device, 1, &submission.fence);
+    if (m_deviceFunctions->vkQueueSubmit(m_queue, 1, &submitInfo, submission.fence) != VK_SUCCESS) {
+        qWarning() << "Failed to submit a DMA-BUF ownership transfer";
+        return false;
+    }
+
+    if (m_orphaned.image != VK_NULL_HANDLE && m_orphaned.image != image) {
+        retireImages({m_orphaned});
+        m_orphaned = ImportedImage();
+    }
+    m_acquiredImage = image;
+    return true;
+}
+
+/*!
+ * Makes \a semaphore wait for the producer's rendering into the DMA-BUF \a fd.
+ * Without sync file support the CPU waits instead and false is returned.
+ */
+bool VulkanTextureBackend::importImplicitFence(int fd, VkSemaphore semaphore)
+{
+    dma_buf_export_sync_file request = {};
+    request.flags = DMA_BUF_SYNC_READ;
+    request.fd = -1;
+    if (m_importSemaphoreFd && ioctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &request) == 0) {
+        VkImportSemaphoreFdInfoKHR importInfo = {};
+        importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR;
+        importInfo.semaphore = semaphore;
+        importInfo.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT;
+        importInfo.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+        importInfo.fd = request.fd;
+        // On success the driver owns the sync file
+        if (m_importSemaphoreFd(m_device, &importInfo) == VK_SUCCESS)
+            return true;
+        close(request.fd);
+    }
+
+    // A readable DMA-BUF has no pending writes
+    pollfd pfd = {fd, POLLIN, 0};
+    poll(&pfd, 1, int(kWaitTimeoutNs / 1000000));
+    return false;
+}
+
+bool VulkanTextureBackend::importImage(const DmaBufAttributes &attribs, VkFormat format, const QSize &size, ImportedImage *imported)
+{
+    QVector<VkSubresourceLayout> planeLayouts;
+    for (const DmaBufPlane &plane : attribs.planes) {
+        VkSubresourceLayout layout = {};
+        layout.offset = plane.offset;
+        layout.rowPitch = plane.stride;
+        planeLayouts.append(layout);
+    }
+
+    VkImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo = {};
+    modifierInfo.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT;
+    modifierInfo.drmFormatModifier = attribs.modifier;
+    modifierInfo.drmFormatModifierPlaneCount = planeLayouts.size();
+    modifierInfo.pPlaneLayouts = planeLayouts.constData();
+
+    VkExternalMemoryImageCreateInfo externalInfo = {};
+    externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    externalInfo.pNext = &modifierInfo;
+    externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    VkImageCreateInfo imageInfo = {};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.pNext = &externalInfo;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.format = format;
+    imageInfo.extent = {uint32_t(size.width()), uint32_t(size.height()), 1};
+    imageInfo.mipLevels = 1;
+    imageInfo.arrayLayers = 1;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (m_deviceFunctions->vkCreateImage(m_device, &imageInfo, nullptr, &imported->image) != VK_SUCCESS) {
+        qWarning() << "Failed to create a Vulkan image for the DMA-BUF, modifier" << attribs.modifier;
+        return false;
+    }
+
+    const int fd = fcntl(attribs.planes.first().fd, F_DUPFD_CLOEXEC, 3);
+    VkMemoryFdPropertiesKHR fdProperties = {};
+    fdProperties.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR;
+    if (fd < 0 || m_getMemoryFdProperties(m_device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, fd, &fdProperties) != VK_SUCCESS) {
+        qWarning() << "Failed to query the DMA-BUF memory properties";
+        if (fd >= 0)
+            close(fd);
+        destroyImage(*imported);
+        return false;
+    }
+
+    VkMemoryRequirements requirements;
+    m_deviceFunctions->vkGetImageMemoryRequirements(m_device, imported->image, &requirements);
+    const uint32_t memoryTypeBits = requirements.memoryTypeBits & fdProperties.memoryTypeBits;
+    if (!memoryTypeBits) {
+        qWarning() << "No memory type can hold the imported DMA-BUF";
+        close(fd);
+        destroyImage(*imported);
+        return false;
+    }
+
+    VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+    dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicatedInfo.image = imported->image;
+
+    VkImportMemoryFdInfoKHR importInfo = {};
+    importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR;
+    importInfo.pNext = &dedicatedInfo;
+    importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    importInfo.fd = fd;
+
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.pNext = &importInfo;
+    allocateInfo.allocationSize = requirements.size;
+    allocateInfo.memoryTypeIndex = qCountTrailingZeroBits(memoryTypeBits);
+
+    // On success the driver owns the duplicated fd
+    if (m_deviceFunctions->vkAllocateMemory(m_device, &allocateInfo, nullptr, &imported->memory) != VK_SUCCESS) {
+        qWarning() << "Failed to import the DMA-BUF memory";
+        close(fd);
+        destroyImage(*imported);
+        return false;
+    }
+
+    if (m_deviceFunctions->vkBindImageMemory(m_device, imported->image, imported->memory, 0) != VK_SUCCESS) {
+        qWarning() << "Failed to bind the imported DMA-BUF memory";
+        destroyImage(*imported);
+        return false;
+    }
+
+    return true;
+}
+
+void VulkanTextureBackend::destroyImage(const ImportedImage &imported)
+{
+    if (imported.image != VK_NULL_HANDLE)
+        m_deviceFunctions->vkDestroyImage(m_device, imported.image, nullptr);
+    if (imported.memory != VK_NULL_HANDLE)
+        m_deviceFunctions->vkFreeMemory(m_device, imported.memory, nullptr);
+}
+
+/*!
+ * Retires the cached images, together with one that was removed while shown.
+ */
+void VulkanTextureBackend::clearCache()
+{
+    m_acquiredImage = VK_NULL_HANDLE;
+
+    QVector<ImportedImage> images;
+    for (const ImportedImage &imported : qAsConst(m_cache)) {
+        images.append(imported);
+    }
+    if (m_orphaned.image != VK_NULL_HANDLE)
+        images.append(m_orphaned);
+    m_cache.clear();
+    m_orphaned = ImportedImage();
+    retireImages(images);
+}
+
+/*!
+ * Frames already submitted may still sample \a images, so they are destroyed
+ * once the queue got past a fence submitted after those.
+ */
+void VulkanTextureBackend::retireImages(const QVector<ImportedImage> &images)
+{
+    if (images.isEmpty())
+        return;
+
+    RetiredImages retired;
+    retired.images = images;
+
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    if (m_deviceFunctions->vkCreateFence(m_device, &fenceInfo, nullptr, &retired.fence) != VK_SUCCESS
+            || m_deviceFunctions->vkQueueSubmit(m_queue, 0, nullptr, retired.fence) != VK_SUCCESS) {
+        // Without a fence only waiting for the whole queue is safe
+        m_deviceFunctions->vkQueueWaitIdle(m_queue);
+        if (retired.fence != VK_NULL_HANDLE)
+            m_deviceFunctions->vkDestroyFence(m_device, retired.fence, nullptr);
+        for (const ImportedImage &imported : images) {
+            destroyImage(imported);
+        }
+        return;
+    }
+    m_retired.append(retired);
+}
+
+/*!
+ * Destroys retired images the GPU is done with, or all of them when \a wait is set.
+ */
+void VulkanTextureBackend::destroyRetired(bool wait)
+{
+    for (int i = m_retired.size() - 1; i >= 0; --i) {
+        const RetiredImages &retired = m_retired.at(i);
+        if (wait)
+            m_deviceFunctions->vkWaitForFences(m_device, 1, &retired.fence, VK_TRUE, UINT64_MAX);
+        else if (m_deviceFunctions->vkGetFenceStatus(m_device, retired.fence) != VK_SUCCESS)
+            continue;
+
+        for (const ImportedImage &imported : retired.images) {
+            destroyImage(imported);
+        }
+        m_deviceFunctions->vkDestroyFence(m_device, retired.fence, nullptr);
+        m_retired.remove(i);
+    }
+}
+
+#endif // WSM_WALLPAPER_HAS_VULKAN
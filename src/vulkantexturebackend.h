@@ -0,0 +1,104 @@
+#ifndef VULKANTEXTUREBACKEND_H
+#define VULKANTEXTUREBACKEND_H
+
+#include "texturebackend.h"
+
+#include <QtGui/qtguiglobal.h>
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0) && QT_CONFIG(vulkan)
+#define WSM_WALLPAPER_HAS_VULKAN 1
+#else
+#define WSM_WALLPAPER_HAS_VULKAN 0
+#endif
+
+#if WSM_WALLPAPER_HAS_VULKAN
+
+#include <QVulkanInstance>
+
+/*!
+ * \brief Vulkan texture backend for Qt Quick's Vulkan scene graph.
+ *
+ * DMA-BUF frames are imported through VK_EXT_external_memory_dma_buf and
+ * VK_EXT_image_drm_format_modifier into VkImages that are handed to the scene
+ * graph with QSGVulkanTexture::fromNative. Producers recycle their buffers, so
+ * imported images are cached per DMA-BUF until the stream removes the buffer or
+ * renegotiates. Every frame is acquired from the foreign queue family after the
+ * producer's implicit fence, and the frame shown before is released back to it.
+ * CPU frames use the generic QRhi staging-buffer upload.
+ */
+class WSM_WALLPAPER_EXPORT VulkanTextureBackend : public TextureBackend
+{
+public:
+    explicit VulkanTextureBackend(QQuickWindow *window);
+    ~VulkanTextureBackend() override;
+
+    static void configureWindow(QQuickWindow *window);
+
+    bool supportsDmaBuf() const override;
+    QHash<spa_video_format, QVector<uint64_t>> dmaBufModifiers(const QVector<spa_video_format> &formats) const override;
+    QSGTexture *importDmaBuf(QQuickWindow *window, const DmaBufAttributes &attribs, spa_video_format format, const QSize &size) override;
+    void removeDmaBuf(quint64 id) override;
+    void clearDmaBufs() override;
+    void setMaxDmaBufs(int count) override;
+
+private:
+    struct ImportedImage {
+        VkImage image = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+    };
+
+    // Ownership transfers are submitted ahead of the scene graph's frame
+    struct Submission {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        VkSemaphore semaphore = VK_NULL_HANDLE;
+    };
+
+    // Images of a previous negotiation, destroyed once the queue passed the fence
+    struct RetiredImages {
+        QVector<ImportedImage> images;
+        VkFence fence = VK_NULL_HANDLE;
+    };
+
+    bool createSubmissions(QQuickWindow *window);
+    void destroySubmissions();
+    bool importImage(const DmaBufAttributes &attribs, VkFormat format, const QSize &size, ImportedImage *imported);
+    bool acquireImage(VkImage image, int fd);
+    bool importImplicitFence(int fd, VkSemaphore semaphore);
+    void destroyImage(const ImportedImage &imported);
+    void clearCache();
+    void retireImages(const QVector<ImportedImage> &images);
+    void destroyRetired(bool wait);
+
+    QVulkanInstance *m_instance = nullptr;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+    VkDevice m_device = VK_NULL_HANDLE;
+    QVulkanDeviceFunctions *m_deviceFunctions = nullptr;
+    PFN_vkGetMemoryFdPropertiesKHR m_getMemoryFdProperties = nullptr;
+    PFN_vkGetPhysicalDeviceFormatProperties2 m_getFormatProperties2 = nullptr;
+    PFN_vkImportSemaphoreFdKHR m_importSemaphoreFd = nullptr;
+    bool m_hasDmaBufImport = false;
+
+    VkQueue m_queue = VK_NULL_HANDLE;
+    uint32_t m_queueFamilyIndex = 0;
+    VkCommandPool m_commandPool = VK_NULL_HANDLE;
+    static constexpr int submissionCount = 3;
+    Submission m_submissions[submissionCount];
+    int m_nextSubmission = 0;
+    // Owned by the scene graph's queue until the next frame releases it
+    VkImage m_acquiredImage = VK_NULL_HANDLE;
+    QVector<RetiredImages> m_retired;
+
+    // Imported images keyed by the dmaBufId() of their first plane
+    QHash<quint64, ImportedImage> m_cache;
+    int m_maxCached = 0;
+    // Removed from the cache while shown, retired once another image is acquired
+    ImportedImage m_orphaned;
+    uint32_t m_cachedFormat = 0;
+    uint64_t m_cachedModifier = 0;
+    QSize m_cachedSize;
+};
+
+#endif // WSM_WALLPAPER_HAS_VULKAN
+
+#endif // VULKANTEXTUREBACKEND_H
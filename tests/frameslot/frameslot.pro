@@ -0,0 +1,13 @@
+TARGET = tst_frameslot
+QT += testlib gui
+CONFIG += testcase c++17
+
+CONFIG += link_pkgconfig
+PKGCONFIG += egl libdrm libpipewire-0.3 libspa-0.2
+
+WALLPAPER_DIR = $$OUT_PWD/../../src/org/wsm/wallpaper
+INCLUDEPATH += $$PWD/../../src
+LIBS += -L$$WALLPAPER_DIR -lwallpaper
+QMAKE_RPATHDIR += $$WALLPAPER_DIR
+
+SOURCES += tst_frameslot.cpp
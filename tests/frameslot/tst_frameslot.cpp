@@ -0,0 +1,107 @@
+#include "frameslot.h"
+
+#include <QtTest>
+
+static const QRect frameRect(0, 0, 32, 32);
+
+/*!
+ * Returns a copy of \a image with \a rect filled with \a color, and the frame
+ * showing it with \a rect as its damage.
+ */
+static PipeWireFrame paintFrame(QImage *image, const QRect &rect, QRgb color)
+{
+    *image = image->copy();
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image->scanLine(y));
+        std::fill(line + rect.left(), line + rect.right() + 1, color);
+    }
+
+    PipeWireFrame frame = {};
+    frame.sourceRect = frameRect;
+    frame.image = *image;
+    frame.damage.emplace();
+    frame.damage->append(rect);
+    return frame;
+}
+
+/*!
+ * Updates \a screen from \a frame the way the render thread does, only the
+ * damaged part is copied.
+ */
+static void applyFrame(QImage *screen, const PipeWireFrame &frame)
+{
+    if (!frame.damage) {
+        *screen = frame.image->copy();
+        return;
+    }
+
+    for (const QRect &rect : qAsConst(*frame.damage)) {
+        for (int y = rect.top(); y <= rect.bottom(); ++y) {
+            memcpy(screen->scanLine(y) + rect.left() * 4, frame.image->constScanLine(y) + rect.left() * 4, rect.width() * 4);
+        }
+    }
+}
+
+class tst_FrameSlot : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void droppedFrameDamageIsKept();
+    void skippedFrameUpdatesEverything();
+};
+
+void tst_FrameSlot::droppedFrameDamageIsKept()
+{
+    FrameSlot slot;
+    QImage image(frameRect.size(), QImage::Format_RGB32);
+    image.fill(Qt::black);
+    QImage screen = image.copy();
+
+    PipeWireFrame frame;
+    PipeWireFrame previous;
+    PipeWireFrame dropped;
+
+    QVERIFY(!slot.publish(paintFrame(&image, QRect(0, 0, 8, 8), qRgb(255, 0, 0)), &dropped));
+    QVERIFY(slot.take(&frame, &previous));
+    applyFrame(&screen, frame);
+
+    // The render thread misses the second frame, only the third one is taken
+    QVERIFY(!slot.publish(paintFrame(&image, QRect(8, 8, 8, 8), qRgb(0, 255, 0)), &dropped));
+    QVERIFY(slot.publish(paintFrame(&image, QRect(16, 16, 8, 8), qRgb(0, 0, 255)), &dropped));
+    QVERIFY(slot.take(&frame, &previous));
+    applyFrame(&screen, frame);
+
+    QCOMPARE(screen, image);
+}
+
+void tst_FrameSlot::skippedFrameUpdatesEverything()
+{
+    FrameSlot slot;
+    QImage image(frameRect.size(), QImage::Format_RGB32);
+    image.fill(Qt::black);
+    QImage screen = image.copy();
+
+    PipeWireFrame frame;
+    PipeWireFrame previous;
+    PipeWireFrame dropped;
+
+    QVERIFY(!slot.publish(paintFrame(&image, QRect(0, 0, 8, 8), qRgb(255, 0, 0)), &dropped));
+    QVERIFY(slot.take(&frame, &previous));
+    applyFrame(&screen, frame);
+
+    // A frame that is never published, as previews skip them
+    paintFrame(&image, QRect(8, 8, 8, 8), qRgb(0, 255, 0));
+    slot.requestFullUpdate();
+
+    QVERIFY(!slot.publish(paintFrame(&image, QRect(16, 16, 8, 8), qRgb(0, 0, 255)), &dropped));
+    QVERIFY(slot.take(&frame, &previous));
+    QVERIFY(!frame.damage);
+    applyFrame(&screen, frame);
+
+    QCOMPARE(screen, image);
+}
+
+QTEST_GUILESS_MAIN(tst_FrameSlot)
+
+#include "tst_frameslot.moc"
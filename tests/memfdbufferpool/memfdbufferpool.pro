@@ -0,0 +1,10 @@
+TARGET = tst_memfdbufferpool
+QT += testlib gui
+CONFIG += testcase c++17
+
+WALLPAPER_DIR = $$OUT_PWD/../../src/org/wsm/wallpaper
+INCLUDEPATH += $$PWD/../../src
+LIBS += -L$$WALLPAPER_DIR -lwallpaper
+QMAKE_RPATHDIR += $$WALLPAPER_DIR
+
+SOURCES += tst_memfdbufferpool.cpp
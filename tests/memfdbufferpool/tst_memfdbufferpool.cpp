@@ -0,0 +1,141 @@
+#include "memfdbufferpool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <QImage>
+#include <QtTest>
+
+static const int frameWidth = 3840;
+static const int frameHeight = 2160;
+static const int frameStride = frameWidth * 4;
+static const size_t frameSize = size_t(frameStride) * frameHeight;
+
+/*!
+ * \brief A memfd mapped the way producers allocate their buffers, with 4 KiB pages.
+ */
+struct ProducerBuffer
+{
+    ProducerBuffer()
+    {
+        fd = memfd_create("tst-producer-buffer", MFD_CLOEXEC);
+        if (fd < 0 || ftruncate(fd, frameSize) != 0)
+            return;
+        void *map = mmap(nullptr, frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            return;
+        madvise(map, frameSize, MADV_NOHUGEPAGE);
+        data = static_cast<uchar *>(map);
+    }
+
+    ~ProducerBuffer()
+    {
+        if (data)
+            munmap(data, frameSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int fd = -1;
+    uchar *data = nullptr;
+};
+
+class tst_MemFdBufferPool : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void otherSizeKeepsIdleBlocks();
+    void copyFrame_data();
+    void copyFrame();
+    void readColumns_data();
+    void readColumns();
+};
+
+void tst_MemFdBufferPool::otherSizeKeepsIdleBlocks()
+{
+    MemFdBufferPool pool;
+    const MemFdBufferPool::Block block = pool.acquire(frameSize);
+    QVERIFY(block.isValid());
+    pool.release(block);
+
+    // A buffer of another size is added while the stream renegotiates
+    const MemFdBufferPool::Block other = pool.acquire(frameSize / 4);
+    QVERIFY(other.isValid());
+    QCOMPARE(pool.idleCount(), 1);
+
+    const MemFdBufferPool::Block reused = pool.acquire(frameSize);
+    QCOMPARE(reused.fd, block.fd);
+    QCOMPARE(reused.data, block.data);
+
+    pool.release(other);
+    pool.release(reused);
+    pool.clear();
+    QCOMPARE(pool.idleCount(), 0);
+}
+
+void tst_MemFdBufferPool::copyFrame_data()
+{
+    QTest::addColumn<bool>("pooled");
+    QTest::newRow("pool") << true;
+    QTest::newRow("producer") << false;
+}
+
+/*!
+ * Copies a 4K frame out of a buffer line by line, as the stream does for CPU frames.
+ */
+void tst_MemFdBufferPool::copyFrame()
+{
+    QFETCH(bool, pooled);
+
+    MemFdBufferPool pool;
+    const MemFdBufferPool::Block block = pooled ? pool.acquire(frameSize) : MemFdBufferPool::Block();
+    ProducerBuffer producer;
+    const uchar *data = pooled ? block.data : producer.data;
+    QVERIFY(data);
+    memset(const_cast<uchar *>(data), 0x80, frameSize);
+
+    QImage image(frameWidth, frameHeight, QImage::Format_RGB32);
+    QBENCHMARK {
+        for (int y = 0; y < frameHeight; ++y)
+            memcpy(image.scanLine(y), data + y * frameStride, frameWidth * 4);
+    }
+
+    pool.release(block);
+}
+
+void tst_MemFdBufferPool::readColumns_data()
+{
+    copyFrame_data();
+}
+
+/*!
+ * Reads a 4K frame column by column, every pixel touches another page, which
+ * is where small pages cost the most TLB misses.
+ */
+void tst_MemFdBufferPool::readColumns()
+{
+    QFETCH(bool, pooled);
+
+    MemFdBufferPool pool;
+    const MemFdBufferPool::Block block = pooled ? pool.acquire(frameSize) : MemFdBufferPool::Block();
+    ProducerBuffer producer;
+    const uchar *data = pooled ? block.data : producer.data;
+    QVERIFY(data);
+    memset(const_cast<uchar *>(data), 0x80, frameSize);
+
+    quint32 sum = 0;
+    QBENCHMARK {
+        for (int x = 0; x < frameWidth; x += 16) {
+            for (int y = 0; y < frameHeight; ++y)
+                sum += reinterpret_cast<const quint32 *>(data + y * frameStride)[x];
+        }
+    }
+    QVERIFY(sum);
+
+    pool.release(block);
+}
+
+QTEST_GUILESS_MAIN(tst_MemFdBufferPool)
+
+#include "tst_memfdbufferpool.moc"
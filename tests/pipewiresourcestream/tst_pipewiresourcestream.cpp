@@ -0,0 +1,311 @@
+#include "pipewiresourcestream.h"
+#include "private/pipewiresourcestream_p.h"
+
+#include <pipewire/stream.h>
+#include <spa/buffer/buffer.h>
+#include <spa/buffer/meta.h>
+
+#include <QtTest>
+
+#include <atomic>
+
+// The UNIX event dispatcher polls the copy thread's eventfd without allocating,
+// unlike glib's, which allocates for its own bookkeeping
+static void useUnixEventDispatcher()
+{
+    qputenv("QT_NO_GLIB", "1");
+}
+Q_CONSTRUCTOR_FUNCTION(useUnixEventDispatcher)
+
+// Every heap allocation, Qt's containers included, goes through these
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static std::atomic<bool> countAllocations(false);
+static std::atomic<int> allocations(0);
+
+extern "C" void *malloc(size_t size)
+{
+    if (countAllocations)
+        ++allocations;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    if (countAllocations)
+        ++allocations;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    if (countAllocations)
+        ++allocations;
+    return __libc_realloc(ptr, size);
+}
+
+static const int frameWidth = 64;
+static const int frameHeight = 48;
+static const int frameStride = frameWidth * 4;
+
+/*!
+ * \brief A buffer as PipeWire hands it out, with header and damage metadata.
+ */
+struct SyntheticBuffer
+{
+    explicit SyntheticBuffer(spa_data_type type)
+        : pixels(frameStride * frameHeight, char(0x80))
+    {
+        header.pts = 0;
+        header.seq = 0;
+        damage[0].region = {{8, 8}, {16, 16}};
+        // Position only, the bitmap only comes with shape changes
+        cursor.id = 1;
+        cursor.position = {4, 4};
+
+        metas[0] = {SPA_META_Header, sizeof(header), &header};
+        metas[1] = {SPA_META_VideoDamage, sizeof(damage), damage};
+        metas[2] = {SPA_META_Cursor, sizeof(cursor), &cursor};
+
+        chunk.offset = 0;
+        chunk.size = pixels.size();
+        chunk.stride = frameStride;
+
+        data.type = type;
+        data.maxsize = pixels.size();
+        data.fd = -1;
+        data.data = type == SPA_DATA_MemPtr ? pixels.data() : nullptr;
+        data.chunk = &chunk;
+
+        spaBuffer.n_metas = 3;
+        spaBuffer.metas = metas;
+        spaBuffer.n_datas = 1;
+        spaBuffer.datas = &data;
+        buffer.buffer = &spaBuffer;
+    }
+
+    void next()
+    {
+        header.pts += 16666667;
+        ++header.seq;
+        cursor.position.x = (cursor.position.x + 1) % frameWidth;
+    }
+
+    QByteArray pixels;
+    spa_meta_header header = {};
+    spa_meta_region damage[2] = {};
+    spa_meta_cursor cursor = {};
+    spa_meta metas[3];
+    spa_chunk chunk = {};
+    spa_data data = {};
+    spa_buffer spaBuffer = {};
+    pw_buffer buffer = {};
+};
+
+class tst_PipewireSourceStream : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void cpuFramesDoNotAllocate();
+    void cursorFramesDoNotAllocate();
+    void downscaledFramesDoNotAllocate();
+    void dmaBufFramesDoNotAllocate();
+
+private:
+    static void configure(PipewireSourceStream *stream);
+    static void drainReleasedBuffers(PipewireSourceStream *stream);
+    static bool waitForFrames(const int *received, int count);
+};
+
+void tst_PipewireSourceStream::configure(PipewireSourceStream *stream)
+{
+    auto d = static_cast<PipewireSourceStreamPrivate *>(QObjectPrivate::get(stream));
+    d->videoFormat.format = SPA_VIDEO_FORMAT_BGRx;
+    d->videoFormat.size = {frameWidth, frameHeight};
+    stream->setDamageEnabled(true);
+}
+
+/*!
+ * Forgets the buffers the consumer released, which the stream's loop would
+ * queue back to the producer.
+ */
+void tst_PipewireSourceStream::drainReleasedBuffers(PipewireSourceStream *stream)
+{
+    auto d = static_cast<PipewireSourceStreamPrivate *>(QObjectPrivate::get(stream));
+    QMutexLocker locker(&d->releaseMutex);
+    for (pw_buffer *buffer : qAsConst(d->releasedBuffers)) {
+        const int index = d->heldBuffers.indexOf(buffer);
+        if (index >= 0) {
+            d->heldBuffers.remove(index);
+            d->heldSince.remove(index);
+        }
+    }
+    d->releasedBuffers.clear();
+}
+
+/*!
+ * Runs the event loop until the copy thread delivered \a count frames.
+ */
+bool tst_PipewireSourceStream::waitForFrames(const int *received, int count)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (*received < count && timer.elapsed() < 5000)
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 100);
+    return *received >= count;
+}
+
+void tst_PipewireSourceStream::cpuFramesDoNotAllocate()
+{
+    PipewireSourceStream stream;
+    configure(&stream);
+    SyntheticBuffer buffer(SPA_DATA_MemPtr);
+
+    int received = 0;
+    int withImage = 0;
+    int withDamage = 0;
+    connect(&stream, &PipewireSourceStream::frameReceived, this, [&](const PipeWireFrame &frame) {
+        ++received;
+        if (frame.image && frame.image->size() == QSize(frameWidth, frameHeight))
+            ++withImage;
+        if (frame.damage && frame.damage->size() == 1)
+            ++withDamage;
+    });
+
+    // Fills the stream's image pool
+    for (int i = 0; i < 4; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+    }
+
+    allocations = 0;
+    countAllocations = true;
+    for (int i = 0; i < 100; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+    }
+    countAllocations = false;
+
+    QCOMPARE(allocations.load(), 0);
+    QCOMPARE(received, 104);
+    QCOMPARE(withImage, 104);
+    QCOMPARE(withDamage, 104);
+}
+
+void tst_PipewireSourceStream::cursorFramesDoNotAllocate()
+{
+    PipewireSourceStream stream;
+    configure(&stream);
+    stream.setCursorEnabled(true);
+    SyntheticBuffer buffer(SPA_DATA_MemPtr);
+
+    int received = 0;
+    int withCursor = 0;
+    connect(&stream, &PipewireSourceStream::frameReceived, this, [&](const PipeWireFrame &frame) {
+        ++received;
+        if (frame.cursor && frame.cursor->position.y() == 4 && frame.cursor->texture.isNull())
+            ++withCursor;
+    });
+
+    for (int i = 0; i < 4; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+    }
+
+    allocations = 0;
+    countAllocations = true;
+    for (int i = 0; i < 100; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+    }
+    countAllocations = false;
+
+    QCOMPARE(allocations.load(), 0);
+    QCOMPARE(received, 104);
+    QCOMPARE(withCursor, 104);
+}
+
+/*!
+ * Downscaled frames are copied on the stream's copy thread, which hands them
+ * back to this thread through the event loop.
+ */
+void tst_PipewireSourceStream::downscaledFramesDoNotAllocate()
+{
+    PipewireSourceStream stream;
+    configure(&stream);
+    stream.setCursorEnabled(true);
+    stream.setDownscaleSize(QSize(frameWidth / 2, frameHeight / 2));
+    SyntheticBuffer buffer(SPA_DATA_MemPtr);
+
+    int received = 0;
+    int downscaled = 0;
+    int withCursor = 0;
+    connect(&stream, &PipewireSourceStream::frameReceived, this, [&](const PipeWireFrame &frame) {
+        ++received;
+        if (frame.image && frame.image->size() == QSize(frameWidth / 2, frameHeight / 2) && !frame.buffer)
+            ++downscaled;
+        if (frame.cursor)
+            ++withCursor;
+    });
+
+    // Starts the copy thread and fills the image pool and the scaler's tables
+    for (int i = 0; i < 4; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+        QVERIFY(waitForFrames(&received, i + 1));
+        drainReleasedBuffers(&stream);
+    }
+
+    allocations = 0;
+    countAllocations = true;
+    for (int i = 0; i < 100; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+        if (!waitForFrames(&received, 5 + i))
+            break;
+        drainReleasedBuffers(&stream);
+    }
+    countAllocations = false;
+
+    QCOMPARE(received, 104);
+    QCOMPARE(allocations.load(), 0);
+    QCOMPARE(downscaled, 104);
+    QCOMPARE(withCursor, 104);
+}
+
+void tst_PipewireSourceStream::dmaBufFramesDoNotAllocate()
+{
+    PipewireSourceStream stream;
+    configure(&stream);
+    SyntheticBuffer buffer(SPA_DATA_DmaBuf);
+
+    int received = 0;
+    int withPlane = 0;
+    connect(&stream, &PipewireSourceStream::frameReceived, this, [&](const PipeWireFrame &frame) {
+        ++received;
+        if (frame.dmabuf && frame.dmabuf->planes.size() == 1 && frame.dmabuf->planes.first().stride == uint32_t(frameStride))
+            ++withPlane;
+    });
+
+    buffer.next();
+    stream.handleFrame(&buffer.buffer);
+
+    allocations = 0;
+    countAllocations = true;
+    for (int i = 0; i < 100; ++i) {
+        buffer.next();
+        stream.handleFrame(&buffer.buffer);
+    }
+    countAllocations = false;
+
+    QCOMPARE(allocations.load(), 0);
+    QCOMPARE(received, 101);
+    QCOMPARE(withPlane, 101);
+}
+
+QTEST_GUILESS_MAIN(tst_PipewireSourceStream)
+
+#include "tst_pipewiresourcestream.moc"
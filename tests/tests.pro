@@ -0,0 +1,5 @@
+TEMPLATE = subdirs
+SUBDIRS += \
+         frameslot \
+         memfdbufferpool \
+         pipewiresourcestream \
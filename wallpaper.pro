@@ -3,8 +3,10 @@ CONFIG += ordered
 SUBDIRS +=\
          src \
          example \
+         tests \
 
 OTHER_FILES += \
     README.md
 
 examples.depends = src
+tests.depends = src